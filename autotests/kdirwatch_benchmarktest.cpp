@@ -60,6 +60,7 @@ private Q_SLOTS: // test methods
     void benchCreateTree();
     void benchCreateWatcher();
     void benchNotifyWatcher();
+    void benchWatchManyFiles();
 
 private:
     QTemporaryDir m_tempDir;
@@ -116,4 +117,30 @@ void KDirWatch_UnitTest::benchNotifyWatcher()
     }
 }
 
+void KDirWatch_UnitTest::benchWatchManyFiles()
+{
+#if !ENABLE_BENCHMARKS
+    QSKIP("Benchmarks are disabled in debug mode");
+#endif
+    QTemporaryDir dir;
+
+    // Files which don't exist yet are all waited for by the entry of their directory
+    const int fileCount = 10000;
+    QStringList files;
+    files.reserve(fileCount);
+    for (int i = 0; i < fileCount; ++i) {
+        files.append(dir.path() + QLatin1String("/missing_") + QString::number(i));
+    }
+
+    QBENCHMARK {
+        KDirWatch watch;
+        for (const QString &file : std::as_const(files)) {
+            watch.addFile(file);
+        }
+        for (const QString &file : std::as_const(files)) {
+            watch.removeFile(file);
+        }
+    }
+}
+
 #include "kdirwatch_benchmarktest.moc"
@@ -53,6 +53,8 @@ static const char *methodToString(KDirWatch::Method method)
         return "Stat";
     case KDirWatch::QFSWatch:
         return "QFSWatch";
+    case KDirWatch::FANotify:
+        return "FANotify";
     }
     return "ERROR!";
 }
@@ -64,10 +64,13 @@ private Q_SLOTS: // test methods
     }
     void touchOneFile();
     void touch1000Files();
+    void batchedChanges();
     void watchAndModifyOneFile();
     void removeAndReAdd();
     void watchNonExistent();
     void watchNonExistentWithSingleton();
+    void watchSubDirs();
+    void watchFromTwoThreads();
     void testDelete();
     void testDeleteAndRecreateFile();
     void testDeleteAndRecreateDir();
@@ -97,6 +100,11 @@ private:
     void removeFile(int num);
     void appendToFile(const QString &path);
     void appendToFile(int num);
+    // fanotify only replaces inotify for recursive watches
+    static bool usesINotify(const KDirWatch &watch)
+    {
+        return watch.internalMethod() == KDirWatch::INotify || watch.internalMethod() == KDirWatch::FANotify;
+    }
 
     QTemporaryDir m_tempDir;
     QString m_path;
@@ -286,7 +294,7 @@ void KDirWatch_UnitTest::touch1000Files()
     }
 
     QList<QVariantList> spy = waitForDirtySignal(watch, fileCount);
-    if (watch.internalMethod() == KDirWatch::INotify) {
+    if (usesINotify(watch)) {
         QVERIFY(spy.count() >= fileCount);
     } else {
         // More stupid backends just see one mtime change on the directory
@@ -298,6 +306,39 @@ void KDirWatch_UnitTest::touch1000Files()
     }
 }
 
+void KDirWatch_UnitTest::batchedChanges()
+{
+    KDirWatch watch;
+    watch.addDir(m_path);
+    watch.setBatchInterval(200);
+    QCOMPARE(watch.batchInterval(), 200);
+    watch.startScan();
+
+    waitUntilMTimeChange(m_path);
+
+    QSignalSpy spyDirty(&watch, &KDirWatch::dirty);
+    QSignalSpy spyBatched(&watch, &KDirWatch::changesBatched);
+    createFile(0);
+    createFile(1);
+    QVERIFY(spyBatched.wait(50 * s_maxTries));
+
+    // Every path is reported once per batch, with all its changes
+    const auto changes = spyBatched.at(0).at(0).value<QList<QPair<QString, KDirWatch::ChangeTypes>>>();
+    QStringList paths;
+    for (const auto &change : changes) {
+        paths.append(change.first);
+    }
+    QVERIFY(paths.contains(removeTrailingSlash(m_path)));
+    QCOMPARE(paths.removeDuplicates(), 0);
+    QCOMPARE(spyDirty.count(), 0);
+
+    watch.setBatchInterval(0);
+    QCOMPARE(watch.batchInterval(), 0);
+
+    removeFile(0);
+    removeFile(1);
+}
+
 void KDirWatch_UnitTest::watchAndModifyOneFile() // watch a specific file, and modify it
 {
     KDirWatch watch;
@@ -318,7 +359,7 @@ void KDirWatch_UnitTest::removeAndReAdd()
     // This triggers bug #374075.
     watch.addDir(QStringLiteral(":/kio5/newfile-templates"));
     watch.startScan();
-    if (watch.internalMethod() != KDirWatch::INotify) {
+    if (!usesINotify(watch)) {
         waitUntilNewSecond(); // necessary for mtime checks in scanEntry
     }
     createFile(0);
@@ -327,7 +368,7 @@ void KDirWatch_UnitTest::removeAndReAdd()
     // Just like KDirLister does: remove the watch, then re-add it.
     watch.removeDir(m_path);
     watch.addDir(m_path);
-    if (watch.internalMethod() != KDirWatch::INotify) {
+    if (!usesINotify(watch)) {
         waitUntilMTimeChange(m_path); // necessary for QFSWatcher
     }
     createFile(1);
@@ -399,6 +440,89 @@ void KDirWatch_UnitTest::watchNonExistentWithSingleton()
     // once QCoreApp was gone, this is what this test is about.
 }
 
+void KDirWatch_UnitTest::watchSubDirs()
+{
+    const QString dir = m_path + QLatin1String("recursive");
+    const QString subdir = dir + QLatin1String("/subdir");
+    QVERIFY(QDir().mkpath(subdir));
+
+    {
+        KDirWatch watch;
+        watch.addDir(dir, KDirWatch::WatchSubDirs | KDirWatch::WatchFiles);
+#if HAVE_FANOTIFY
+        if (qstrcmp(KDIRWATCH_TEST_METHOD, "FANotify") == 0 && watch.internalMethod() != KDirWatch::FANotify) {
+            // useFANotify() falls back to inotify when marking the filesystem fails with EPERM
+            QVERIFY(!watch.d->supports_fanotify);
+            QVERIFY(QDir(dir).removeRecursively());
+            QSKIP("Marking a filesystem with fanotify needs CAP_SYS_ADMIN, the FANotify backend is not tested");
+        }
+#endif
+        watch.startScan();
+        waitUntilMTimeChange(subdir);
+
+        // Every backend notices the change of a subdirectory
+        createFile(subdir + QLatin1String("/file"));
+        QVERIFY(waitForOneSignal(watch, SIGNAL(dirty(QString)), subdir));
+
+        if (usesINotify(watch)) {
+            // New subdirectories are watched as well
+            const QString nested = subdir + QLatin1String("/nested");
+            QVERIFY(QDir().mkdir(nested));
+            QVERIFY(waitForOneSignal(watch, SIGNAL(created(QString)), nested));
+
+            const QString nestedFile = nested + QLatin1String("/file");
+            createFile(nestedFile);
+            QVERIFY(waitForOneSignal(watch, SIGNAL(created(QString)), nestedFile));
+        }
+    }
+
+    QVERIFY(QDir(dir).removeRecursively());
+}
+
+void KDirWatch_UnitTest::watchFromTwoThreads()
+{
+    QThread thread;
+    thread.start();
+    QObject context;
+    context.moveToThread(&thread);
+
+    QAtomicInt threadDirty;
+    KDirWatch *threadWatch = nullptr;
+    QMetaObject::invokeMethod(
+        &context,
+        [&] {
+            threadWatch = new KDirWatch;
+            connect(threadWatch, &KDirWatch::dirty, threadWatch, [&] {
+                threadDirty.ref();
+            });
+            threadWatch->addDir(m_path);
+        },
+        Qt::BlockingQueuedConnection);
+
+    KDirWatch watch;
+    watch.addDir(m_path);
+    waitUntilMTimeChange(m_path);
+
+    // Both threads see the change of the directory
+    createFile(0);
+    QVERIFY(waitForOneSignal(watch, SIGNAL(dirty(QString)), m_path));
+    QTRY_VERIFY(threadDirty.loadRelaxed() > 0);
+
+    // and the watch outlives the thread which stopped watching
+    QMetaObject::invokeMethod(
+        &context,
+        [&] {
+            delete threadWatch;
+        },
+        Qt::BlockingQueuedConnection);
+    thread.quit();
+    thread.wait();
+
+    waitUntilMTimeChange(m_path);
+    removeFile(0);
+    QVERIFY(waitForOneSignal(watch, SIGNAL(dirty(QString)), m_path));
+}
+
 void KDirWatch_UnitTest::testDelete()
 {
     const QString file1 = m_path + QLatin1String("del");
@@ -539,7 +663,7 @@ void KDirWatch_UnitTest::testMoveTo()
     watch.addFile(file1);
     watch.startScan();
 
-    if (watch.internalMethod() != KDirWatch::INotify) {
+    if (!usesINotify(watch)) {
         waitUntilMTimeChange(m_path);
     }
 
@@ -556,7 +680,7 @@ void KDirWatch_UnitTest::testMoveTo()
     QVERIFY(waitForOneSignal(watch, SIGNAL(dirty(QString)), m_path));
 
     // Getting created() on an unwatched file is an inotify bonus, it's not part of the requirements.
-    if (watch.internalMethod() == KDirWatch::INotify) {
+    if (usesINotify(watch)) {
         QCOMPARE(spyCreated.count(), 1);
         QCOMPARE(spyCreated[0][0].toString(), file1);
 
@@ -721,7 +845,7 @@ void KDirWatch_UnitTest::testRelativeRefcounting()
     // its entries with it regardless of whether the entry was well-formed
     KDirWatch watch0;
 
-    if (watch0.internalMethod() != KDirWatch::INotify && watch0.internalMethod() != KDirWatch::QFSWatch) {
+    if (!usesINotify(watch0) && watch0.internalMethod() != KDirWatch::QFSWatch) {
         // Only test on inotify & QFileSystemWatcher. Otherwise Entry count expectations may diverge.
         return;
     }
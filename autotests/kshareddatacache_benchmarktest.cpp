@@ -0,0 +1,365 @@
+/*
+    This file is part of the KDE libraries
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: LGPL-2.0-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+*/
+
+#include <kshareddatacache.h>
+
+#include <QByteArray>
+#include <QDebug>
+#include <QList>
+#include <QStandardPaths>
+#include <QString>
+#include <QStringList>
+#include <QTest>
+#include <QThread>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#ifdef Q_OS_UNIX
+#include <errno.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "config-tests.h"
+
+// Runs a number of processes against one cache at the same time, to measure
+// how the cache behaves under contention. Half of the processes only look up
+// entries, the others insert and remove entries. Every process picks its keys
+// from a Zipfian distribution, where a skew of 0 means every key is equally
+// likely, and larger skews concentrate the requests on fewer keys.
+//
+// The number of processes defaults to the number of cores, and can be changed
+// by setting KSDC_BENCHMARK_PROCESSES.
+
+namespace
+{
+enum Operation {
+    Find,
+    Insert,
+    Remove,
+    OperationCount,
+};
+
+constexpr int keyCount = 10000;
+constexpr int operationsPerProcess = 20000;
+constexpr unsigned cacheSize = 8 * 1024 * 1024;
+
+// What each process reports back to the benchmark through a pipe, followed
+// by the latency of every operation in nanoseconds, grouped by operation.
+struct ProcessResult {
+    qint64 elapsed = 0;
+    qint64 hits = 0;
+    qint64 counts[OperationCount] = {};
+};
+
+// Picks a key index in [0, n) with probability proportional to 1 / (rank + 1)^skew.
+class ZipfianDistribution
+{
+public:
+    ZipfianDistribution(int n, double skew)
+    {
+        m_cdf.reserve(n);
+        double sum = 0;
+        for (int i = 0; i < n; ++i) {
+            sum += 1.0 / std::pow(i + 1, skew);
+            m_cdf.push_back(sum);
+        }
+        for (double &value : m_cdf) {
+            value /= sum;
+        }
+    }
+
+    template<typename Generator>
+    int operator()(Generator &generator) const
+    {
+        const double value = std::uniform_real_distribution<double>(0.0, 1.0)(generator);
+        const auto it = std::lower_bound(m_cdf.begin(), m_cdf.end(), value);
+        return std::min<int>(it - m_cdf.begin(), m_cdf.size() - 1);
+    }
+
+private:
+    std::vector<double> m_cdf;
+};
+
+#ifdef Q_OS_UNIX
+bool readAll(int fd, void *buffer, size_t size)
+{
+    auto data = static_cast<char *>(buffer);
+    while (size > 0) {
+        const ssize_t count = ::read(fd, data, size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+bool writeAll(int fd, const void *buffer, size_t size)
+{
+    auto data = static_cast<const char *>(buffer);
+    while (size > 0) {
+        const ssize_t count = ::write(fd, data, size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+// The body of every forked process. Returns the exit code of the process.
+int runProcess(const QString &cacheName,
+               const QStringList &keys,
+               const QByteArray &value,
+               double skew,
+               bool isWriter,
+               unsigned seed,
+               int startFd,
+               int resultFd)
+{
+    using Clock = std::chrono::steady_clock;
+
+    KSharedDataCache cache(cacheName, cacheSize);
+    const ZipfianDistribution keyDistribution(keys.size(), skew);
+    std::mt19937 generator(seed);
+    std::uniform_int_distribution<int> operationDistribution(0, 9);
+
+    ProcessResult result;
+    std::vector<qint64> latencies[OperationCount];
+    for (auto &operationLatencies : latencies) {
+        operationLatencies.reserve(operationsPerProcess);
+    }
+
+    // Wait until every process is ready, so that they all run at the same time.
+    char start;
+    if (!readAll(startFd, &start, 1)) {
+        return 1;
+    }
+
+    const auto begin = Clock::now();
+    for (int i = 0; i < operationsPerProcess; ++i) {
+        const QString &key = keys.at(keyDistribution(generator));
+
+        // Writers remove every tenth entry they pick, and insert the others.
+        const Operation operation = !isWriter ? Find : operationDistribution(generator) == 0 ? Remove : Insert;
+
+        const auto operationBegin = Clock::now();
+        switch (operation) {
+        case Find: {
+            QByteArray data;
+            if (cache.find(key, &data)) {
+                ++result.hits;
+            }
+            break;
+        }
+        case Insert:
+            cache.insert(key, value);
+            break;
+        case Remove:
+            cache.remove(key);
+            break;
+        case OperationCount:
+            break;
+        }
+        latencies[operation].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - operationBegin).count());
+    }
+    result.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count();
+
+    for (int operation = 0; operation < OperationCount; ++operation) {
+        result.counts[operation] = latencies[operation].size();
+    }
+
+    if (!writeAll(resultFd, &result, sizeof(result))) {
+        return 1;
+    }
+    for (const auto &operationLatencies : latencies) {
+        if (!writeAll(resultFd, operationLatencies.data(), operationLatencies.size() * sizeof(qint64))) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+qint64 percentile(const std::vector<qint64> &sortedValues, double fraction)
+{
+    if (sortedValues.empty()) {
+        return 0;
+    }
+    return sortedValues[qRound64(fraction * (sortedValues.size() - 1))];
+}
+}
+
+class KSharedDataCacheBenchmarkTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void benchContention_data();
+    void benchContention();
+};
+
+void KSharedDataCacheBenchmarkTest::initTestCase()
+{
+    QStandardPaths::setTestModeEnabled(true);
+}
+
+void KSharedDataCacheBenchmarkTest::benchContention_data()
+{
+    QTest::addColumn<int>("itemSize");
+    QTest::addColumn<double>("skew");
+    QTest::addColumn<int>("evictionPolicy");
+
+    const struct {
+        const char *name;
+        KSharedDataCache::EvictionPolicy policy;
+    } policies[] = {
+        {"default", KSharedDataCache::NoEvictionPreference},
+        {"lru", KSharedDataCache::EvictLeastRecentlyUsed},
+        {"lfu", KSharedDataCache::EvictLeastOftenUsed},
+        {"oldest", KSharedDataCache::EvictOldest},
+        {"admission-filter", KSharedDataCache::EvictWithAdmissionFilter},
+    };
+
+    for (int itemSize : {64, 4096, 65536}) {
+        for (double skew : {0.0, 0.99}) {
+            for (const auto &policy : policies) {
+                QTest::addRow("%d bytes, skew %.2f, %s", itemSize, skew, policy.name) << itemSize << skew << int(policy.policy);
+            }
+        }
+    }
+}
+
+void KSharedDataCacheBenchmarkTest::benchContention()
+{
+#if !ENABLE_BENCHMARKS
+    QSKIP("Benchmarks are disabled in debug mode");
+#endif
+#ifndef Q_OS_UNIX
+    QSKIP("This benchmark needs fork()");
+#else
+    QFETCH(int, itemSize);
+    QFETCH(double, skew);
+    QFETCH(int, evictionPolicy);
+
+    bool ok = false;
+    int processCount = qEnvironmentVariableIntValue("KSDC_BENCHMARK_PROCESSES", &ok);
+    if (!ok || processCount < 2) {
+        processCount = std::max(2, QThread::idealThreadCount());
+    }
+    const int writerCount = processCount / 2;
+
+    const QString cacheName = QStringLiteral("kshareddatacache-benchmark");
+    KSharedDataCache::deleteCache(cacheName);
+
+    QStringList keys;
+    keys.reserve(keyCount);
+    for (int i = 0; i < keyCount; ++i) {
+        keys.append(QStringLiteral("key-%1").arg(i));
+    }
+    const QByteArray value(itemSize, 'x');
+
+    // Start out with a full cache, so that the writers have to evict entries.
+    {
+        KSharedDataCache cache(cacheName, cacheSize);
+        cache.setEvictionPolicy(KSharedDataCache::EvictionPolicy(evictionPolicy));
+        for (const QString &key : std::as_const(keys)) {
+            cache.insert(key, value);
+        }
+    }
+
+    int startPipe[2];
+    QVERIFY(::pipe(startPipe) == 0);
+
+    struct Process {
+        pid_t pid;
+        int resultFd;
+    };
+    std::vector<Process> processes;
+    for (int i = 0; i < processCount; ++i) {
+        int resultPipe[2];
+        QVERIFY(::pipe(resultPipe) == 0);
+
+        const pid_t pid = ::fork();
+        QVERIFY(pid >= 0);
+        if (pid == 0) {
+            ::close(startPipe[1]);
+            ::close(resultPipe[0]);
+            ::_exit(runProcess(cacheName, keys, value, skew, i < writerCount, i + 1, startPipe[0], resultPipe[1]));
+        }
+
+        ::close(resultPipe[1]);
+        processes.push_back({pid, resultPipe[0]});
+    }
+
+    // Let every process start at once.
+    ::close(startPipe[0]);
+    const QByteArray start(processCount, 's');
+    QVERIFY(writeAll(startPipe[1], start.constData(), start.size()));
+    ::close(startPipe[1]);
+
+    // Readers and writers take different amounts of time, so the throughput of
+    // each operation is measured over the processes doing it.
+    qint64 elapsed[OperationCount] = {};
+    qint64 hits = 0;
+    std::vector<qint64> latencies[OperationCount];
+    for (const Process &process : processes) {
+        ProcessResult result;
+        QVERIFY(readAll(process.resultFd, &result, sizeof(result)));
+        for (int operation = 0; operation < OperationCount; ++operation) {
+            auto &operationLatencies = latencies[operation];
+            const size_t offset = operationLatencies.size();
+            operationLatencies.resize(offset + result.counts[operation]);
+            QVERIFY(readAll(process.resultFd, operationLatencies.data() + offset, result.counts[operation] * sizeof(qint64)));
+            if (result.counts[operation] > 0) {
+                elapsed[operation] = std::max(elapsed[operation], result.elapsed);
+            }
+        }
+        ::close(process.resultFd);
+
+        int status = 0;
+        QCOMPARE(::waitpid(process.pid, &status, 0), process.pid);
+        QVERIFY(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+        hits += result.hits;
+    }
+
+    static const char *const operationNames[OperationCount] = {"find", "insert", "remove"};
+    for (int operation = 0; operation < OperationCount; ++operation) {
+        const double seconds = std::max<qint64>(elapsed[operation], 1) / 1e9;
+        auto &operationLatencies = latencies[operation];
+        std::sort(operationLatencies.begin(), operationLatencies.end());
+
+        qInfo().nospace().noquote() << operationNames[operation] << ": " << qRound64(operationLatencies.size() / seconds)
+                                    << " ops/s, p50 " << percentile(operationLatencies, 0.5) << " ns, p99 " << percentile(operationLatencies, 0.99)
+                                    << " ns";
+    }
+    if (!latencies[Find].empty()) {
+        qInfo().nospace() << "hit rate: " << 100.0 * hits / latencies[Find].size() << "%";
+    }
+
+    KSharedDataCache::deleteCache(cacheName);
+#endif
+}
+
+QTEST_GUILESS_MAIN(KSharedDataCacheBenchmarkTest)
+
+#include "kshareddatacache_benchmarktest.moc"
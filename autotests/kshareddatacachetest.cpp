@@ -6,13 +6,29 @@
 */
 
 #include <kshareddatacache.h>
+#include <kshareddatacachet.h>
 
 #include <QTest>
 
+#include <QElapsedTimer>
+#include <QFuture>
+#include <QHash>
 #include <QObject>
 #include <QStandardPaths>
 #include <QString>
+#include <QStringList>
+#include <QTemporaryDir>
+#include <QThread>
+
+#include <atomic>
+#include <memory>
 #include <string.h> // strcpy
+#include <vector>
+
+#ifdef Q_OS_UNIX
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 class KSharedDataCacheTest : public QObject
 {
@@ -22,6 +38,23 @@ private Q_SLOTS:
     void initTestCase();
     void simpleInsert();
     void remove();
+    void concurrentFind();
+    void concurrentInsert();
+    void batchInsertAndFind();
+    void pinnedData();
+    void highIndexLoad();
+    void limitedDefragmentation();
+    void admissionFilter();
+    void statisticsCounters();
+    void compression();
+    void typedCache();
+    void mappingOptions();
+    void robustLocks();
+    void expiry();
+    void invalidateTag();
+    void insertAsync();
+    void resize();
+    void snapshot();
 };
 
 void KSharedDataCacheTest::initTestCase()
@@ -91,6 +124,836 @@ void KSharedDataCacheTest::remove()
     QVERIFY(!cache.contains(QStringLiteral("foo")));
 }
 
+void KSharedDataCacheTest::concurrentFind()
+{
+    const QLatin1String cacheName("concurrentFind");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    // Each payload repeats a single byte, and its size depends on the key, so
+    // that reading an entry while it is being overwritten is easy to spot.
+    const int keyCount = 50;
+    const auto keyName = [](int key) {
+        return QStringLiteral("key%1").arg(key);
+    };
+    const auto payload = [](int key, int round) {
+        return QByteArray(1000 + key * 10, char('a' + (key + round) % 26));
+    };
+
+    KSharedDataCache writerCache(cacheName, 1024 * 1024);
+    KSharedDataCache readerCache(cacheName, 1024 * 1024);
+    for (int key = 0; key < keyCount; ++key) {
+        QVERIFY(writerCache.insert(keyName(key), payload(key, 0)));
+    }
+
+    std::atomic_bool done = false;
+    std::unique_ptr<QThread> writer(QThread::create([&]() {
+        for (int round = 1; round < 100; ++round) {
+            for (int key = 0; key < keyCount; ++key) {
+                writerCache.insert(keyName(key), payload(key, round));
+            }
+        }
+        done = true;
+    }));
+    writer->start();
+
+    int corrupted = 0;
+    while (!done) {
+        for (int key = 0; key < keyCount; ++key) {
+            QByteArray result;
+            if (!readerCache.find(keyName(key), &result)) {
+                continue;
+            }
+
+            if (result.size() != payload(key, 0).size() || result != QByteArray(result.size(), result.at(0))) {
+                ++corrupted;
+            }
+        }
+    }
+
+    QVERIFY(writer->wait());
+    QCOMPARE(corrupted, 0);
+}
+
+void KSharedDataCacheTest::concurrentInsert()
+{
+    const QLatin1String cacheName("concurrentInsert");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    // Large enough to be split into several independently locked shards, and
+    // to hold everything inserted below.
+    const unsigned cacheSize = 8 * 1024 * 1024;
+    const int threadCount = 4;
+    const int keyCount = 100;
+    const auto keyName = [](int thread, int key) {
+        return QStringLiteral("thread%1-key%2").arg(thread).arg(key);
+    };
+    const auto payload = [](int thread, int key) {
+        return QByteArray(500 + key * 20, char('a' + thread));
+    };
+
+    std::atomic_int failures = 0;
+    std::vector<std::unique_ptr<QThread>> writers;
+    for (int thread = 0; thread < threadCount; ++thread) {
+        writers.emplace_back(QThread::create([&, thread]() {
+            KSharedDataCache cache(cacheName, cacheSize);
+            for (int key = 0; key < keyCount; ++key) {
+                QByteArray result;
+                if (!cache.insert(keyName(thread, key), payload(thread, key)) || !cache.find(keyName(thread, key), &result)
+                    || result != payload(thread, key)) {
+                    ++failures;
+                }
+            }
+        }));
+        writers.back()->start();
+    }
+
+    for (const auto &writer : writers) {
+        QVERIFY(writer->wait());
+    }
+    QCOMPARE(failures.load(), 0);
+
+#ifndef Q_OS_WIN // the windows implementation is currently only memory based and not really shared
+    KSharedDataCache cache(cacheName, cacheSize);
+    for (int thread = 0; thread < threadCount; ++thread) {
+        for (int key = 0; key < keyCount; ++key) {
+            QByteArray result;
+            QVERIFY(cache.find(keyName(thread, key), &result));
+            QCOMPARE(result, payload(thread, key));
+        }
+    }
+
+    cache.clear();
+    QVERIFY(!cache.contains(keyName(0, 0)));
+    QCOMPARE(cache.freeSize(), cache.totalSize());
+#endif
+}
+
+void KSharedDataCacheTest::batchInsertAndFind()
+{
+    const QLatin1String cacheName("batchInsertAndFind");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    KSharedDataCache cache(cacheName, 8 * 1024 * 1024);
+
+    QList<QPair<QString, QByteArray>> entries;
+    QStringList keys;
+    for (int i = 0; i < 100; ++i) {
+        const QString key = QStringLiteral("key%1").arg(i);
+        entries.append({key, QByteArray(100 + i * 10, char('a' + i % 26))});
+        keys.append(key);
+    }
+
+    const QList<bool> inserted = cache.insertMany(entries);
+    QCOMPARE(inserted, QList<bool>(entries.size(), true));
+
+    keys.append(QStringLiteral("missing"));
+    QHash<QString, QByteArray> found;
+    const QList<bool> present = cache.findMany(keys, &found);
+    QCOMPARE(present.size(), keys.size());
+    QVERIFY(!present.last());
+    QVERIFY(!found.contains(QStringLiteral("missing")));
+    QCOMPARE(found.size(), entries.size());
+    for (const auto &entry : std::as_const(entries)) {
+        QCOMPARE(found.value(entry.first), entry.second);
+    }
+
+    // The same result without a destination
+    QCOMPARE(cache.findMany(keys, nullptr), present);
+}
+
+void KSharedDataCacheTest::pinnedData()
+{
+    const QLatin1String cacheName("pinnedData");
+    const QLatin1String key("pinned");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    KSharedDataCache cache(cacheName, 1024 * 1024);
+    const QByteArray data(20000, 'p');
+    QVERIFY(cache.insert(key, data));
+
+    QVERIFY(cache.findPinned(QStringLiteral("missing")).isNull());
+
+    {
+        KSharedDataCache::PinnedData pinned = cache.findPinned(key);
+        QVERIFY(!pinned.isNull());
+        QCOMPARE(pinned.toByteArray(), data);
+
+#ifndef Q_OS_WIN // the windows implementation is currently only memory based and not really shared
+        // The entry can be neither removed nor replaced while it is pinned...
+        QVERIFY(!cache.remove(key));
+        QVERIFY(!cache.insert(key, QByteArrayLiteral("other")));
+
+        // ...nor evicted or moved to make room for others.
+        for (int i = 0; i < 500; ++i) {
+            cache.insert(QStringLiteral("filler%1").arg(i), QByteArray(5000 + (i % 7) * 1000, 'f'));
+        }
+        QVERIFY(cache.contains(key));
+        QCOMPARE(QByteArray(pinned.constData(), pinned.size()), data);
+#endif
+
+        const KSharedDataCache::PinnedData moved = std::move(pinned);
+        QVERIFY(pinned.isNull());
+        QCOMPARE(moved.toByteArray(), data);
+    }
+
+    // Releasing the pin makes the entry removable again
+    QVERIFY(cache.remove(key));
+    QVERIFY(!cache.contains(key));
+}
+
+void KSharedDataCacheTest::highIndexLoad()
+{
+#ifdef Q_OS_WIN
+    QSKIP("The windows implementation has no index table");
+#endif
+    const QLatin1String cacheName("highIndexLoad");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    // Entries much smaller than expected run out of index entries long before
+    // running out of pages, which must neither make inserts fail nor lose
+    // entries which are already present.
+    KSharedDataCache cache(cacheName, 4 * 1024 * 1024, 1024);
+    const uint indexSize = cache.statistics().indexSize;
+    QVERIFY(indexSize > 0);
+
+    const auto keyName = [](uint key) {
+        return QStringLiteral("key%1").arg(key);
+    };
+
+    const uint keyCount = indexSize * 9 / 10;
+    for (uint key = 0; key < keyCount; ++key) {
+        QVERIFY(cache.insert(keyName(key), QByteArray(200, char('a' + key % 26))));
+    }
+
+    const KSharedDataCache::Statistics statistics = cache.statistics();
+    QCOMPARE(statistics.indexSize, indexSize);
+    QVERIFY(statistics.indexLoadFactor() > 0.85);
+    QVERIFY(statistics.maximumProbeLength >= 1);
+    QVERIFY(statistics.averageProbeLength >= 1);
+
+    uint found = 0;
+    for (uint key = 0; key < keyCount; ++key) {
+        QByteArray result;
+        if (cache.find(keyName(key), &result)) {
+            QCOMPARE(result, QByteArray(200, char('a' + key % 26)));
+            ++found;
+        }
+    }
+    QCOMPARE(found, statistics.entryCount);
+
+    // Overflowing the index evicts entries instead of failing
+    for (uint key = keyCount; key < 2 * indexSize; ++key) {
+        QVERIFY(cache.insert(keyName(key), QByteArray(200, 'z')));
+        QVERIFY(cache.contains(keyName(key)));
+    }
+    QCOMPARE(cache.statistics().entryCount, indexSize);
+
+    cache.clear();
+    QCOMPARE(cache.statistics().entryCount, 0u);
+}
+
+void KSharedDataCacheTest::limitedDefragmentation()
+{
+    const QLatin1String cacheName("limitedDefragmentation");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    KSharedDataCache cache(cacheName, 2 * 1024 * 1024, 4096);
+    QCOMPARE(cache.defragmentationLimit(), 1024u * 1024u);
+    cache.setDefragmentationLimit(4096);
+    QCOMPARE(cache.defragmentationLimit(), 4096u);
+
+    const auto keyName = [](int round, int key) {
+        return QStringLiteral("round%1-key%2").arg(round).arg(key);
+    };
+    const auto payload = [](int round, int key) {
+        return QByteArray(1000 + (key % 5) * 3000, char('a' + (round + key) % 26));
+    };
+
+    // Leave holes behind everywhere, which have to be defragmented away to
+    // make room for larger entries, a little at a time.
+    for (int round = 0; round < 6; ++round) {
+        for (int key = 0; key < 300; ++key) {
+            cache.insert(keyName(round, key), payload(round, key));
+        }
+        for (int key = 0; key < 300; key += 2) {
+            cache.remove(keyName(round, key));
+        }
+        for (int key = 300; key < 340; ++key) {
+            QVERIFY(cache.insert(keyName(round, key), payload(round, key) + QByteArray(30000, 'x')));
+        }
+    }
+
+    // Whatever is left must be intact
+    for (int round = 0; round < 6; ++round) {
+        for (int key = 0; key < 340; ++key) {
+            QByteArray result;
+            if (cache.find(keyName(round, key), &result)) {
+                QCOMPARE(result, key < 300 ? payload(round, key) : payload(round, key) + QByteArray(30000, 'x'));
+            }
+        }
+    }
+
+    cache.clear();
+    QCOMPARE(cache.freeSize(), cache.totalSize());
+}
+
+void KSharedDataCacheTest::admissionFilter()
+{
+#ifdef Q_OS_WIN
+    QSKIP("The windows implementation has no eviction policies");
+#endif
+    const QLatin1String cacheName("admissionFilter");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    KSharedDataCache cache(cacheName, 1024 * 1024, 4096);
+    cache.setEvictionPolicy(KSharedDataCache::EvictWithAdmissionFilter);
+    QCOMPARE(cache.evictionPolicy(), KSharedDataCache::EvictWithAdmissionFilter);
+
+    const int hotCount = 50;
+    const auto payload = [](const QString &key) {
+        return QByteArray(4000, char(qHash(key)));
+    };
+    const auto request = [&](const QString &key) {
+        QByteArray result;
+        if (!cache.find(key, &result)) {
+            cache.insert(key, payload(key));
+        }
+    };
+
+    for (int round = 0; round < 5; ++round) {
+        for (int key = 0; key < hotCount; ++key) {
+            request(QStringLiteral("hot%1").arg(key));
+        }
+    }
+
+    // A scan over many keys requested only once, while the hot keys are
+    // still requested every now and then, must not evict the hot keys.
+    for (int key = 0; key < 3000; ++key) {
+        request(QStringLiteral("scan%1").arg(key));
+        if (key % 4 == 0) {
+            request(QStringLiteral("hot%1").arg((key / 4) % hotCount));
+        }
+    }
+
+    int hotLeft = 0;
+    for (int key = 0; key < hotCount; ++key) {
+        const QString keyName = QStringLiteral("hot%1").arg(key);
+        QByteArray result;
+        if (cache.find(keyName, &result)) {
+            QCOMPARE(result, payload(keyName));
+            ++hotLeft;
+        }
+    }
+    QVERIFY2(hotLeft >= hotCount * 8 / 10, qPrintable(QString::number(hotLeft)));
+}
+
+void KSharedDataCacheTest::statisticsCounters()
+{
+    const QLatin1String cacheName("statisticsCounters");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    KSharedDataCache cache(cacheName, 1024 * 1024, 1024);
+    QCOMPARE(cache.statistics().hits, quint64(0));
+
+    const uint keyCount = 2000;
+    for (uint key = 0; key < keyCount; ++key) {
+        QVERIFY(cache.insert(QStringLiteral("key%1").arg(key), QByteArray(200, 'x')));
+    }
+
+    QByteArray result;
+    QVERIFY(cache.find(QStringLiteral("key%1").arg(keyCount - 1), &result));
+    QVERIFY(!cache.find(QStringLiteral("missing"), &result));
+    QVERIFY(cache.findPinned(QStringLiteral("missing")).isNull());
+
+    const KSharedDataCache::Statistics statistics = cache.statistics();
+    QCOMPARE(statistics.hits, quint64(1));
+    QCOMPARE(statistics.misses, quint64(2));
+    QCOMPARE(statistics.inserts, quint64(keyCount));
+    QCOMPARE(statistics.failedInserts, quint64(0));
+    QCOMPARE(statistics.hitRatio(), 1.0 / 3);
+
+    uint histogramTotal = 0;
+    for (const uint entries : statistics.probeLengthHistogram) {
+        histogramTotal += entries;
+    }
+    QCOMPARE(histogramTotal, statistics.entryCount);
+    QCOMPARE(uint(statistics.probeLengthHistogram.size()), statistics.maximumProbeLength);
+
+#ifndef Q_OS_WIN // the windows implementation is currently only memory based and not really shared
+    // The cache is too small for all of the keys
+    QVERIFY(statistics.evictions > 0);
+
+    // The counters are shared, and survive clearing the cache
+    KSharedDataCache otherCache(cacheName, 1024 * 1024, 1024);
+    cache.clear();
+    QVERIFY(!otherCache.find(QStringLiteral("key0"), &result));
+    QCOMPARE(cache.statistics().misses, quint64(3));
+    QCOMPARE(cache.statistics().entryCount, 0u);
+#endif
+}
+
+void KSharedDataCacheTest::compression()
+{
+    const QLatin1String cacheName("compression");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    KSharedDataCache cache(cacheName, 1024 * 1024, 1024);
+    QCOMPARE(cache.compressionThreshold(), 0u);
+    cache.setCompressionThreshold(1024);
+    QCOMPARE(cache.compressionThreshold(), 1024u);
+
+    const auto payload = [](int key) {
+        QByteArray data(20000, char('a' + key % 26));
+        for (int i = 0; i < data.size(); i += 97) {
+            data[i] = char(i + key);
+        }
+        return data;
+    };
+
+    // Uncompressed only about 50 of these would fit
+    const int keyCount = 200;
+    for (int key = 0; key < keyCount; ++key) {
+        QVERIFY(cache.insert(QStringLiteral("key%1").arg(key), payload(key)));
+    }
+
+    // Small data is left alone
+    QVERIFY(cache.insert(QStringLiteral("small"), QByteArray("data")));
+
+    // Other users of the cache decompress the entries too
+#ifdef Q_OS_WIN // the windows implementation is currently only memory based and not really shared
+    KSharedDataCache &otherCache = cache;
+#else
+    KSharedDataCache otherCache(cacheName, 1024 * 1024, 1024);
+#endif
+    for (int key = 0; key < keyCount; ++key) {
+        QByteArray result;
+        QVERIFY(otherCache.find(QStringLiteral("key%1").arg(key), &result));
+        QCOMPARE(result, payload(key));
+    }
+
+    QByteArray result;
+    QVERIFY(otherCache.find(QStringLiteral("small"), &result));
+    QCOMPARE(result, QByteArray("data"));
+
+    const KSharedDataCache::PinnedData pinnedData = cache.findPinned(QStringLiteral("key1"));
+    QCOMPARE(pinnedData.toByteArray(), payload(1));
+}
+
+void KSharedDataCacheTest::typedCache()
+{
+    const QLatin1String cacheName("typed");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    struct Info {
+        qint64 time;
+        int width;
+        int height;
+    };
+
+    KSharedDataCacheT<QString, Info> infoCache(cacheName, 1024 * 1024);
+    QVERIFY(infoCache.insert(QStringLiteral("info"), Info{42, 640, 480}));
+
+    Info info{0, 0, 0};
+    QVERIFY(infoCache.find(QStringLiteral("info"), &info));
+    QCOMPARE(info.time, 42);
+    QCOMPARE(info.width, 640);
+    QCOMPARE(info.height, 480);
+    QVERIFY(infoCache.find(QStringLiteral("info"), nullptr));
+    QVERIFY(!infoCache.find(QStringLiteral("missing"), &info));
+
+    // Data of the wrong size does not decode, and leaves the destination alone
+    QVERIFY(infoCache.cache().insert(QStringLiteral("short"), QByteArray("data")));
+    QVERIFY(!infoCache.find(QStringLiteral("short"), &info));
+    QCOMPARE(info.width, 640);
+
+    QVERIFY(infoCache.remove(QStringLiteral("info")));
+    QVERIFY(!infoCache.contains(QStringLiteral("info")));
+
+    KSharedDataCacheT<int, QList<int>> listCache(cacheName, 1024 * 1024);
+    const QList<int> list{1, 2, 3, 5, 8};
+    QVERIFY(listCache.insert(7, list));
+    QList<int> listResult;
+    QVERIFY(listCache.find(7, &listResult));
+    QCOMPARE(listResult, list);
+
+    KSharedDataCacheT<QString, QString> stringCache(cacheName, 1024 * 1024);
+    QVERIFY(stringCache.insert(QStringLiteral("string"), QStringLiteral("value")));
+    QString stringResult;
+    QVERIFY(stringCache.find(QStringLiteral("string"), &stringResult));
+    QCOMPARE(stringResult, QStringLiteral("value"));
+
+    KSharedDataCacheT<QString, QByteArray> bytesCache(cacheName, 1024 * 1024);
+    QVERIFY(bytesCache.insert(QStringLiteral("bytes"), QByteArrayLiteral("raw")));
+    QByteArray bytesResult;
+    QVERIFY(bytesCache.find(QStringLiteral("bytes"), &bytesResult));
+    QCOMPARE(bytesResult, QByteArrayLiteral("raw"));
+
+    // QStringList has no specialization, so goes through QDataStream
+    KSharedDataCacheT<QString, QStringList> streamCache(cacheName, 1024 * 1024);
+    const QStringList strings{QStringLiteral("a"), QStringLiteral("bc")};
+    QVERIFY(streamCache.insert(QStringLiteral("strings"), strings));
+    QStringList stringsResult;
+    QVERIFY(streamCache.find(QStringLiteral("strings"), &stringsResult));
+    QCOMPARE(stringsResult, strings);
+}
+
+void KSharedDataCacheTest::mappingOptions()
+{
+    const QLatin1String cacheName("mappingOptions");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    const auto options = KSharedDataCache::PrefaultMapping | KSharedDataCache::HugePages | KSharedDataCache::LockIndex;
+    KSharedDataCache cache(cacheName, 4 * 1024 * 1024, 0, options);
+    QVERIFY(cache.insert(QStringLiteral("foo"), QByteArrayLiteral("bar")));
+
+    // Processes using other options share the same cache
+    KSharedDataCache otherCache(cacheName, 4 * 1024 * 1024);
+#ifndef Q_OS_WIN // the windows implementation is currently only memory based and not really shared
+    QByteArray result;
+    QVERIFY(otherCache.find(QStringLiteral("foo"), &result));
+    QCOMPARE(result, QByteArrayLiteral("bar"));
+#endif
+}
+
+void KSharedDataCacheTest::robustLocks()
+{
+#ifndef Q_OS_LINUX
+    QSKIP("Robust locks are only known to be supported on Linux");
+#else
+    const QLatin1String cacheName("robustLocks");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    KSharedDataCache cache(cacheName, 4 * 1024 * 1024, 0, KSharedDataCache::RobustLocks);
+    QVERIFY(cache.insert(QStringLiteral("foo"), QByteArrayLiteral("bar")));
+
+    // The child dies while writing an entry, with the lock of its shard held
+    const pid_t pid = ::fork();
+    QVERIFY(pid >= 0);
+    if (pid == 0) {
+        cache.insert(QStringLiteral("foo"), 16, [](char *) {
+            ::_exit(0);
+        });
+        ::_exit(1);
+    }
+
+    int status = 0;
+    QCOMPARE(::waitpid(pid, &status, 0), pid);
+    QVERIFY(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // The lock is handed over right away, rather than once it times out
+    QTest::ignoreMessage(QtWarningMsg, "Recovering a cache lock whose owner died while holding it");
+    QElapsedTimer timer;
+    timer.start();
+    QVERIFY(cache.insert(QStringLiteral("foo"), QByteArrayLiteral("baz")));
+    QVERIFY(timer.elapsed() < 5000);
+
+    QByteArray result;
+    QVERIFY(cache.find(QStringLiteral("foo"), &result));
+    QCOMPARE(result, QByteArrayLiteral("baz"));
+#endif
+}
+
+void KSharedDataCacheTest::expiry()
+{
+    using namespace std::chrono_literals;
+    const QLatin1String cacheName("expiry");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    // Small enough for a single shard, whose index the inserts below cover
+    KSharedDataCache cache(cacheName, 256 * 4096, 4096);
+    QVERIFY(cache.insert(QStringLiteral("long"), QByteArrayLiteral("a"), 1h));
+    QVERIFY(cache.insert(QStringLiteral("forever"), QByteArrayLiteral("b")));
+    const int shortCount = 10;
+    for (int i = 0; i < shortCount; ++i) {
+        QVERIFY(cache.insert(QStringLiteral("short%1").arg(i), QByteArrayLiteral("c"), 1s));
+    }
+
+    QVERIFY(cache.contains(QStringLiteral("long")));
+    QTRY_VERIFY_WITH_TIMEOUT(!cache.contains(QStringLiteral("short0")), 5000);
+
+    QByteArray result;
+    QVERIFY(!cache.find(QStringLiteral("short1"), &result));
+    QVERIFY(cache.find(QStringLiteral("long"), &result));
+    QCOMPARE(result, QByteArrayLiteral("a"));
+    QVERIFY(cache.contains(QStringLiteral("forever")));
+
+#ifndef Q_OS_WIN // the windows implementation only drops expired entries when they are looked up
+    // Later inserts reclaim the expired entries
+    for (int i = 0; i < 16; ++i) {
+        QVERIFY(cache.insert(QStringLiteral("other%1").arg(i), QByteArrayLiteral("d")));
+    }
+
+    const KSharedDataCache::Statistics statistics = cache.statistics();
+    QCOMPARE(statistics.expirations, quint64(shortCount));
+    QCOMPARE(statistics.entryCount, 2u + 16u);
+#endif
+}
+
+void KSharedDataCacheTest::invalidateTag()
+{
+    const QLatin1String cacheName("invalidateTag");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    KSharedDataCache cache(cacheName, 5 * 1024 * 1024);
+    for (int i = 0; i < 10; ++i) {
+        QVERIFY(cache.insert(QStringLiteral("breeze/%1").arg(i), QByteArrayLiteral("b"), QStringLiteral("breeze")));
+        QVERIFY(cache.insert(QStringLiteral("oxygen/%1").arg(i), QByteArrayLiteral("o"), QStringLiteral("oxygen")));
+    }
+    QVERIFY(cache.insert(QStringLiteral("untagged"), QByteArrayLiteral("u")));
+
+    // Invalidating a tag affects every process using the cache
+#ifdef Q_OS_WIN // the windows implementation is currently only memory based and not really shared
+    KSharedDataCache &otherCache = cache;
+#else
+    KSharedDataCache otherCache(cacheName, 5 * 1024 * 1024);
+#endif
+    QVERIFY(otherCache.contains(QStringLiteral("breeze/3")));
+    otherCache.invalidateTag(QStringLiteral("breeze"));
+
+    QByteArray result;
+    for (int i = 0; i < 10; ++i) {
+        QVERIFY(!cache.find(QStringLiteral("breeze/%1").arg(i), &result));
+        QVERIFY(cache.find(QStringLiteral("oxygen/%1").arg(i), &result));
+        QCOMPARE(result, QByteArrayLiteral("o"));
+    }
+    QVERIFY(cache.contains(QStringLiteral("untagged")));
+
+    // Entries inserted afterwards are not affected
+    QVERIFY(cache.insert(QStringLiteral("breeze/3"), QByteArrayLiteral("new"), QStringLiteral("breeze")));
+    QVERIFY(cache.find(QStringLiteral("breeze/3"), &result));
+    QCOMPARE(result, QByteArrayLiteral("new"));
+}
+
+void KSharedDataCacheTest::insertAsync()
+{
+    const QLatin1String cacheName("insertAsync");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    const int keyCount = 100;
+    QList<QFuture<bool>> futures;
+    {
+        KSharedDataCache cache(cacheName, 5 * 1024 * 1024);
+
+        // Every key is queued twice, only the second value may remain
+        for (int i = 0; i < 2 * keyCount; ++i) {
+            futures.append(cache.insertAsync(QStringLiteral("key%1").arg(i % keyCount), QByteArray(1000, i < keyCount ? 'a' : 'b')));
+        }
+
+        for (const QFuture<bool> &future : std::as_const(futures)) {
+            QVERIFY(future.result());
+        }
+
+        QByteArray result;
+        for (int i = 0; i < keyCount; ++i) {
+            QVERIFY(cache.find(QStringLiteral("key%1").arg(i), &result));
+            QCOMPARE(result, QByteArray(1000, 'b'));
+        }
+
+        // Destroying the cache waits for the queued entries to be written
+        futures = {cache.insertAsync(QStringLiteral("last"), QByteArrayLiteral("data"))};
+    }
+
+    QVERIFY(futures.first().isFinished());
+    QVERIFY(futures.first().result());
+
+#ifndef Q_OS_WIN // the windows implementation is currently only memory based and not really shared
+    KSharedDataCache cache(cacheName, 5 * 1024 * 1024);
+    QVERIFY(cache.contains(QStringLiteral("last")));
+#endif
+}
+
+void KSharedDataCacheTest::resize()
+{
+    const QLatin1String cacheName("resize");
+
+    QFile file(makeCacheFileName(cacheName));
+    if (file.exists()) {
+        QVERIFY(file.remove());
+    }
+
+    const auto payload = [](int key) {
+        return QByteArray(1500, char('a' + key % 26));
+    };
+
+    KSharedDataCache cache(cacheName, 1024 * 1024, 2048);
+    const int keyCount = 100;
+    for (int key = 0; key < keyCount; ++key) {
+        QVERIFY(cache.insert(QStringLiteral("key%1").arg(key), payload(key)));
+    }
+
+    // Attaching with a different size doesn't change the existing cache
+#ifdef Q_OS_WIN // the windows implementation is currently only memory based and not really shared
+    KSharedDataCache &otherCache = cache;
+#else
+    KSharedDataCache otherCache(cacheName, 2 * 1024 * 1024, 2048);
+    QCOMPARE(otherCache.totalSize(), 1024u * 1024u);
+#endif
+
+    QVERIFY(cache.resize(4 * 1024 * 1024));
+    QCOMPARE(cache.totalSize(), 4u * 1024u * 1024u);
+
+    // Everyone using the cache switches over, and the entries are kept
+    QCOMPARE(otherCache.totalSize(), 4u * 1024u * 1024u);
+    QByteArray result;
+    for (int key = 0; key < keyCount; ++key) {
+        QVERIFY(otherCache.find(QStringLiteral("key%1").arg(key), &result));
+        QCOMPARE(result, payload(key));
+    }
+
+    QVERIFY(otherCache.insert(QStringLiteral("other"), QByteArrayLiteral("data")));
+    QVERIFY(cache.contains(QStringLiteral("other")));
+
+    // Shrinking keeps as many entries as fit
+    const unsigned smallSize = 256 * 2048;
+    QVERIFY(otherCache.resize(smallSize));
+    QCOMPARE(cache.totalSize(), smallSize);
+    const KSharedDataCache::Statistics statistics = cache.statistics();
+    QVERIFY(statistics.entryCount > 0);
+    QVERIFY(statistics.entryCount <= statistics.indexSize);
+}
+
+void KSharedDataCacheTest::snapshot()
+{
+    const QLatin1String sourceName("snapshot-source");
+    const QLatin1String cacheName("snapshot");
+    for (const QString &name : {QString(sourceName), QString(cacheName)}) {
+        QFile file(makeCacheFileName(name));
+        if (file.exists()) {
+            QVERIFY(file.remove());
+        }
+    }
+
+    const auto payload = [](int key) {
+        return QByteArray(100 + key * 10, char('a' + key % 26));
+    };
+
+    // Some of the entries are stored compressed
+    KSharedDataCache source(sourceName, 1024 * 1024);
+    source.setCompressionThreshold(1024);
+    const int keyCount = 200;
+    for (int key = 0; key < keyCount; ++key) {
+        QVERIFY(source.insert(QStringLiteral("key%1").arg(key), payload(key)));
+    }
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString snapshotFile = dir.filePath(QStringLiteral("snapshot"));
+    QVERIFY(source.exportSnapshot(snapshotFile));
+
+    KSharedDataCache cache(cacheName, 1024 * 1024);
+    QVERIFY(cache.insert(QStringLiteral("key0"), QByteArrayLiteral("replaced")));
+    QVERIFY(cache.insert(QStringLiteral("other"), QByteArrayLiteral("other")));
+    QVERIFY(cache.attachSnapshot(snapshotFile));
+
+    // The snapshot comes first, and the cache is still consulted for the rest
+    QByteArray result;
+    QStringList keys;
+    for (int key = 0; key < keyCount; ++key) {
+        keys.append(QStringLiteral("key%1").arg(key));
+        QVERIFY(cache.find(keys.last(), &result));
+        QCOMPARE(result, payload(key));
+        QVERIFY(cache.contains(keys.last()));
+    }
+    QVERIFY(cache.find(QStringLiteral("other"), &result));
+    QCOMPARE(result, QByteArrayLiteral("other"));
+    QVERIFY(!cache.contains(QStringLiteral("missing")));
+
+    keys.append(QStringLiteral("missing"));
+    QHash<QString, QByteArray> found;
+    const QList<bool> results = cache.findMany(keys, &found);
+    QCOMPARE(results.count(true), keyCount);
+    QCOMPARE(found.value(QStringLiteral("key150")), payload(150));
+
+    QByteArray readResult;
+    QVERIFY(cache.find(QStringLiteral("key1"), [&readResult](const char *data, qsizetype size) {
+        readResult = QByteArray(data, size);
+    }));
+    QCOMPARE(readResult, payload(1));
+
+    // Lookups in the snapshot don't touch the cache
+    QCOMPARE(cache.statistics().hits, quint64(1));
+
+    // Invalid snapshots are rejected, keeping the attached one
+    const QString invalidFile = dir.filePath(QStringLiteral("invalid"));
+    QFile invalid(invalidFile);
+    QVERIFY(invalid.open(QIODevice::WriteOnly));
+    invalid.write(QByteArray(1024, 'x'));
+    invalid.close();
+    QVERIFY(!cache.attachSnapshot(invalidFile));
+    QVERIFY(!cache.attachSnapshot(dir.filePath(QStringLiteral("nonexistent"))));
+    QVERIFY(cache.contains(QStringLiteral("key2")));
+
+    // Pinned data of the snapshot outlives it
+    const KSharedDataCache::PinnedData pinned = cache.findPinned(QStringLiteral("key199"));
+    QVERIFY(!pinned.isNull());
+    cache.detachSnapshot();
+    QCOMPARE(pinned.toByteArray(), payload(199));
+
+    QVERIFY(!cache.contains(QStringLiteral("key2")));
+    QVERIFY(cache.find(QStringLiteral("key0"), &result));
+    QCOMPARE(result, QByteArrayLiteral("replaced"));
+}
+
 QTEST_MAIN(KSharedDataCacheTest)
 
 #include "kshareddatacachetest.moc"
@@ -1,2 +1,4 @@
 #cmakedefine01 HAVE_SYS_MMAN_H
+#cmakedefine01 HAVE_LINUX_FUTEX_H
+#cmakedefine01 HAVE_PTHREAD_MUTEXATTR_SETROBUST
 
@@ -11,13 +11,173 @@
 
 #include <memory>
 
+#include <errno.h>
+
+#ifdef KSDC_FUTEX_SUPPORTED
+#include <QDeadlineTimer>
+#include <qyieldcpu.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// The futex of a futexLock is 0 if the lock is free. Otherwise it has the
+// locked flag set, and the waiters flag if anyone may be waiting for it.
+static const int futexLockedFlag = 0x1;
+static const int futexWaitersFlag = 0x2;
+
+// Locks time out after this long, like the timed pthread and semaphore locks.
+static const qint64 futexLockTimeout = 10 * 1000; // in milliseconds
+
+// Upper bound for the number of spins before waiting in the kernel.
+static const int futexMaximumSpins = 100;
+
+futexLock::futexLock(QBasicAtomicInt &futex)
+    : m_futex(futex)
+    , m_spinEstimate(0)
+{
+}
+
+bool futexLock::initialize(bool &processSharingSupported)
+{
+    m_futex.storeRelaxed(0);
+    processSharingSupported = true;
+    return true;
+}
+
+KSDCLock::LockResult futexLock::lock()
+{
+    if (Q_LIKELY(m_futex.testAndSetAcquire(0, futexLockedFlag))) {
+        return LockAcquired;
+    }
+
+    return lockContended() ? LockAcquired : LockFailed;
+}
+
+bool futexLock::lockContended()
+{
+    // The lock is usually held only briefly, so spin for a while before going
+    // to sleep. How long adapts to how long it took to get the lock before,
+    // like with PTHREAD_MUTEX_ADAPTIVE_NP. Threads which are already asleep
+    // waiting for the lock are not overtaken.
+    const int spinEstimate = m_spinEstimate.load(std::memory_order_relaxed);
+    const int maximumSpins = qMin(futexMaximumSpins, 2 * spinEstimate + 10);
+    for (int spins = 1; spins <= maximumSpins; ++spins) {
+        qYieldCpu();
+
+        const int current = m_futex.loadRelaxed();
+        if (current & futexWaitersFlag) {
+            break;
+        }
+
+        if (current == 0 && m_futex.testAndSetAcquire(0, futexLockedFlag)) {
+            m_spinEstimate.store(spinEstimate + (spins - spinEstimate) / 8, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    m_spinEstimate.store(spinEstimate + (maximumSpins - spinEstimate) / 8, std::memory_order_relaxed);
+
+    // Go to sleep, with the waiters flag set to have unlock() wake us up. It
+    // is unknown whether anyone else is still waiting once we get the lock, so
+    // the flag is kept then.
+    const QDeadlineTimer deadline(futexLockTimeout);
+    for (;;) {
+        int current = m_futex.loadRelaxed();
+        if (!(current & futexLockedFlag)) {
+            if (m_futex.testAndSetAcquire(current, futexLockedFlag | futexWaitersFlag)) {
+                return true;
+            }
+            continue;
+        }
+
+        if (!(current & futexWaitersFlag)) {
+            if (!m_futex.testAndSetRelaxed(current, current | futexWaitersFlag)) {
+                continue;
+            }
+            current |= futexWaitersFlag;
+        }
+
+        const qint64 remaining = deadline.remainingTimeNSecs();
+        if (remaining <= 0) {
+            return false;
+        }
+
+        const struct timespec timeout = {static_cast<time_t>(remaining / (1000 * 1000 * 1000)), static_cast<long>(remaining % (1000 * 1000 * 1000))};
+        ::syscall(SYS_futex, &m_futex, FUTEX_WAIT, current, &timeout, nullptr, 0);
+    }
+}
+
+void futexLock::unlock()
+{
+    if (m_futex.fetchAndStoreRelease(0) & futexWaitersFlag) {
+        ::syscall(SYS_futex, &m_futex, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+    }
+}
+#endif // KSDC_FUTEX_SUPPORTED
+
+#ifdef KSDC_ROBUST_MUTEX_SUPPORTED
+bool pthreadRobustLock::initialize(bool &processSharingSupported)
+{
+    // Unlike the other locks there is no fallback to a thread-only mutex, as
+    // robustness only matters across processes.
+    pthread_mutexattr_t mutexAttr;
+    processSharingSupported = false;
+
+    if (::sysconf(_SC_THREAD_PROCESS_SHARED) >= 200112L && pthread_mutexattr_init(&mutexAttr) == 0) {
+        if (pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED) == 0 && pthread_mutexattr_setrobust(&mutexAttr, PTHREAD_MUTEX_ROBUST) == 0
+            && pthread_mutex_init(&m_mutex, &mutexAttr) == 0) {
+            processSharingSupported = true;
+        }
+        pthread_mutexattr_destroy(&mutexAttr);
+    }
+
+    return processSharingSupported;
+}
+
+KSDCLock::LockResult pthreadRobustLock::lock()
+{
+    struct timespec timeout;
+    timeout.tv_sec = 10 + ::time(nullptr); // Absolute time, so 10 seconds from now
+    timeout.tv_nsec = 0;
+
+    const int result = pthread_mutex_timedlock(&m_mutex, &timeout);
+    if (result != EOWNERDEAD) {
+        return result == 0 ? LockAcquired : LockFailed;
+    }
+
+    // The owner died while holding the lock, which is ours now. The cache may
+    // have been left inconsistent, so the caller has to check it.
+    qCWarning(KCOREADDONS_DEBUG) << "Recovering a cache lock whose owner died while holding it";
+    pthread_mutex_consistent(&m_mutex);
+    return LockRecovered;
+}
+#endif // KSDC_ROBUST_MUTEX_SUPPORTED
+
 /*!
  * This is a method to determine the best lock type to use for a
  * shared cache, based on local support. An identifier to the appropriate
  * SharedLockId is returned, which can be passed to createLockFromId().
  */
-SharedLockId findBestSharedLock()
+SharedLockId findBestSharedLock(bool recoverFromOwnerDeath)
 {
+#ifdef KSDC_ROBUST_MUTEX_SUPPORTED
+    if (recoverFromOwnerDeath) {
+        pthread_mutex_t tempMutex;
+        bool robustProcessShared = false;
+        pthreadRobustLock(tempMutex).initialize(robustProcessShared);
+        if (robustProcessShared) {
+            pthread_mutex_destroy(&tempMutex);
+            return LOCKTYPE_ROBUST_MUTEX;
+        }
+    }
+#else
+    Q_UNUSED(recoverFromOwnerDeath);
+#endif
+
+#ifdef KSDC_FUTEX_SUPPORTED
+    // Futexes are always process-shared, support timeouts and are the
+    // cheapest to take, so there is no need to look any further.
+    return LOCKTYPE_FUTEX;
+#else
     // We would prefer a process-shared capability that also supports
     // timeouts. Failing that, process-shared is preferred over timeout
     // support. Failing that we'll go thread-local
@@ -76,6 +236,7 @@ SharedLockId findBestSharedLock()
 
     // Fallback to a dumb-simple but possibly-CPU-wasteful solution.
     return LOCKTYPE_SPINLOCK;
+#endif // KSDC_FUTEX_SUPPORTED
 }
 
 KSDCLock *createLockFromId(SharedLockId id, SharedLock &lock)
@@ -109,6 +270,18 @@ KSDCLock *createLockFromId(SharedLockId id, SharedLock &lock)
         return new simpleSpinLock(lock.spinlock);
         break;
 
+#ifdef KSDC_FUTEX_SUPPORTED
+    case LOCKTYPE_FUTEX:
+        return new futexLock(lock.futex);
+        break;
+#endif // KSDC_FUTEX_SUPPORTED
+
+#ifdef KSDC_ROBUST_MUTEX_SUPPORTED
+    case LOCKTYPE_ROBUST_MUTEX:
+        return new pthreadRobustLock(lock.mutex);
+        break;
+#endif // KSDC_ROBUST_MUTEX_SUPPORTED
+
     default:
         qCCritical(KCOREADDONS_DEBUG) << "Creating shell of a lock!";
         return new KSDCLock;
@@ -8,8 +8,12 @@
 #ifndef KSDCLOCK_P_H
 #define KSDCLOCK_P_H
 
+#include <config-caching.h> // HAVE_LINUX_FUTEX_H, HAVE_PTHREAD_MUTEXATTR_SETROBUST
+
 #include <qbasicatomic.h>
 
+#include <atomic>
+
 #include <sched.h> // sched_yield
 #include <unistd.h> // Check for sched_yield
 
@@ -35,7 +39,15 @@
 #define KSDC_SEMAPHORES_SUPPORTED 1
 #endif
 
-#if defined(__GNUC__) && !defined(KSDC_SEMAPHORES_SUPPORTED) && !defined(KSDC_THREAD_PROCESS_SHARED_SUPPORTED)
+#if HAVE_LINUX_FUTEX_H
+#define KSDC_FUTEX_SUPPORTED 1
+#endif
+
+#if defined(KSDC_THREAD_PROCESS_SHARED_SUPPORTED) && defined(KSDC_TIMEOUTS_SUPPORTED) && HAVE_PTHREAD_MUTEXATTR_SETROBUST
+#define KSDC_ROBUST_MUTEX_SUPPORTED 1
+#endif
+
+#if defined(__GNUC__) && !defined(KSDC_SEMAPHORES_SUPPORTED) && !defined(KSDC_THREAD_PROCESS_SHARED_SUPPORTED) && !defined(KSDC_FUTEX_SUPPORTED)
 #warning "No system support claimed for process-shared synchronization, KSharedDataCache will be mostly useless."
 #endif
 
@@ -59,9 +71,21 @@ public:
         return false;
     }
 
-    virtual bool lock()
+    // The outcome of lock(). LockRecovered means the lock was acquired, but
+    // only after its previous owner died while holding it (pthreadRobustLock),
+    // so the cache may have been left in an inconsistent state.
+    enum LockResult {
+        LockFailed,
+        LockAcquired,
+        LockRecovered,
+    };
+
+    // Return value indicates if the lock was acquired. Unless it is LockFailed
+    // the lock is held and has to be unlocked again, even if the cache turns
+    // out to be corrupt.
+    virtual LockResult lock()
     {
-        return false;
+        return LockFailed;
     }
 
     virtual void unlock()
@@ -90,13 +114,13 @@ public:
         return true;
     }
 
-    bool lock() override
+    LockResult lock() override
     {
         // Spin a few times attempting to gain the lock, as upper-level code won't
         // attempt again without assuming the cache is corrupt.
         for (unsigned i = 50; i > 0; --i) {
             if (m_spinlock.testAndSetAcquire(0, 1)) {
-                return true;
+                return LockAcquired;
             }
 
             // Don't steal the processor and starve the thread we're waiting
@@ -104,7 +128,7 @@ public:
             loopSpinPause();
         }
 
-        return false;
+        return LockFailed;
     }
 
     void unlock() override
@@ -171,9 +195,9 @@ public:
         return true;
     }
 
-    bool lock() override
+    LockResult lock() override
     {
-        return pthread_mutex_lock(&m_mutex) == 0;
+        return pthread_mutex_lock(&m_mutex) == 0 ? LockAcquired : LockFailed;
     }
 
     void unlock() override
@@ -195,7 +219,7 @@ public:
     {
     }
 
-    bool lock() override
+    LockResult lock() override
     {
         struct timespec timeout;
 
@@ -205,11 +229,31 @@ public:
         timeout.tv_sec = 10 + ::time(nullptr); // Absolute time, so 10 seconds from now
         timeout.tv_nsec = 0;
 
-        return pthread_mutex_timedlock(&m_mutex, &timeout) == 0;
+        return pthread_mutex_timedlock(&m_mutex, &timeout) == 0 ? LockAcquired : LockFailed;
     }
 };
 #endif // defined(KSDC_THREAD_PROCESS_SHARED_SUPPORTED) && defined(KSDC_TIMEOUTS_SUPPORTED)
 
+#ifdef KSDC_ROBUST_MUTEX_SUPPORTED
+/*
+ * A timed process-shared mutex which is robust: if its owner dies while
+ * holding it, the kernel hands it to the next thread waiting for it instead of
+ * leaving everyone else to time out. This works across PID namespaces as well,
+ * for processes in different containers sharing a cache.
+ */
+class pthreadRobustLock : public pthreadTimedLock
+{
+public:
+    pthreadRobustLock(pthread_mutex_t &mutex)
+        : pthreadTimedLock(mutex)
+    {
+    }
+
+    bool initialize(bool &processSharingSupported) override;
+    LockResult lock() override;
+};
+#endif // KSDC_ROBUST_MUTEX_SUPPORTED
+
 #ifdef KSDC_SEMAPHORES_SUPPORTED
 class semaphoreLock : public KSDCLock
 {
@@ -238,9 +282,9 @@ public:
         return true;
     }
 
-    bool lock() override
+    LockResult lock() override
     {
-        return sem_wait(&m_semaphore) == 0;
+        return sem_wait(&m_semaphore) == 0 ? LockAcquired : LockFailed;
     }
 
     void unlock() override
@@ -262,7 +306,7 @@ public:
     {
     }
 
-    bool lock() override
+    LockResult lock() override
     {
         struct timespec timeout;
 
@@ -272,11 +316,44 @@ public:
         timeout.tv_sec = 10 + ::time(nullptr); // Absolute time, so 10 seconds from now
         timeout.tv_nsec = 0;
 
-        return sem_timedwait(&m_semaphore, &timeout) == 0;
+        return sem_timedwait(&m_semaphore, &timeout) == 0 ? LockAcquired : LockFailed;
     }
 };
 #endif // defined(KSDC_SEMAPHORES_SUPPORTED) && defined(KSDC_TIMEOUTS_SUPPORTED)
 
+#ifdef KSDC_FUTEX_SUPPORTED
+/*
+ * A lock built directly on Linux futexes, which are process-shared by nature.
+ * Acquiring it without contention takes a single atomic operation. A contended
+ * lock is spun on for a while first, for about as long as it took to get it
+ * the previous times, and then waited for in the kernel, so waiting neither
+ * burns CPU nor gives up early like simpleSpinLock does.
+ *
+ * The lock holds a flag telling whether it is taken and another one telling
+ * whether anyone may be waiting for it, to be woken up by unlock(). It does not
+ * recover from the death of its owner, caches which need that use
+ * pthreadRobustLock instead.
+ */
+class futexLock : public KSDCLock
+{
+public:
+    futexLock(QBasicAtomicInt &futex);
+
+    bool initialize(bool &processSharingSupported) override;
+    LockResult lock() override;
+    void unlock() override;
+
+private:
+    bool lockContended();
+
+    QBasicAtomicInt &m_futex;
+
+    // The number of spins it took to get the lock recently, averaged. This is
+    // local to the process, as it only serves as a hint.
+    std::atomic<int> m_spinEstimate;
+};
+#endif // KSDC_FUTEX_SUPPORTED
+
 // This enum controls the type of the locking used for the cache to allow
 // for as much portability as possible. This value will be stored in the
 // cache and used by multiple processes, therefore you should consider this
@@ -286,6 +363,8 @@ enum SharedLockId {
     LOCKTYPE_MUTEX = 1, // pthread_mutex
     LOCKTYPE_SEMAPHORE = 2, // sem_t
     LOCKTYPE_SPINLOCK = 3, // atomic int in shared memory
+    LOCKTYPE_FUTEX = 4, // Linux futex on an atomic int in shared memory
+    LOCKTYPE_ROBUST_MUTEX = 5, // robust pthread_mutex
 };
 
 // This type is a union of all possible lock types, with a SharedLockId used
@@ -299,6 +378,9 @@ struct SharedLock {
         sem_t semaphore;
 #endif
         QBasicAtomicInt spinlock;
+#if defined(KSDC_FUTEX_SUPPORTED)
+        QBasicAtomicInt futex;
+#endif
 
         // It would be highly unfortunate if a simple glibc upgrade or kernel
         // addition caused this structure to change size when an existing
@@ -314,8 +396,10 @@ struct SharedLock {
  * This is a method to determine the best lock type to use for a
  * shared cache, based on local support. An identifier to the appropriate
  * SharedLockId is returned, which can be passed to createLockFromId().
+ * If @p recoverFromOwnerDeath is set, a lock which recovers from the death of
+ * its owner is preferred, if there is one.
  */
-SharedLockId findBestSharedLock();
+SharedLockId findBestSharedLock(bool recoverFromOwnerDeath);
 
 KSDCLock *createLockFromId(SharedLockId id, SharedLock &lock);
 
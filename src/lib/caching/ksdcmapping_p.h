@@ -19,6 +19,8 @@
 
 #include <sys/resource.h>
 
+#include <vector>
+
 #if defined(_POSIX_MAPPED_FILES) && ((_POSIX_MAPPED_FILES == 0) || (_POSIX_MAPPED_FILES >= 200112L))
 #define KSDC_MAPPED_FILES_SUPPORTED 1
 #endif
@@ -43,11 +45,13 @@
 class Q_DECL_HIDDEN KSDCMapping
 {
 public:
-    KSDCMapping(const QFile *file, const uint size, const uint cacheSize, const uint pageSize)
+    KSDCMapping(const QFile *file, const uint size, const uint cacheSize, const uint pageSize, KSharedDataCache::MappingOptions options)
         : m_mapped(nullptr)
-        , m_lock()
+        , m_locks()
         , m_mapSize(size)
         , m_expectedType(LOCKTYPE_INVALID)
+        , m_options(options)
+        , m_fileBacked(false)
     {
         mapSharedMemory(file, size, cacheSize, pageSize);
     }
@@ -62,23 +66,33 @@ public:
         return !!m_mapped;
     }
 
-    bool lock() const
+    // Whether the cache is shared through its file, rather than being private
+    // to this KSharedDataCache, see mapSharedMemory().
+    bool isFileBacked() const
+    {
+        return m_mapped && m_fileBacked;
+    }
+
+    KSDCLock::LockResult lock(uint shard) const
     {
         if (Q_UNLIKELY(!m_mapped)) {
-            return false;
+            return KSDCLock::LockFailed;
+        }
+        if (Q_UNLIKELY(shard >= m_locks.size())) {
+            throw KSDCCorrupted("Invalid cache shard!");
         }
-        if (Q_LIKELY(m_mapped->shmLock.type == m_expectedType)) {
-            return m_lock->lock();
+        if (Q_LIKELY(m_mapped->shards()[shard].lock.type == m_expectedType)) {
+            return m_locks[shard]->lock();
         }
 
         // Wrong type --> corrupt!
         throw KSDCCorrupted("Invalid cache lock type!");
     }
 
-    void unlock() const
+    void unlock(uint shard) const
     {
-        if (Q_LIKELY(m_lock)) {
-            m_lock->unlock();
+        if (Q_LIKELY(shard < m_locks.size())) {
+            m_locks[shard]->unlock();
         }
     }
 
@@ -131,7 +145,8 @@ public:
         case KSharedDataCache::NoEvictionPreference: // fallthrough
         case KSharedDataCache::EvictLeastRecentlyUsed: // fallthrough
         case KSharedDataCache::EvictLeastOftenUsed: // fallthrough
-        case KSharedDataCache::EvictOldest:
+        case KSharedDataCache::EvictOldest: // fallthrough
+        case KSharedDataCache::EvictWithAdmissionFilter:
             break;
         default:
             return false;
@@ -149,9 +164,9 @@ private:
     // m_mapSize must already be set to the amount of memory mapped to m_mapped.
     void detachFromSharedMemory(const bool flush = false)
     {
-        // The lock holds a reference into shared memory, so this must be
+        // The locks hold a reference into shared memory, so they must be
         // cleared before m_mapped is removed.
-        m_lock.reset();
+        m_locks.clear();
 
         // Note that there is no other actions required to separate from the
         // shared memory segment, simply unmapping is enough. This makes things
@@ -173,6 +188,40 @@ private:
         m_mapSize = 0;
     }
 
+    // Adds the flags requested by m_options to the mmap() flags.
+    int mapFlags(int flags) const
+    {
+#ifdef MAP_POPULATE
+        if (m_options & KSharedDataCache::PrefaultMapping) {
+            flags |= MAP_POPULATE;
+        }
+#endif
+        return flags;
+    }
+
+    // Applies the remaining options once the cache is fully set up. None of
+    // them is required for the cache to work, so failures are ignored.
+    void applyMappingOptions()
+    {
+#if !defined(MAP_POPULATE) && defined(MADV_WILLNEED)
+        if (m_options & KSharedDataCache::PrefaultMapping) {
+            ::madvise(m_mapped, m_mapSize, MADV_WILLNEED);
+        }
+#endif
+#ifdef MADV_HUGEPAGE
+        if ((m_options & KSharedDataCache::HugePages) && ::madvise(m_mapped, m_mapSize, MADV_HUGEPAGE) != 0) {
+            qCDebug(KCOREADDONS_DEBUG) << "Unable to use huge pages for the cache:" << ::strerror(errno);
+        }
+#endif
+        if (m_options & KSharedDataCache::LockIndex) {
+            // Everything in front of the pages is needed to look up entries.
+            const uint indexSize = static_cast<const char *>(m_mapped->cachePages()) - reinterpret_cast<const char *>(m_mapped);
+            if (::mlock(m_mapped, qMin(indexSize, m_mapSize)) != 0) {
+                qCDebug(KCOREADDONS_DEBUG) << "Unable to lock the cache index into memory:" << ::strerror(errno);
+            }
+        }
+    }
+
     // This function does a lot of the important work, attempting to connect to shared
     // memory, a private anonymous mapping if that fails, and failing that, nothing (but
     // the cache remains "valid", we just don't actually do anything).
@@ -184,7 +233,7 @@ private:
             // Use mmap directly instead of QFile::map since the QFile (and its
             // shared mapping) will disappear unless we hang onto the QFile for no
             // reason (see the note below, we don't care about the file per se...)
-            mapAddress = QT_MMAP(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file->handle(), 0);
+            mapAddress = QT_MMAP(nullptr, size, PROT_READ | PROT_WRITE, mapFlags(MAP_SHARED), file->handle(), 0);
 
             // So... it is possible that someone else has mapped this cache already
             // with a larger size. If that's the case we need to at least match
@@ -216,15 +265,17 @@ private:
                 if (mapped->version != SharedMemory::PIXMAP_CACHE_VERSION && mapped->version > 0) {
                     detachFromSharedMemory(false);
                     throw KSDCCorrupted(QLatin1String("Wrong version of cache ") + file->fileName());
-                } else if (mapped->cacheSize > cacheSize) {
+                } else if (mapped->version > 0 && (mapped->cacheSize != cacheSize || mapped->cachePageSize() != pageSize)) {
+                    // The existing cache wins, even if it is smaller than
+                    // requested, e.g. after KSharedDataCache::resize().
                     // This order is very important. We must save the cache size
                     // before we remove the mapping, but unmap before overwriting
                     // the previous mapping size...
                     auto actualCacheSize = mapped->cacheSize;
                     auto actualPageSize = mapped->cachePageSize();
                     ::munmap(mapAddress, size);
-                    size = SharedMemory::totalSize(cacheSize, pageSize);
-                    mapAddress = QT_MMAP(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file->handle(), 0);
+                    size = SharedMemory::totalSize(actualCacheSize, actualPageSize);
+                    mapAddress = QT_MMAP(nullptr, size, PROT_READ | PROT_WRITE, mapFlags(MAP_SHARED), file->handle(), 0);
                     if (mapAddress != MAP_FAILED) {
                         cacheSize = actualCacheSize;
                         pageSize = actualPageSize;
@@ -247,10 +298,11 @@ private:
         // NOTE: We never use the on-disk representation independently of the
         // shared memory. If we don't get shared memory the disk info is ignored,
         // if we do get shared memory we never look at disk again.
-        if (!file || mapAddress == MAP_FAILED) {
+        m_fileBacked = file && mapAddress != MAP_FAILED;
+        if (!m_fileBacked) {
             qCWarning(KCOREADDONS_DEBUG) << "Couldn't establish file backed memory mapping, will fallback"
                                          << "to anonymous memory";
-            mapAddress = QT_MMAP(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            mapAddress = QT_MMAP(nullptr, size, PROT_READ | PROT_WRITE, mapFlags(MAP_SHARED | MAP_ANONYMOUS), -1, 0);
         }
 
         // Well now we're really hosed. We can still work, but we can't even cache
@@ -284,7 +336,7 @@ private:
             }
 
             if (m_mapped->ready.testAndSetAcquire(0, 1)) {
-                if (!m_mapped->performInitialSetup(cacheSize, pageSize)) {
+                if (!m_mapped->performInitialSetup(cacheSize, pageSize, m_options.testFlag(KSharedDataCache::RobustLocks))) {
                     qCCritical(KCOREADDONS_DEBUG) << "Unable to perform initial setup, this system probably "
                                                      "does not really support process-shared pthreads or "
                                                      "semaphores, even though it claims otherwise.";
@@ -300,20 +352,25 @@ private:
             }
         }
 
-        m_expectedType = m_mapped->shmLock.type;
-        m_lock.reset(createLockFromId(m_expectedType, m_mapped->shmLock));
-        bool isProcessSharingSupported = false;
+        // The locks were initialized by performInitialSetup(). They must not
+        // be initialized again here, another process may be holding one.
+        CacheShard *shards = m_mapped->shards();
+        const uint shardCount = m_mapped->shardCount();
+        m_expectedType = shards[0].lock.type;
 
-        if (!m_lock->initialize(isProcessSharingSupported)) {
-            qCCritical(KCOREADDONS_DEBUG) << "Unable to setup shared cache lock, although it worked when created.";
-            detachFromSharedMemory(false);
-            return;
+        for (uint i = 0; i < shardCount; ++i) {
+            m_locks.emplace_back(createLockFromId(m_expectedType, shards[i].lock));
         }
+
+        applyMappingOptions();
     }
 
-    std::unique_ptr<KSDCLock> m_lock;
+    // One lock per shard of the cache.
+    std::vector<std::unique_ptr<KSDCLock>> m_locks;
     uint m_mapSize;
     SharedLockId m_expectedType;
+    KSharedDataCache::MappingOptions m_options;
+    bool m_fileBacked;
 };
 
 #endif /* KSDCMEMORY_P_H */
@@ -13,6 +13,9 @@
 #include "ksdcmemory_p.h"
 
 #include <QByteArray>
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+#include <QtMath>
 
 //-----------------------------------------------------------------------------
 // MurmurHashAligned, by Austin Appleby
@@ -283,7 +286,7 @@ unsigned SharedMemory::cachePageSize() const
  * 2. Any member variable you add takes up space in shared memory as well,
  * so make sure you need it.
  */
-bool SharedMemory::performInitialSetup(uint _cacheSize, uint _pageSize)
+bool SharedMemory::performInitialSetup(uint _cacheSize, uint _pageSize, bool robustLocks)
 {
     if (_cacheSize < MINIMUM_CACHE_SIZE) {
         qCCritical(KCOREADDONS_DEBUG) << "Internal error: Attempted to create a cache sized < " << MINIMUM_CACHE_SIZE;
@@ -295,30 +298,44 @@ bool SharedMemory::performInitialSetup(uint _cacheSize, uint _pageSize)
         return false;
     }
 
-    shmLock.type = findBestSharedLock();
-    if (shmLock.type == LOCKTYPE_INVALID) {
+    // These must be updated to make some of our auxiliary functions
+    // work right since their values will be based on the cache size.
+    cacheSize = _cacheSize;
+    pageSize = _pageSize;
+
+    const SharedLockId lockType = findBestSharedLock(robustLocks);
+    if (lockType == LOCKTYPE_INVALID) {
         qCCritical(KCOREADDONS_DEBUG) << "Unable to find an appropriate lock to guard the shared cache. "
                                       << "This *should* be essentially impossible. :(";
         return false;
     }
 
-    bool isProcessShared = false;
-    std::unique_ptr<KSDCLock> tempLock(createLockFromId(shmLock.type, shmLock));
+    CacheShard *shardHeaders = shards();
+    for (uint i = 0; i < shardCount(); ++i) {
+        shardHeaders[i].lock.type = lockType;
 
-    if (!tempLock->initialize(isProcessShared)) {
-        qCCritical(KCOREADDONS_DEBUG) << "Unable to initialize the lock for the cache!";
-        return false;
+        bool isProcessShared = false;
+        std::unique_ptr<KSDCLock> tempLock(createLockFromId(lockType, shardHeaders[i].lock));
+
+        if (!tempLock->initialize(isProcessShared)) {
+            qCCritical(KCOREADDONS_DEBUG) << "Unable to initialize the lock for the cache!";
+            return false;
+        }
+
+        if (i == 0 && !isProcessShared) {
+            qCWarning(KCOREADDONS_DEBUG) << "Cache initialized, but does not support being"
+                                         << "shared across processes.";
+        }
+
+        shardHeaders[i].generation.storeRelaxed(0);
+        ::memset(static_cast<void *>(&shardHeaders[i].counters), 0, sizeof(CacheCounters));
     }
 
-    if (!isProcessShared) {
-        qCWarning(KCOREADDONS_DEBUG) << "Cache initialized, but does not support being"
-                                     << "shared across processes.";
+    for (QAtomicInt &tagGeneration : tagGenerations) {
+        tagGeneration.storeRelaxed(0);
     }
 
-    // These must be updated to make some of our auxiliary functions
-    // work right since their values will be based on the cache size.
-    cacheSize = _cacheSize;
-    pageSize = _pageSize;
+    retired.storeRelaxed(0);
     version = PIXMAP_CACHE_VERSION;
     cacheTimestamp = static_cast<unsigned>(::time(nullptr));
 
@@ -332,7 +349,15 @@ bool SharedMemory::performInitialSetup(uint _cacheSize, uint _pageSize)
 void SharedMemory::clearInternalTables()
 {
     // Assumes we're already locked somehow.
-    cacheAvail = pageTableSize();
+    CacheShard *shardHeaders = shards();
+    for (uint i = 0; i < shardCount(); ++i) {
+        shardHeaders[i].cacheAvail = shardPageCount();
+        shardHeaders[i].usedEntries = 0;
+        shardHeaders[i].defragmentCursor = 0;
+        shardHeaders[i].expiringEntries = 0;
+        shardHeaders[i].expiryCursor = 0;
+        ::memset(&shardHeaders[i].sketch, 0, sizeof(FrequencySketch));
+    }
 
     // Setup page tables to point nowhere
     PageTableEntry *table = pageTable();
@@ -340,23 +365,102 @@ void SharedMemory::clearInternalTables()
         table[i].index = -1;
     }
 
+    for (uint i = 0; i < shardCount(); ++i) {
+        updateFreeRuns(i * shardPageCount(), shardPageCount());
+    }
+
     // Setup index tables to be accurate.
-    IndexTableEntry *indices = indexTable();
     for (uint i = 0; i < indexTableSize(); ++i) {
-        indices[i].firstPage = -1;
-        indices[i].useCount = 0;
-        indices[i].fileNameHash = 0;
-        indices[i].totalItemSize = 0;
-        indices[i].addTime = 0;
-        indices[i].lastUsedTime = 0;
+        clearEntry(i);
     }
 }
 
-const IndexTableEntry *SharedMemory::indexTable() const
+void SharedMemory::beginWrite(uint shard)
 {
-    // Index Table goes immediately after this struct, at the first byte
+    // Make the odd value visible before any of the following writes. A writer
+    // which died in the middle of a modification, see pthreadRobustLock,
+    // leaves an odd value behind.
+    QAtomicInt &generation = shards()[shard].generation;
+    generation.fetchAndAddOrdered((generation.loadRelaxed() & 1) ? 2 : 1);
+}
+
+void SharedMemory::endWrite(uint shard)
+{
+    shards()[shard].generation.fetchAndAddRelease(1);
+}
+
+uint SharedMemory::shardCountFor(uint numberPages)
+{
+    uint count = 1;
+    while (count < MAX_SHARD_COUNT && numberPages / (2 * count) >= MINIMUM_SHARD_PAGES) {
+        count *= 2;
+    }
+
+    return count;
+}
+
+uint SharedMemory::shardCount() const
+{
+    return shardCountFor(pageTableSize());
+}
+
+const CacheShard *SharedMemory::shards() const
+{
+    // The shard headers go immediately after this struct, at the first byte
     // where alignment constraints are met (accounted for by offsetAs).
-    return offsetAs<IndexTableEntry>(this, sizeof(*this));
+    return offsetAs<CacheShard>(this, sizeof(*this));
+}
+
+CacheShard *SharedMemory::shards()
+{
+    const SharedMemory *that = const_cast<const SharedMemory *>(this);
+    return const_cast<CacheShard *>(that->shards());
+}
+
+uint SharedMemory::shardFor(uint keyHash) const
+{
+    // The low bits pick the position within the shard, so use the high ones
+    // here. The shard count is always a power of 2.
+    return (keyHash >> 24) & (shardCount() - 1);
+}
+
+CacheCounters &SharedMemory::countersFor(uint keyHash)
+{
+    return shards()[shardFor(keyHash)].counters;
+}
+
+uint SharedMemory::shardIndexSize() const
+{
+    // Assume 2 pages on average are needed -> the number of entries
+    // would be half of the number of pages.
+    return shardPageCount() / 2;
+}
+
+uint SharedMemory::shardPageCount() const
+{
+    // If the pages can't be split evenly the remainder is simply not used.
+    return pageTableSize() / shardCount();
+}
+
+uint SharedMemory::cacheAvail() const
+{
+    uint result = 0;
+    const CacheShard *shardHeaders = shards();
+    for (uint i = 0; i < shardCount(); ++i) {
+        result += shardHeaders[i].cacheAvail;
+    }
+
+    return result;
+}
+
+const IndexTableEntry *SharedMemory::indexTable() const
+{
+    // Index Table goes immediately after the shard headers, at the first byte
+    // where alignment constraints are met.
+    const CacheShard *base = shards();
+    base += shardCount();
+
+    return alignTo<IndexTableEntry>(base);
 }
 
 const PageTableEntry *SharedMemory::pageTable() const
@@ -368,13 +472,26 @@ const PageTableEntry *SharedMemory::pageTable() const
     return alignTo<PageTableEntry>(base);
 }
 
+const FreeRunNode *SharedMemory::freeRunTree(uint shard) const
+{
+    const PageTableEntry *base = pageTable();
+    base += pageTableSize();
+
+    return alignTo<FreeRunNode>(base) + shard * freeRunLeafCount();
+}
+
 const void *SharedMemory::cachePages() const
 {
-    const PageTableEntry *tableStart = pageTable();
-    tableStart += pageTableSize();
+    const FreeRunNode *tableStart = freeRunTree(shardCount());
 
-    // Let's call wherever we end up the start of the data...
-    return alignTo<void>(tableStart, cachePageSize());
+    // Let's call wherever we end up the start of the data... The alignment is
+    // relative to the start of the segment, as every process may have mapped
+    // it at a different address and they all need to agree on the offset.
+    const char *base = reinterpret_cast<const char *>(this);
+    const quintptr tableEnd = reinterpret_cast<const char *>(tableStart) - base;
+    const quintptr mask = cachePageSize() - 1;
+
+    return base + ((tableEnd + mask) & ~mask);
 }
 
 const void *SharedMemory::page(pageID at) const
@@ -406,6 +523,12 @@ PageTableEntry *SharedMemory::pageTable()
     return const_cast<PageTableEntry *>(that->pageTable());
 }
 
+FreeRunNode *SharedMemory::freeRunTree(uint shard)
+{
+    const SharedMemory *that = const_cast<const SharedMemory *>(this);
+    return const_cast<FreeRunNode *>(that->freeRunTree(shard));
+}
+
 void *SharedMemory::cachePages()
 {
     const SharedMemory *that = const_cast<const SharedMemory *>(this);
@@ -425,42 +548,391 @@ uint SharedMemory::pageTableSize() const
 
 uint SharedMemory::indexTableSize() const
 {
-    // Assume 2 pages on average are needed -> the number of entries
-    // would be half of the number of pages.
-    return pageTableSize() / 2;
+    return shardIndexSize() * shardCount();
+}
+
+uint SharedMemory::freeRunLeafCountFor(uint shardPageCount)
+{
+    return shardPageCount > 1 ? qNextPowerOfTwo(shardPageCount - 1) : 1;
+}
+
+uint SharedMemory::freeRunLeafCount() const
+{
+    return freeRunLeafCountFor(shardPageCount());
+}
+
+// Returns node @p node of a free run @p tree with @p leafCount leaves. The
+// leaves are computed from the @p pages of the shard instead.
+static FreeRunNode freeRunNode(const FreeRunNode *tree, uint leafCount, const PageTableEntry *pages, uint pageCount, uint node)
+{
+    if (node < leafCount) {
+        return tree[node];
+    }
+
+    const uint page = node - leafCount;
+    const uint free = (page < pageCount && pages[page].index < 0) ? 1 : 0;
+    return FreeRunNode{free, free, free};
+}
+
+void SharedMemory::updateFreeRuns(pageID firstPage, uint count)
+{
+    if (count == 0) {
+        return;
+    }
+
+    const uint shard = static_cast<uint>(firstPage) / shardPageCount();
+    const uint firstShardPage = shard * shardPageCount();
+    if (Q_UNLIKELY(firstPage < 0 || shard >= shardCount() || firstPage + count > firstShardPage + shardPageCount())) {
+        throw KSDCCorrupted();
+    }
+
+    // Recompute the ancestors of the changed leaves, one level at a time.
+    FreeRunNode *tree = freeRunTree(shard);
+    const PageTableEntry *pages = pageTable() + firstShardPage;
+    const uint pageCount = shardPageCount();
+    const uint leafCount = freeRunLeafCount();
+    uint first = leafCount + (firstPage - firstShardPage);
+    uint last = first + count - 1;
+    for (uint half = 1; first > 1; half *= 2) {
+        first /= 2;
+        last /= 2;
+
+        for (uint node = first; node <= last; ++node) {
+            const FreeRunNode left = freeRunNode(tree, leafCount, pages, pageCount, 2 * node);
+            const FreeRunNode right = freeRunNode(tree, leafCount, pages, pageCount, 2 * node + 1);
+
+            tree[node].prefix = left.prefix == half ? half + right.prefix : left.prefix;
+            tree[node].suffix = right.suffix == half ? half + left.suffix : right.suffix;
+            tree[node].longest = qMax(qMax(left.longest, right.longest), left.suffix + right.prefix);
+        }
+    }
 }
 
 /*
  * Returns the index of the first page, for the set of contiguous
- * pages that can hold pagesNeeded PAGES.
+ * pages within shard that can hold pagesNeeded PAGES.
  */
-pageID SharedMemory::findEmptyPages(uint pagesNeeded) const
+pageID SharedMemory::findEmptyPages(uint shard, uint pagesNeeded) const
 {
-    if (Q_UNLIKELY(pagesNeeded > pageTableSize())) {
+    if (Q_UNLIKELY(pagesNeeded == 0 || pagesNeeded > shardPageCount())) {
         return pageTableSize();
     }
 
-    // Loop through the page table, find the first empty page, and just
-    // makes sure that there are enough free pages.
-    const PageTableEntry *table = pageTable();
-    uint contiguousPagesFound = 0;
-    pageID base = 0;
-    for (pageID i = 0; i < static_cast<int>(pageTableSize()); ++i) {
-        if (table[i].index < 0) {
-            if (contiguousPagesFound == 0) {
-                base = i;
-            }
-            contiguousPagesFound++;
+    const FreeRunNode *tree = freeRunTree(shard);
+    const PageTableEntry *pages = pageTable() + shard * shardPageCount();
+    const uint pageCount = shardPageCount();
+    const uint leafCount = freeRunLeafCount();
+    if (freeRunNode(tree, leafCount, pages, pageCount, 1).longest < pagesNeeded) {
+        return pageTableSize();
+    }
+
+    // Descend towards the first run which is long enough. It is either in the
+    // left child, or crosses the middle, or is in the right child.
+    uint node = 1;
+    uint offset = 0;
+    for (uint half = leafCount / 2; node < leafCount; half /= 2) {
+        const FreeRunNode left = freeRunNode(tree, leafCount, pages, pageCount, 2 * node);
+        const FreeRunNode right = freeRunNode(tree, leafCount, pages, pageCount, 2 * node + 1);
+
+        if (left.longest >= pagesNeeded) {
+            node = 2 * node;
+        } else if (left.suffix + right.prefix >= pagesNeeded) {
+            offset += half - left.suffix;
+            break;
         } else {
-            contiguousPagesFound = 0;
+            node = 2 * node + 1;
+            offset += half;
+        }
+    }
+
+    // The tree is derived from the page table, so double check that they
+    // agree before handing out the pages.
+    if (Q_UNLIKELY(offset + pagesNeeded > pageCount)) {
+        throw KSDCCorrupted();
+    }
+
+    for (uint i = 0; i < pagesNeeded; ++i) {
+        if (Q_UNLIKELY(pages[offset + i].index >= 0)) {
+            qCCritical(KCOREADDONS_DEBUG) << "The free run tree does not match the page table -- cache is corrupt, clearing.";
+            throw KSDCCorrupted();
+        }
+    }
+
+    return shard * pageCount + offset;
+}
+
+bool SharedMemory::isPinned(const IndexTableEntry &entry)
+{
+    return entry.pinCount > 0 && (::time(nullptr) - entry.pinTime) < PIN_LEASE_TIME;
+}
+
+void SharedMemory::unpinEntry(pageID firstPage)
+{
+    if (firstPage < 0 || static_cast<uint>(firstPage) >= pageTableSize()) {
+        return;
+    }
+
+    // The entry may have been removed by clear() or after its pin expired, in
+    // that case there is nothing to release anymore.
+    const qint32 index = pageTable()[firstPage].index;
+    if (index < 0 || static_cast<uint>(index) >= indexTableSize()) {
+        return;
+    }
+
+    IndexTableEntry &entry = indexTable()[index];
+    if (entry.firstPage == firstPage && entry.pinCount > 0) {
+        entry.pinCount--;
+    }
+}
+
+uint SharedMemory::probeDistance(uint index) const
+{
+    const uint size = shardIndexSize();
+    const uint home = indexTable()[index].fileNameHash % size;
+
+    return (index % size + size - home) % size;
+}
+
+uint SharedMemory::insertEntry(uint shard, IndexTableEntry entry)
+{
+    CacheShard &shardHeader = shards()[shard];
+    const uint size = shardIndexSize();
+    if (shardHeader.usedEntries >= size) {
+        qCCritical(KCOREADDONS_DEBUG) << "Internal error: Inserting into a full index table.";
+        throw KSDCCorrupted();
+    }
+
+    if (canExpire(entry)) {
+        shardHeader.expiringEntries++;
+    }
+
+    const IndexTableEntry *indices = indexTable();
+    const uint firstShardEntry = shard * size;
+    const pageID firstPage = entry.firstPage;
+    const uint pagesUsed = intCeil(entry.totalItemSize, cachePageSize());
+    uint position = firstShardEntry + entry.fileNameHash % size;
+    uint distance = 0;
+    uint result = indexTableSize();
+
+    for (uint probe = 0; probe < size; ++probe) {
+        if (indices[position].firstPage < 0) {
+            storeEntry(position, entry);
+            shardHeader.usedEntries++;
+
+            // Entries which were only moved keep their pages.
+            updateFreeRuns(firstPage, pagesUsed);
+            return result < indexTableSize() ? result : position;
+        }
+
+        // Take the place of entries which are closer to their home position
+        // than the one being inserted, and carry on inserting them instead.
+        // This keeps the probe distances even, and sorted along each run.
+        const uint existingDistance = probeDistance(position);
+        if (existingDistance < distance) {
+            const IndexTableEntry displaced = indices[position];
+            storeEntry(position, entry);
+            if (result == indexTableSize()) {
+                result = position;
+            }
+
+            entry = displaced;
+            distance = existingDistance;
+        }
+
+        position = firstShardEntry + (position - firstShardEntry + 1) % size;
+        ++distance;
+    }
+
+    // usedEntries claimed there was room.
+    throw KSDCCorrupted();
+}
+
+bool SharedMemory::evictEntry(uint shard, const uint *candidateHash)
+{
+    // Instead of sorting all entries, only look at a few of them and evict the
+    // one which comes first in the eviction order. Entries are placed by their
+    // hash, so the ones following a random position are a random sample too.
+    const EntryCompare compareFunction = evictionCompare();
+    const IndexTableEntry *indices = indexTable();
+    const uint size = shardIndexSize();
+    const uint firstShardEntry = shard * size;
+    const uint start = QRandomGenerator::global()->bounded(size);
+
+    const time_t now = ::time(nullptr);
+
+    qint32 victim = -1;
+    bool expired = false;
+    uint sampled = 0;
+    for (uint i = 0; i < size && sampled < EVICTION_SAMPLE_SIZE; ++i) {
+        const uint position = firstShardEntry + (start + i) % size;
+        if (indices[position].firstPage < 0 || isPinned(indices[position])) {
+            continue;
+        }
+
+        // Nobody can find this one anymore anyway.
+        if (isExpired(indices[position], now)) {
+            victim = position;
+            expired = true;
+            break;
+        }
+
+        ++sampled;
+        if (victim < 0 || compareFunction(indices[position], indices[victim])) {
+            victim = position;
+        }
+    }
+
+    if (victim < 0) {
+        return false;
+    }
+
+    // Only make room for entries which are likely to be requested again, so
+    // that a scan over many keys that are each requested once does not
+    // evict everything else.
+    if (!expired && candidateHash && evictionPolicy.loadRelaxed() == KSharedDataCache::EvictWithAdmissionFilter
+        && requestFrequency(*candidateHash) <= requestFrequency(indices[victim].fileNameHash)) {
+        qCDebug(KCOREADDONS_DEBUG) << "Not evicting a more frequently requested entry of" << indices[victim].totalItemSize << "size";
+        return false;
+    }
+
+    qCDebug(KCOREADDONS_DEBUG) << "Removing entry of" << indices[victim].totalItemSize << "size";
+    removeEntry(victim);
+    CacheCounters &counters = shards()[shard].counters;
+    (expired ? counters.expirations : counters.evictions).fetchAndAddRelaxed(1);
+    return true;
+}
+
+bool SharedMemory::canExpire(const IndexTableEntry &entry)
+{
+    return entry.expiryTime != 0 || entry.tag != 0;
+}
+
+bool SharedMemory::isExpired(const IndexTableEntry &entry, time_t now) const
+{
+    if (entry.expiryTime != 0 && entry.expiryTime <= now) {
+        return true;
+    }
+
+    return entry.tag != 0 && entry.tagGeneration != tagGeneration(entry.tag);
+}
+
+uint SharedMemory::tagFor(const QByteArray &tag)
+{
+    return 1 + generateHash(tag) % TAG_SLOT_COUNT;
+}
+
+void SharedMemory::invalidateTag(uint tag)
+{
+    if (tag == 0 || tag > TAG_SLOT_COUNT) {
+        return;
+    }
+
+    tagGenerations[tag - 1].fetchAndAddOrdered(1);
+}
+
+uint SharedMemory::tagGeneration(uint tag) const
+{
+    // Tags of entries come from the cache, so they have to be checked.
+    if (tag == 0 || tag > TAG_SLOT_COUNT) {
+        return 0;
+    }
+
+    return tagGenerations[tag - 1].loadAcquire();
+}
+
+uint SharedMemory::removeExpiredEntries(uint shard, uint scanCount)
+{
+    CacheShard &shardHeader = shards()[shard];
+    if (shardHeader.expiringEntries == 0) {
+        return 0;
+    }
+
+    const IndexTableEntry *indices = indexTable();
+    const uint size = shardIndexSize();
+    const uint firstShardEntry = shard * size;
+    const time_t now = ::time(nullptr);
+    uint cursor = shardHeader.expiryCursor % size;
+    uint removed = 0;
+
+    for (uint i = 0; i < qMin(scanCount, size); ++i) {
+        // Removing an entry moves the following one into its place, so look
+        // at the same position again, like clear() does.
+        const uint position = firstShardEntry + cursor;
+        while (indices[position].firstPage >= 0 && isExpired(indices[position], now) && !isPinned(indices[position])) {
+            removeEntry(position);
+            ++removed;
+        }
+
+        cursor = (cursor + 1) % size;
+    }
+
+    shardHeader.expiryCursor = cursor;
+    shardHeader.counters.expirations.fetchAndAddRelaxed(removed);
+    return removed;
+}
+
+// Maps @p keyHash to a counter of @p row of a FrequencySketch.
+static uint sketchColumn(uint keyHash, uint row)
+{
+    // Multiplying by different odd constants gives independent enough
+    // hashes for the rows, the top bits depend on all bits of the key hash.
+    static const quint32 seeds[FrequencySketch::DEPTH] = {0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu};
+    static_assert(FrequencySketch::WIDTH == 1024, "Adjust the shift below");
+
+    return (keyHash * seeds[row]) >> (32 - 10);
+}
+
+void SharedMemory::recordRequest(uint keyHash)
+{
+    if (evictionPolicy.loadRelaxed() != KSharedDataCache::EvictWithAdmissionFilter) {
+        return;
+    }
+
+    FrequencySketch &sketch = shards()[shardFor(keyHash)].sketch;
+    for (uint row = 0; row < FrequencySketch::DEPTH; ++row) {
+        quint8 &counter = sketch.counters[row][sketchColumn(keyHash, row)];
+        if (counter < FrequencySketch::MAXIMUM_COUNT) {
+            ++counter;
         }
+    }
 
-        if (contiguousPagesFound == pagesNeeded) {
-            return base;
+    // Age all counters once enough requests have been seen.
+    if (++sketch.requests >= 10 * shardIndexSize()) {
+        for (uint row = 0; row < FrequencySketch::DEPTH; ++row) {
+            for (uint column = 0; column < FrequencySketch::WIDTH; ++column) {
+                sketch.counters[row][column] /= 2;
+            }
         }
+        sketch.requests = 0;
     }
+}
+
+uint SharedMemory::requestFrequency(uint keyHash) const
+{
+    const FrequencySketch &sketch = shards()[shardFor(keyHash)].sketch;
+    uint result = FrequencySketch::MAXIMUM_COUNT;
+    for (uint row = 0; row < FrequencySketch::DEPTH; ++row) {
+        result = qMin<uint>(result, sketch.counters[row][sketchColumn(keyHash, row)]);
+    }
+
+    return result;
+}
+
+SharedMemory::EntryCompare SharedMemory::evictionCompare() const
+{
+    switch (evictionPolicy.loadRelaxed()) {
+    case KSharedDataCache::EvictLeastOftenUsed:
+    case KSharedDataCache::NoEvictionPreference:
+    default:
+        return seldomUsedCompare;
+
+    case KSharedDataCache::EvictLeastRecentlyUsed:
+    case KSharedDataCache::EvictWithAdmissionFilter:
+        return lruCompare;
 
-    return pageTableSize();
+    case KSharedDataCache::EvictOldest:
+        return ageCompare;
+    }
 }
 
 // left < right?
@@ -510,23 +982,43 @@ bool SharedMemory::ageCompare(const IndexTableEntry &l, const IndexTableEntry &r
     return l.addTime < r.addTime;
 }
 
-void SharedMemory::defragment()
+bool SharedMemory::defragment(uint shard, uint pageBudget)
 {
-    if (cacheAvail * cachePageSize() == cacheSize) {
-        return; // That was easy
+    CacheShard &shardHeader = shards()[shard];
+    if (shardHeader.cacheAvail == shardPageCount()) {
+        shardHeader.defragmentCursor = 0;
+        return true; // That was easy
     }
 
-    qCDebug(KCOREADDONS_DEBUG) << "Defragmenting the shared cache";
+    qCDebug(KCOREADDONS_DEBUG) << "Defragmenting shard" << shard << "of the shared cache";
+
+    // A pass which was resumed in the middle of the shard leaves the holes
+    // in front of where it started, so it's followed by one from the start.
+    const bool resumed = shardHeader.defragmentCursor > 0;
+    uint pagesMoved = 0;
+    QElapsedTimer timer;
+    timer.start();
+
+    const bool finished = compactPages(shard, pageBudget, pagesMoved) && (!resumed || compactPages(shard, pageBudget, pagesMoved));
 
+    shardHeader.counters.defragmentations.fetchAndAddRelaxed(1);
+    shardHeader.counters.defragmentationTime.fetchAndAddRelaxed(timer.nsecsElapsed());
+    return finished;
+}
+
+bool SharedMemory::compactPages(uint shard, uint pageBudget, uint &pagesMoved)
+{
     // Just do a linear scan, and anytime there is free space, swap it
     // with the pages to its right. In order to meet the precondition
     // we need to skip any used pages first.
 
-    pageID currentPage = 0;
-    pageID idLimit = static_cast<pageID>(pageTableSize());
+    CacheShard &shardHeader = shards()[shard];
+    const pageID firstShardPage = shard * shardPageCount();
+    pageID currentPage = firstShardPage + static_cast<pageID>(qMin(shardHeader.defragmentCursor, shardPageCount()));
+    pageID idLimit = firstShardPage + static_cast<pageID>(shardPageCount());
     PageTableEntry *pages = pageTable();
 
-    if (Q_UNLIKELY(!pages || idLimit <= 0)) {
+    if (Q_UNLIKELY(!pages || idLimit <= firstShardPage || static_cast<uint>(idLimit) > pageTableSize())) {
         throw KSDCCorrupted();
     }
 
@@ -536,10 +1028,18 @@ void SharedMemory::defragment()
     }
 
     pageID freeSpot = currentPage;
+    const pageID firstChangedPage = freeSpot;
 
     // Main loop, starting from a free page, skip to the used pages and
     // move them back.
     while (currentPage < idLimit) {
+        // Out of budget, continue from the first free page next time.
+        if (pageBudget > 0 && pagesMoved >= pageBudget) {
+            shardHeader.defragmentCursor = freeSpot - firstShardPage;
+            updateFreeRuns(firstChangedPage, currentPage - firstChangedPage);
+            return false;
+        }
+
         // Find the next used page
         while (currentPage < idLimit && pages[currentPage].index < 0) {
             ++currentPage;
@@ -551,10 +1051,21 @@ void SharedMemory::defragment()
 
         // Found an entry, move it.
         qint32 affectedIndex = pages[currentPage].index;
-        if (Q_UNLIKELY(affectedIndex < 0 || affectedIndex >= idLimit || indexTable()[affectedIndex].firstPage != currentPage)) {
+        if (Q_UNLIKELY(affectedIndex < 0 || static_cast<uint>(affectedIndex) >= indexTableSize() || indexTable()[affectedIndex].firstPage != currentPage)) {
             throw KSDCCorrupted();
         }
 
+        // Pinned entries must stay where they are, so they act as a wall.
+        // Continue with the first free page behind them.
+        if (isPinned(indexTable()[affectedIndex])) {
+            while (currentPage < idLimit && pages[currentPage].index >= 0) {
+                ++currentPage;
+            }
+
+            freeSpot = currentPage;
+            continue;
+        }
+
         indexTable()[affectedIndex].firstPage = freeSpot;
 
         // Moving one page at a time guarantees we can use memcpy safely
@@ -574,6 +1085,7 @@ void SharedMemory::defragment()
             pages[currentPage].index = -1;
             ++currentPage;
             ++freeSpot;
+            ++pagesMoved;
 
             // If we've just moved the very last page and it happened to
             // be at the very end of the cache then we're done.
@@ -584,7 +1096,12 @@ void SharedMemory::defragment()
             // We're moving consecutive used pages whether they belong to
             // our affected entry or not, so detect if we've started moving
             // the data for a different entry and adjust if necessary.
-            if (affectedIndex != pages[currentPage].index) {
+            if (affectedIndex != pages[currentPage].index && pages[currentPage].index >= 0) {
+                // The outer loop deals with pinned entries, and the budget.
+                if (isPinned(indexTable()[pages[currentPage].index]) || (pageBudget > 0 && pagesMoved >= pageBudget)) {
+                    break;
+                }
+
                 indexTable()[pages[currentPage].index].firstPage = freeSpot;
             }
             affectedIndex = pages[currentPage].index;
@@ -594,6 +1111,10 @@ void SharedMemory::defragment()
         // cycle repeats. However, currentPage is not the first unused
         // page, freeSpot is, so leave it alone.
     }
+
+    shardHeader.defragmentCursor = 0;
+    updateFreeRuns(firstChangedPage, currentPage - firstChangedPage);
+    return true;
 }
 
 /*
@@ -604,23 +1125,27 @@ void SharedMemory::defragment()
  */
 qint32 SharedMemory::findNamedEntry(const QByteArray &key) const
 {
-    uint keyHash = SharedMemory::generateHash(key);
-    uint position = keyHash % indexTableSize();
-    uint probeNumber = 1; // See insert() for description
-
-    // Imagine 3 entries A, B, C in this logical probing chain. If B is
-    // later removed then we can't find C either. So, we must keep
-    // searching for probeNumber number of tries (or we find the item,
-    // obviously).
-    while (indexTable()[position].fileNameHash != keyHash && probeNumber < MAX_PROBE_COUNT) {
-        position = (keyHash + (probeNumber + probeNumber * probeNumber) / 2) % indexTableSize();
-        probeNumber++;
-    }
+    const uint keyHash = SharedMemory::generateHash(key);
+    const uint size = shardIndexSize();
+    const uint firstShardEntry = shardFor(keyHash) * size;
+    const uint home = keyHash % size;
+    const IndexTableEntry *indices = indexTable();
+
+    // Entries along a run of used entries are sorted by their distance from
+    // their home position (see insertEntry()), so once an entry is closer to
+    // its home than the key would be to its own the key can't be in the table.
+    // The distance limit only matters if a writer is modifying the table
+    // concurrently, see KSharedDataCache::Private::lockFreeFind().
+    for (uint distance = 0; distance < size; ++distance) {
+        const uint position = firstShardEntry + (home + distance) % size;
+        const pageID firstPage = indices[position].firstPage;
+        if (firstPage < 0 || probeDistance(position) < distance) {
+            break;
+        }
 
-    if (indexTable()[position].fileNameHash == keyHash) {
-        pageID firstPage = indexTable()[position].firstPage;
-        if (firstPage < 0 || static_cast<uint>(firstPage) >= pageTableSize()) {
-            return -1;
+        // Different keys may share a hash, the key itself has to be compared.
+        if (indices[position].fileNameHash != keyHash || static_cast<uint>(firstPage) >= pageTableSize()) {
+            continue;
         }
 
         const void *resultPage = page(firstPage);
@@ -634,13 +1159,7 @@ qint32 SharedMemory::findNamedEntry(const QByteArray &key) const
         }
     }
 
-    return -1; // Not found, or a different one found.
-}
-
-// Function to use with std::unique_ptr in removeUsedPages below...
-void SharedMemory::deleteTable(IndexTableEntry *table)
-{
-    delete[] table;
+    return -1; // Not found
 }
 
 /*
@@ -653,19 +1172,21 @@ void SharedMemory::deleteTable(IndexTableEntry *table)
  *         request can be filled.
  * @internal
  */
-uint SharedMemory::removeUsedPages(uint numberNeeded)
+uint SharedMemory::removeUsedPages(uint shard, uint numberNeeded, uint defragmentBudget, const uint *candidateHash)
 {
     if (numberNeeded == 0) {
         qCCritical(KCOREADDONS_DEBUG) << "Internal error: Asked to remove exactly 0 pages for some reason.";
         throw KSDCCorrupted();
     }
 
-    if (numberNeeded > pageTableSize()) {
-        qCCritical(KCOREADDONS_DEBUG) << "Internal error: Requested more space than exists in the cache.";
-        qCCritical(KCOREADDONS_DEBUG) << numberNeeded << "requested, " << pageTableSize() << "is the total possible.";
+    if (numberNeeded > shardPageCount()) {
+        qCCritical(KCOREADDONS_DEBUG) << "Internal error: Requested more space than exists in the cache shard.";
+        qCCritical(KCOREADDONS_DEBUG) << numberNeeded << "requested, " << shardPageCount() << "is the total possible.";
         throw KSDCCorrupted();
     }
 
+    const uint &cacheAvail = shards()[shard].cacheAvail;
+
     // If the cache free space is large enough we will defragment first
     // instead since it's likely we're highly fragmented.
     // Otherwise, we will (eventually) simply remove entries per the
@@ -675,105 +1196,38 @@ uint SharedMemory::removeUsedPages(uint numberNeeded)
     qCDebug(KCOREADDONS_DEBUG) << "Removing old entries to free up" << numberNeeded << "pages," << cacheAvail << "are already theoretically available.";
 
     if (cacheAvail > 3 * numberNeeded) {
-        defragment();
-        uint result = findEmptyPages(numberNeeded);
+        const bool compacted = defragment(shard, defragmentBudget);
+        uint result = findEmptyPages(shard, numberNeeded);
 
         if (result < pageTableSize()) {
             return result;
-        } else {
+        } else if (compacted) {
             qCCritical(KCOREADDONS_DEBUG) << "Just defragmented a locked cache, but still there"
                                           << "isn't enough room for the current request.";
         }
     }
 
-    // At this point we know we'll have to free some space up, so sort our
-    // list of entries by whatever the current criteria are and start
-    // killing expired entries.
-    std::unique_ptr<IndexTableEntry, decltype(deleteTable) *> tablePtr(new IndexTableEntry[indexTableSize()], deleteTable);
-
-    if (!tablePtr) {
-        qCCritical(KCOREADDONS_DEBUG) << "Unable to allocate temporary memory for sorting the cache!";
-        clearInternalTables();
-        throw KSDCCorrupted();
-    }
-
-    // We use tablePtr to ensure the data is destroyed, but do the access
-    // via a helper pointer to allow for array ops.
-    IndexTableEntry *table = tablePtr.get();
-
-    ::memcpy(table, indexTable(), sizeof(IndexTableEntry) * indexTableSize());
-
-    // Our entry ID is simply its index into the
-    // index table, which qSort will rearrange all willy-nilly, so first
-    // we'll save the *real* entry ID into firstPage (which is useless in
-    // our copy of the index table). On the other hand if the entry is not
-    // used then we note that with -1.
-    for (uint i = 0; i < indexTableSize(); ++i) {
-        table[i].firstPage = table[i].useCount > 0 ? static_cast<pageID>(i) : -1;
-    }
-
-    // Declare the comparison function that we'll use to pass to qSort,
-    // based on our cache eviction policy.
-    bool (*compareFunction)(const IndexTableEntry &, const IndexTableEntry &);
-    switch (evictionPolicy.loadRelaxed()) {
-    case KSharedDataCache::EvictLeastOftenUsed:
-    case KSharedDataCache::NoEvictionPreference:
-    default:
-        compareFunction = seldomUsedCompare;
-        break;
-
-    case KSharedDataCache::EvictLeastRecentlyUsed:
-        compareFunction = lruCompare;
-        break;
-
-    case KSharedDataCache::EvictOldest:
-        compareFunction = ageCompare;
-        break;
-    }
-
-    std::sort(table, table + indexTableSize(), compareFunction);
-
-    // Least recently used entries will be in the front.
-    // Start killing until we have room.
-
-    // Note on removeEntry: It expects an index into the index table,
-    // but our sorted list is all jumbled. But we stored the real index
-    // in the firstPage member.
-    // Remove entries until we've removed at least the required number
-    // of pages.
-    uint i = 0;
-    while (i < indexTableSize() && numberNeeded > cacheAvail) {
-        int curIndex = table[i++].firstPage; // Really an index, not a page
-
-        // Removed everything, still no luck (or curIndex is set but too high).
-        if (curIndex < 0 || static_cast<uint>(curIndex) >= indexTableSize()) {
-            qCCritical(KCOREADDONS_DEBUG) << "Trying to remove index" << curIndex << "out-of-bounds for index table of size" << indexTableSize();
-            throw KSDCCorrupted();
+    // At this point we know we'll have to free some space up, so start
+    // evicting entries (see evictEntry()) until there is enough room.
+    while (numberNeeded > cacheAvail) {
+        // Removed everything but the pinned entries (or those which are more
+        // popular than the candidate), there's nothing more we can do.
+        if (!evictEntry(shard, candidateHash)) {
+            break;
         }
-
-        qCDebug(KCOREADDONS_DEBUG) << "Removing entry of" << indexTable()[curIndex].totalItemSize << "size";
-        removeEntry(curIndex);
     }
 
     // At this point let's see if we have freed up enough data by
     // defragmenting first and seeing if we can find that free space.
-    defragment();
+    defragment(shard, defragmentBudget);
 
     pageID result = pageTableSize();
-    while (i < indexTableSize() && (static_cast<uint>(result = findEmptyPages(numberNeeded))) >= pageTableSize()) {
-        int curIndex = table[i++].firstPage;
-
-        if (curIndex < 0) {
+    while ((static_cast<uint>(result = findEmptyPages(shard, numberNeeded))) >= pageTableSize()) {
+        if (!evictEntry(shard, candidateHash)) {
             // One last shot.
-            defragment();
-            return findEmptyPages(numberNeeded);
+            defragment(shard, defragmentBudget);
+            return findEmptyPages(shard, numberNeeded);
         }
-
-        if (Q_UNLIKELY(static_cast<uint>(curIndex) >= indexTableSize())) {
-            throw KSDCCorrupted();
-        }
-
-        removeEntry(curIndex);
     }
 
     // Whew.
@@ -784,21 +1238,30 @@ uint SharedMemory::removeUsedPages(uint numberNeeded)
 uint SharedMemory::totalSize(uint cacheSize, uint effectivePageSize)
 {
     uint numberPages = intCeil(cacheSize, effectivePageSize);
-    uint indexTableSize = numberPages / 2;
+
+    // pageTableSize() rounds down, so the shards have to as well.
+    uint usablePages = cacheSize / effectivePageSize;
+    uint shardCount = shardCountFor(usablePages);
+    uint indexTableSize = (usablePages / shardCount / 2) * shardCount;
 
     // Knowing the number of pages, we can determine what addresses we'd be
     // using (properly aligned), and from there determine how much memory
     // we'd use.
-    IndexTableEntry *indexTableStart = offsetAs<IndexTableEntry>(static_cast<void *>(nullptr), sizeof(SharedMemory));
+    CacheShard *shardsStart = offsetAs<CacheShard>(static_cast<void *>(nullptr), sizeof(SharedMemory));
+    shardsStart += shardCount;
 
+    IndexTableEntry *indexTableStart = alignTo<IndexTableEntry>(shardsStart);
     indexTableStart += indexTableSize;
 
     PageTableEntry *pageTableStart = reinterpret_cast<PageTableEntry *>(indexTableStart);
     pageTableStart = alignTo<PageTableEntry>(pageTableStart);
     pageTableStart += numberPages;
 
+    FreeRunNode *freeRunTreeStart = alignTo<FreeRunNode>(pageTableStart);
+    freeRunTreeStart += shardCount * freeRunLeafCountFor(usablePages / shardCount);
+
     // The weird part, we must manually adjust the pointer based on the page size.
-    char *cacheStart = reinterpret_cast<char *>(pageTableStart);
+    char *cacheStart = alignTo<char>(freeRunTreeStart, effectivePageSize);
     cacheStart += (numberPages * effectivePageSize);
 
     // ALIGNOF gives pointer alignment
@@ -809,20 +1272,39 @@ uint SharedMemory::totalSize(uint cacheSize, uint effectivePageSize)
     return static_cast<uint>(reinterpret_cast<quintptr>(cacheStart));
 }
 
-uint SharedMemory::fileNameHash(const QByteArray &utf8FileName) const
-{
-    return generateHash(utf8FileName) % indexTableSize();
-}
-
 void SharedMemory::clear()
 {
-    clearInternalTables();
+    const IndexTableEntry *indices = indexTable();
+    bool hasPinnedEntries = false;
+    for (uint i = 0; i < indexTableSize() && !hasPinnedEntries; ++i) {
+        hasPinnedEntries = indices[i].firstPage >= 0 && isPinned(indices[i]);
+    }
+
+    if (!hasPinnedEntries) {
+        clearInternalTables();
+        return;
+    }
+
+    // Pinned entries have to stay, remove everything else one by one. Removing
+    // an entry moves the following ones back, so look at the same position
+    // again until it holds a pinned entry or none at all.
+    for (uint i = 0; i < indexTableSize(); ++i) {
+        while (indices[i].firstPage >= 0 && !isPinned(indices[i])) {
+            removeEntry(i);
+        }
+    }
 }
 
 // Must be called while the lock is already held!
 void SharedMemory::removeEntry(uint index)
 {
-    if (index >= indexTableSize() || cacheAvail > pageTableSize()) {
+    if (index >= indexTableSize()) {
+        throw KSDCCorrupted();
+    }
+
+    CacheShard &shardHeader = shards()[index / shardIndexSize()];
+    uint &cacheAvail = shardHeader.cacheAvail;
+    if (cacheAvail > shardPageCount()) {
         throw KSDCCorrupted();
     }
 
@@ -849,6 +1331,7 @@ void SharedMemory::removeEntry(uint index)
         pageTableEntries[i].index = -1;
         cacheAvail++;
     }
+    updateFreeRuns(firstPage, cacheAvail - savedCacheSize);
 
     if ((cacheAvail - savedCacheSize) != entriesToRemove) {
         qCCritical(KCOREADDONS_DEBUG) << "We somehow did not remove" << entriesToRemove << "when removing entry" << index << ", instead we removed"
@@ -870,10 +1353,57 @@ void SharedMemory::removeEntry(uint index)
 #endif
 
     // Update the index
-    entriesIndex[index].fileNameHash = 0;
-    entriesIndex[index].totalItemSize = 0;
-    entriesIndex[index].useCount = 0;
-    entriesIndex[index].lastUsedTime = 0;
-    entriesIndex[index].addTime = 0;
-    entriesIndex[index].firstPage = -1;
+    if (canExpire(entriesIndex[index]) && shardHeader.expiringEntries > 0) {
+        shardHeader.expiringEntries--;
+    }
+    clearEntry(index);
+    shardHeader.usedEntries--;
+
+    // Close the gap by moving the following entries which aren't at their
+    // home position back by one, otherwise lookups for them would stop here.
+    const uint size = shardIndexSize();
+    const uint firstShardEntry = index - index % size;
+    uint gap = index;
+    for (uint i = 1; i < size; ++i) {
+        const uint next = firstShardEntry + (gap - firstShardEntry + 1) % size;
+        if (entriesIndex[next].firstPage < 0 || probeDistance(next) == 0) {
+            break;
+        }
+
+        storeEntry(gap, entriesIndex[next]);
+        clearEntry(next);
+        gap = next;
+    }
+}
+
+void SharedMemory::storeEntry(uint index, const IndexTableEntry &entry)
+{
+    const uint pagesUsed = intCeil(entry.totalItemSize, cachePageSize());
+    if (index >= indexTableSize() || entry.firstPage < 0 || static_cast<uint>(entry.firstPage) + pagesUsed > pageTableSize()) {
+        throw KSDCCorrupted();
+    }
+
+    indexTable()[index] = entry;
+
+    PageTableEntry *table = pageTable();
+    for (uint i = 0; i < pagesUsed; ++i) {
+        table[entry.firstPage + i].index = index;
+    }
+}
+
+void SharedMemory::clearEntry(uint index)
+{
+    IndexTableEntry &entry = indexTable()[index];
+    entry.fileNameHash = 0;
+    entry.totalItemSize = 0;
+    entry.useCount = 0;
+    entry.lastUsedTime = 0;
+    entry.addTime = 0;
+    entry.firstPage = -1;
+    entry.pinCount = 0;
+    entry.pinTime = 0;
+    entry.expiryTime = 0;
+    entry.tag = 0;
+    entry.tagGeneration = 0;
+    entry.flags = 0;
 }
@@ -55,21 +55,38 @@ typedef qint32 pageID;
 // configurable page size. In the event that the data is too large to fit into
 // a single logical page, it will need to occupy consecutive pages of memory.
 //
-// The accounting data that was referenced earlier is split into two:
+// The accounting data that was referenced earlier is split into three:
 //
 // 1. index table, containing a fixed-size list of possible cache entries.
 // Each index entry is of type IndexTableEntry (below), and holds the various
-// accounting data and a pointer to the first page.
+// accounting data and a pointer to the first page. The index table is a hash
+// table using linear probing with Robin Hood ordering: entries are kept sorted
+// by their distance from their home position, so that lookups can stop as
+// soon as they pass the position the key would have had, and removed entries
+// are filled by shifting the following ones back instead of leaving
+// tombstones. Entries may therefore move within the index table whenever
+// another one is inserted or removed.
 //
 // 2. page table, which is used to speed up the process of searching for
 // free pages of memory. There is one entry for every page in the page table,
 // and it contains the index of the one entry in the index table actually
 // holding the page (or <0 if the page is free).
 //
+// 3. free run trees, which summarize the page table so that a run of free
+// pages of a given length can be found without scanning all of it. See
+// FreeRunNode (below).
+//
+// To allow processes to write to the cache concurrently, all tables and the
+// pages are split into a number of shards, each guarded by its own lock. Every
+// key belongs to exactly one shard (determined by its hash), and the entries
+// and pages of a shard never leave its part of the tables. The per-shard
+// bookkeeping (lock, free pages, ...) is stored in the shard headers which
+// directly follow the global header.
+//
 // The entire segment looks like so:
-// ?════════?═════════════?════════════?═══════?═══════?═══════?═══════?═══?
-// ? Header │ Index Table │ Page Table ? Pages │       │       │       │...?
-// ?════════?═════════════?════════════?═══════?═══════?═══════?═══════?═══?
+// ?════════?═══════════════?═════════════?════════════?════════════════?═══════?═══?
+// ? Header │ Shard Headers │ Index Table │ Page Table │ Free Run Trees ? Pages │...?
+// ?════════?═══════════════?═════════════?════════════?════════════════?═══════?═══?
 // =========================================================================
 
 // All elements of this struct must be "plain old data" (POD) types since it
@@ -83,6 +100,28 @@ struct IndexTableEntry {
     time_t addTime;
     mutable time_t lastUsedTime;
     pageID firstPage;
+
+    // Number of KSharedDataCache::PinnedData referring to this entry, and the
+    // time the last one was created. See SharedMemory::isPinned().
+    uint pinCount;
+    time_t pinTime;
+
+    // The time after which the entry is no longer found, or 0 if it does not
+    // expire. See SharedMemory::removeExpiredEntries().
+    time_t expiryTime;
+
+    // The tag slot of the entry plus one, or 0 if it has no tag, and the
+    // generation of the slot when the entry was inserted. The entry expires
+    // as soon as the generation changes, see SharedMemory::invalidateTag().
+    uint tag;
+    uint tagGeneration;
+
+    enum Flag {
+        // The data is compressed with qCompress(), see
+        // KSharedDataCache::setCompressionThreshold().
+        COMPRESSED = 1,
+    };
+    uint flags;
 };
 
 // Page table entry
@@ -91,6 +130,84 @@ struct PageTableEntry {
     qint32 index;
 };
 
+// Each shard has a binary tree over its pages, stored like a binary heap: node
+// 1 is the root, and the children of node n are 2n and 2n + 1. The leaves are
+// the pages themselves (free if their page table entry is <0), so they are not
+// stored. Every node holds the length of the longest run of free pages below
+// it, and of the runs at its start and end, which allows finding the first run
+// of a given length and updating the tree in logarithmic time. The number of
+// leaves is rounded up to a power of 2, the extra ones count as used pages.
+struct FreeRunNode {
+    uint prefix;
+    uint suffix;
+    uint longest;
+};
+
+// A Count-Min sketch estimating how often the keys of a shard have been
+// requested recently, for the EvictWithAdmissionFilter policy. Each row maps
+// a key to one counter by a different hash, and the smallest of its counters
+// is the estimate. All counters are halved after ten requests per entry the
+// index of the shard can hold, so that keys which are no longer requested are
+// forgotten. Like the use counts of the entries the counters are updated
+// without synchronization, they are only hints.
+struct FrequencySketch {
+    enum {
+        DEPTH = 4,
+        WIDTH = 1024, // must be a power of 2
+        MAXIMUM_COUNT = 15,
+    };
+
+    quint8 counters[DEPTH][WIDTH];
+    uint requests;
+};
+
+// Counters of the events in a shard since the cache was created, reported by
+// KSharedDataCache::statistics(). They are updated with relaxed atomic
+// increments only, even by lock-free readers, and are not reset by clear().
+// Aligned so that updating them does not contend with the lock.
+struct alignas(64) CacheCounters {
+    QAtomicInteger<quint64> hits;
+    QAtomicInteger<quint64> misses;
+    QAtomicInteger<quint64> inserts;
+    QAtomicInteger<quint64> failedInserts;
+    QAtomicInteger<quint64> evictions;
+    QAtomicInteger<quint64> expirations;
+    QAtomicInteger<quint64> defragmentations;
+    QAtomicInteger<quint64> defragmentationTime; // in nanoseconds
+    QAtomicInteger<quint64> lockWaitTime; // in nanoseconds
+};
+
+// Bookkeeping of a shard, see above. Aligned to keep the locks of different
+// shards from sharing a cache line.
+struct alignas(64) CacheShard {
+    // See kshareddatacache_p.h
+    SharedLock lock;
+
+    uint cacheAvail; // in pages
+    uint usedEntries; // in the index table
+
+    // The page (relative to the first page of the shard) at which the next
+    // call to SharedMemory::defragment() continues.
+    uint defragmentCursor;
+
+    // The number of entries with an expiry time or a tag, and the index entry
+    // (relative to the first one of the shard) at which the next call to
+    // SharedMemory::removeExpiredEntries() continues.
+    uint expiringEntries;
+    uint expiryCursor;
+
+    // Sequence counter protecting the entries and pages of this shard.
+    // Writers increment it once before and once after modifying any of them
+    // (with the lock held), so it is odd while a modification is in progress.
+    // This allows readers to look up entries without taking the lock, and to
+    // retry if the counter changed while they were reading.
+    QAtomicInt generation;
+
+    FrequencySketch sketch;
+
+    CacheCounters counters;
+};
+
 // Each individual page contains the cached data. The first page starts off with
 // the utf8-encoded key, a null '\0', and then the data follows immediately
 // from the next byte, possibly crossing consecutive page boundaries to hold
@@ -110,13 +227,30 @@ struct SharedMemory {
      * e.g. the next version bump will be from 4 to 8, then 12, etc.
      */
     enum {
-        PIXMAP_CACHE_VERSION = 12,
+        PIXMAP_CACHE_VERSION = 64,
         MINIMUM_CACHE_SIZE = 4096,
     };
 
-    /// The maximum number of probes to make while searching for a bucket in
-    /// the presence of collisions in the cache index table.
-    static const uint MAX_PROBE_COUNT = 6;
+    /// The upper bound for the number of shards, and the number of pages a
+    /// cache needs per shard before it is split further. Changing either one
+    /// changes the layout of existing caches, so bump the version if you do.
+    static const uint MAX_SHARD_COUNT = 16;
+    static const uint MINIMUM_SHARD_PAGES = 512;
+
+    /// The number of entries compared to pick one to evict, see evictEntry().
+    static const uint EVICTION_SAMPLE_SIZE = 8;
+
+    /// The number of index entries checked for expiry per insert, see
+    /// removeExpiredEntries().
+    static const uint EXPIRY_SCAN_SIZE = 16;
+
+    /// The number of tag generations, see invalidateTag(). Tags are mapped to
+    /// them by their hash, so tags sharing one are invalidated together.
+    static const uint TAG_SLOT_COUNT = 256;
+
+    /// The time in seconds after which pins are no longer honored. Otherwise
+    /// the pins of a crashed process would keep their entries forever.
+    static const uint PIN_LEASE_TIME = 600;
 
     // Note to those who follow me. You should not, under any circumstances, ever
     // re-arrange the following two fields, even if you change the version number
@@ -124,11 +258,7 @@ struct SharedMemory {
     QAtomicInt ready; ///< DO NOT INITIALIZE
     quint8 version;
 
-    // See kshareddatacache_p.h
-    SharedLock shmLock;
-
     uint cacheSize;
-    uint cacheAvail;
     QAtomicInt evictionPolicy;
 
     // pageSize and cacheSize determine the number of pages. The number of
@@ -141,6 +271,15 @@ struct SharedMemory {
     // written to, to allow clients to detect a changed cache quickly.
     QAtomicInt cacheTimestamp;
 
+    // Set once the cache has been replaced by a resized copy, see
+    // KSharedDataCache::resize(). Processes still using it switch to the
+    // copy the next time they lock it.
+    QAtomicInt retired;
+
+    // The current generation of each tag slot. Bumping one invalidates all
+    // entries tagged with it at once, see IndexTableEntry::tag.
+    QAtomicInt tagGenerations[TAG_SLOT_COUNT];
+
     /*
      * Converts the given average item size into an appropriate page size.
      */
@@ -161,9 +300,39 @@ struct SharedMemory {
      * 2. Any member variable you add takes up space in shared memory as well,
      * so make sure you need it.
      */
-    bool performInitialSetup(uint _cacheSize, uint _pageSize);
+    bool performInitialSetup(uint _cacheSize, uint _pageSize, bool robustLocks);
 
     void clearInternalTables();
+
+    /*
+     * Marks the beginning and the end of a modification of the contents of
+     * @p shard. Its lock must be held. See CacheShard::generation.
+     */
+    void beginWrite(uint shard);
+    void endWrite(uint shard);
+
+    // Returns the number of shards for a cache with the given number of pages.
+    static uint shardCountFor(uint numberPages);
+
+    uint shardCount() const;
+    const CacheShard *shards() const;
+    CacheShard *shards();
+
+    // Returns the shard holding the entry for a key with the given hash.
+    uint shardFor(uint keyHash) const;
+
+    // Each shard holds this many index entries, and this many pages. The
+    // index entries of shard n start at n * shardIndexSize(), its pages at
+    // n * shardPageCount().
+    uint shardIndexSize() const;
+    uint shardPageCount() const;
+
+    // Returns the counters of the shard holding the key with the given hash.
+    CacheCounters &countersFor(uint keyHash);
+
+    // Returns the number of free pages over all shards.
+    uint cacheAvail() const;
+
     const IndexTableEntry *indexTable() const;
     const PageTableEntry *pageTable() const;
     const void *cachePages() const;
@@ -180,11 +349,106 @@ struct SharedMemory {
     uint pageTableSize() const;
     uint indexTableSize() const;
 
+    // Returns the number of leaves of the free run tree of a shard with the
+    // given number of pages. The tree has as many nodes, including the unused
+    // node 0.
+    static uint freeRunLeafCountFor(uint shardPageCount);
+
+    uint freeRunLeafCount() const;
+    const FreeRunNode *freeRunTree(uint shard) const;
+    FreeRunNode *freeRunTree(uint shard);
+
+    /*
+     * Updates the free run trees after the pages starting at @p firstPage
+     * changed between used and free. The pages must all belong to the same
+     * shard.
+     */
+    void updateFreeRuns(pageID firstPage, uint count);
+
     /*
      * @return the index of the first page, for the set of contiguous
-     * pages that can hold @p pagesNeeded PAGES.
+     * pages within @p shard that can hold @p pagesNeeded PAGES. Returns a
+     * value >= pageTableSize() if there are none.
+     */
+    pageID findEmptyPages(uint shard, uint pagesNeeded) const;
+
+    /*
+     * @return true if @p entry is in use by a KSharedDataCache::PinnedData,
+     * in which case it may neither be removed nor moved.
+     */
+    static bool isPinned(const IndexTableEntry &entry);
+
+    /*
+     * Releases a pin taken on the entry starting at @p firstPage. Unlike the
+     * pages of a pinned entry its position in the index table may change, so
+     * it is found through the page table. The lock of its shard must be held.
+     */
+    void unpinEntry(pageID firstPage);
+
+    // Returns how far the entry at @p index is from its home position, i.e.
+    // the number of probes it takes to find it minus one.
+    uint probeDistance(uint index) const;
+
+    /*
+     * Inserts @p entry, whose pages must already be allocated, into the index
+     * table of @p shard, which must have a free entry.
+     * @return the index of the entry.
      */
-    pageID findEmptyPages(uint pagesNeeded) const;
+    uint insertEntry(uint shard, IndexTableEntry entry);
+
+    /*
+     * Removes an entry of @p shard to make room. This is the entry coming
+     * first in the eviction order among EVICTION_SAMPLE_SIZE entries picked
+     * at random, which approximates evicting the first one of all of them.
+     * With the EvictWithAdmissionFilter policy the entry is only removed if
+     * it is requested less often than @p candidateHash, the key of the entry
+     * the room is made for. Expired entries in the sample are removed first,
+     * whatever the policy.
+     * @return false if there was nothing that could be removed.
+     */
+    bool evictEntry(uint shard, const uint *candidateHash = nullptr);
+
+    // Returns true if @p entry can expire, by time or by its tag.
+    static bool canExpire(const IndexTableEntry &entry);
+
+    // Returns true if @p entry has expired by @p now, or its tag has been
+    // invalidated.
+    bool isExpired(const IndexTableEntry &entry, time_t now) const;
+
+    // Returns the IndexTableEntry::tag for @p tag, a UTF-8 encoded tag name.
+    static uint tagFor(const QByteArray &tag);
+
+    // Makes all entries with the IndexTableEntry::tag @p tag expire. This
+    // doesn't need the lock, the entries are removed later on, see
+    // removeExpiredEntries().
+    void invalidateTag(uint tag);
+
+    // Returns the current generation of the IndexTableEntry::tag @p tag.
+    uint tagGeneration(uint tag) const;
+
+    /*
+     * Removes the expired entries among the next @p scanCount index entries of
+     * @p shard, continuing where the previous call left off, so that expired
+     * entries are reclaimed a bit at a time without scanning the whole index.
+     * Does nothing if the shard has no entries which expire.
+     * @return the number of entries removed.
+     */
+    uint removeExpiredEntries(uint shard, uint scanCount);
+
+    /*
+     * Notes a request for the key with hash @p keyHash in the frequency
+     * sketch of its shard, if the eviction policy uses it.
+     */
+    void recordRequest(uint keyHash);
+
+    // Returns how often the key with hash @p keyHash has been requested
+    // recently, according to the frequency sketch of its shard.
+    uint requestFrequency(uint keyHash) const;
+
+    typedef bool (*EntryCompare)(const IndexTableEntry &, const IndexTableEntry &);
+
+    // Returns the comparison function sorting entries in eviction order.
+    EntryCompare evictionCompare() const;
 
     // left < right?
     static bool lruCompare(const IndexTableEntry &l, const IndexTableEntry &r);
@@ -195,38 +459,57 @@ struct SharedMemory {
     // left < right?
     static bool ageCompare(const IndexTableEntry &l, const IndexTableEntry &r);
 
-    void defragment();
+    /*
+     * Compacts the pages of @p shard by moving entries towards its start,
+     * continuing where the previous call left off. To bound the time the lock
+     * is held, this stops at the first entry after moving @p pageBudget pages
+     * (0 means no limit).
+     * @return true if the shard has been compacted completely.
+     */
+    bool defragment(uint shard, uint pageBudget = 0);
+
+    // Does a single pass of defragment() from the cursor to the end of the
+    // shard, adding the number of pages moved to @p pagesMoved.
+    bool compactPages(uint shard, uint pageBudget, uint &pagesMoved);
 
     /*
      * Finds the index entry for a given key.
+     * This is safe to call without holding the lock, although the result is
+     * only meaningful if generation did not change in the meantime.
      * @param key UTF-8 encoded key to search for.
      * @return The index of the entry in the cache named by @p key. Returns
      *         <0 if no such entry is present.
      */
     qint32 findNamedEntry(const QByteArray &key) const;
 
-    // Function to use with std::unique_ptr in removeUsedPages below...
-    static void deleteTable(IndexTableEntry *table);
-
     /*
-     * Removes the requested number of pages.
+     * Removes the requested number of pages from @p shard. Pinned entries are
+     * left alone.
      *
      * @param numberNeeded the number of pages required to fulfill a current request.
-     *        This number should be <0 and <= the number of pages in the cache.
+     *        This number should be <0 and <= the number of pages in the shard.
+     * @param defragmentBudget limits each defragment() done meanwhile.
+     * @param candidateHash see evictEntry().
      * @return The identifier of the beginning of a consecutive block of pages able
      *         to fill the request. Returns a value >= pageTableSize() if no such
      *         request can be filled.
      * @internal
      */
-    uint removeUsedPages(uint numberNeeded);
+    uint removeUsedPages(uint shard, uint numberNeeded, uint defragmentBudget = 0, const uint *candidateHash = nullptr);
 
     // Returns the total size required for a given cache size.
     static uint totalSize(uint cacheSize, uint effectivePageSize);
 
-    uint fileNameHash(const QByteArray &utf8FileName) const;
     void clear();
     void removeEntry(uint index);
 
+    // Stores @p entry at @p index, and points its pages to it. The free run
+    // trees are not updated, as this is meant for pages already in use.
+    void storeEntry(uint index, const IndexTableEntry &entry);
+
+    // Marks the entry at @p index as unused, without touching its pages.
+    void clearEntry(uint index);
+
     static quint32 generateHash(const QByteArray &buffer);
 
     /*
@@ -0,0 +1,307 @@
+/*
+    This file is part of the KDE project.
+
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: LGPL-2.0-only
+*/
+
+#include "ksdcsnapshot_p.h"
+
+#include "kcoreaddons_debug.h"
+
+#include <QSaveFile>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+// Must be incremented whenever the layout of a snapshot changes.
+static const quint32 SNAPSHOT_VERSION = 1;
+
+static const char SNAPSHOT_MAGIC[8] = {'K', 'S', 'D', 'C', 'S', 'N', 'A', 'P'};
+
+// Written in the byte order of the machine writing the snapshot, so that it
+// doesn't match when read in a different one.
+static const quint32 SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+// Buckets of the perfect hash function hold this many keys on average. Larger
+// buckets make for fewer seeds, but take longer to place.
+static const uint KEYS_PER_BUCKET = 4;
+
+// Give up on writing a snapshot if no seed up to this one places a bucket.
+// With the spare slots this only happens when keys have the same hash.
+static const quint32 MAXIMUM_SEED = 1 << 20;
+
+struct KSDCSnapshot::Header {
+    char magic[8];
+    quint32 byteOrder;
+    quint32 version;
+    quint32 entryCount;
+    quint32 bucketCount;
+    quint32 slotCount;
+    quint32 padding;
+    quint64 fileSize;
+};
+
+// The offset of an empty slot is 0, which is always part of the header.
+struct KSDCSnapshot::Slot {
+    quint32 offset; // Of the key, which the data follows
+    quint32 keySize;
+    quint32 dataSize;
+    quint32 flags;
+};
+
+// The finalizer of MurmurHash3, which spreads the bits of a hash.
+static quint64 mixHash(quint64 hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// FNV-1a, mixed some more as buckets and slots are picked modulo sizes which
+// are not powers of 2.
+static quint64 hashKey(const char *key, qsizetype size)
+{
+    quint64 hash = 0xcbf29ce484222325ULL;
+    for (qsizetype i = 0; i < size; ++i) {
+        hash ^= static_cast<uchar>(key[i]);
+        hash *= 0x100000001b3ULL;
+    }
+
+    return mixHash(hash);
+}
+
+static quint32 slotFor(quint64 hash, quint32 seed, quint32 slotCount)
+{
+    return mixHash(hash + (quint64(seed) + 1) * 0x9e3779b97f4a7c15ULL) % slotCount;
+}
+
+bool KSDCSnapshot::write(const QString &fileName, const std::vector<Entry> &entries)
+{
+    const quint32 entryCount = entries.size();
+    const quint32 bucketCount = entryCount / KEYS_PER_BUCKET + 1;
+
+    // Spare slots make it much easier to find seeds for the last buckets,
+    // when most slots are taken already.
+    const quint32 slotCount = entryCount + entryCount / 8 + 1;
+
+    std::vector<quint64> hashes;
+    std::vector<std::vector<quint32>> buckets(bucketCount);
+    hashes.reserve(entryCount);
+    for (quint32 i = 0; i < entryCount; ++i) {
+        hashes.push_back(hashKey(entries[i].key.constData(), entries[i].key.size()));
+        buckets[hashes.back() % bucketCount].push_back(i);
+    }
+
+    // Place the largest buckets first, while there are plenty of free slots.
+    std::vector<quint32> bucketOrder(bucketCount);
+    for (quint32 i = 0; i < bucketCount; ++i) {
+        bucketOrder[i] = i;
+    }
+    std::stable_sort(bucketOrder.begin(), bucketOrder.end(), [&buckets](quint32 left, quint32 right) {
+        return buckets[left].size() > buckets[right].size();
+    });
+
+    std::vector<quint32> seeds(bucketCount, 0);
+    std::vector<qint64> slotEntries(slotCount, -1);
+    std::vector<quint32> bucketSlots;
+    for (const quint32 bucket : bucketOrder) {
+        const std::vector<quint32> &keys = buckets[bucket];
+        if (keys.empty()) {
+            break;
+        }
+
+        quint32 seed = 0;
+        for (; seed < MAXIMUM_SEED; ++seed) {
+            bucketSlots.clear();
+            for (const quint32 entry : keys) {
+                const quint32 slot = slotFor(hashes[entry], seed, slotCount);
+                if (slotEntries[slot] >= 0 || std::find(bucketSlots.begin(), bucketSlots.end(), slot) != bucketSlots.end()) {
+                    break;
+                }
+                bucketSlots.push_back(slot);
+            }
+
+            if (bucketSlots.size() == keys.size()) {
+                break;
+            }
+        }
+
+        if (seed == MAXIMUM_SEED) {
+            qCWarning(KCOREADDONS_DEBUG) << "Unable to index the entries of snapshot" << fileName;
+            return false;
+        }
+
+        seeds[bucket] = seed;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            slotEntries[bucketSlots[i]] = keys[i];
+        }
+    }
+
+    const quint64 dataOffset = sizeof(Header) + quint64(bucketCount) * sizeof(quint32) + quint64(slotCount) * sizeof(Slot);
+    std::vector<Slot> slots(slotCount, Slot{0, 0, 0, 0});
+    quint64 offset = dataOffset;
+    for (quint32 slot = 0; slot < slotCount; ++slot) {
+        if (slotEntries[slot] < 0) {
+            continue;
+        }
+
+        const Entry &entry = entries[slotEntries[slot]];
+        slots[slot] = Slot{quint32(offset), quint32(entry.key.size()), quint32(entry.data.size()), entry.flags};
+        offset += entry.key.size() + entry.data.size();
+
+        // Offsets are 32 bits wide, which is plenty for a cache.
+        if (offset > std::numeric_limits<quint32>::max()) {
+            qCWarning(KCOREADDONS_DEBUG) << "Too much data for snapshot" << fileName;
+            return false;
+        }
+    }
+
+    Header header;
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.version = SNAPSHOT_VERSION;
+    header.entryCount = entryCount;
+    header.bucketCount = bucketCount;
+    header.slotCount = slotCount;
+    header.padding = 0;
+    header.fileSize = offset;
+
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCWarning(KCOREADDONS_DEBUG) << "Unable to write snapshot" << fileName << file.errorString();
+        return false;
+    }
+
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(seeds.data()), seeds.size() * sizeof(quint32));
+    file.write(reinterpret_cast<const char *>(slots.data()), slots.size() * sizeof(Slot));
+    for (const qint64 entry : slotEntries) {
+        if (entry >= 0) {
+            file.write(entries[entry].key);
+            file.write(entries[entry].data);
+        }
+    }
+
+    if (!file.commit()) {
+        qCWarning(KCOREADDONS_DEBUG) << "Unable to write snapshot" << fileName << file.errorString();
+        return false;
+    }
+
+    return true;
+}
+
+std::shared_ptr<const KSDCSnapshot> KSDCSnapshot::open(const QString &fileName)
+{
+    std::shared_ptr<KSDCSnapshot> snapshot(new KSDCSnapshot);
+    snapshot->m_file.setFileName(fileName);
+    if (!snapshot->m_file.open(QIODevice::ReadOnly)) {
+        qCWarning(KCOREADDONS_DEBUG) << "Unable to open snapshot" << fileName << snapshot->m_file.errorString();
+        return nullptr;
+    }
+
+    snapshot->m_size = snapshot->m_file.size();
+    if (snapshot->m_size < qint64(sizeof(Header))) {
+        qCWarning(KCOREADDONS_DEBUG) << "Invalid snapshot" << fileName;
+        return nullptr;
+    }
+
+    // The mapping stays valid until the file is closed, even if the snapshot
+    // is replaced by a new one in the meantime.
+    snapshot->m_mapped = snapshot->m_file.map(0, snapshot->m_size);
+    if (!snapshot->m_mapped) {
+        qCWarning(KCOREADDONS_DEBUG) << "Unable to map snapshot" << fileName << snapshot->m_file.errorString();
+        return nullptr;
+    }
+
+    if (!snapshot->validate()) {
+        qCWarning(KCOREADDONS_DEBUG) << "Invalid snapshot" << fileName;
+        return nullptr;
+    }
+
+    return snapshot;
+}
+
+// Checks everything find() relies on up front, so that it doesn't have to.
+bool KSDCSnapshot::validate() const
+{
+    const Header *snapshotHeader = header();
+    if (std::memcmp(snapshotHeader->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || snapshotHeader->byteOrder != SNAPSHOT_BYTE_ORDER
+        || snapshotHeader->version != SNAPSHOT_VERSION || snapshotHeader->fileSize != quint64(m_size)) {
+        return false;
+    }
+
+    if (snapshotHeader->bucketCount == 0 || snapshotHeader->slotCount == 0 || snapshotHeader->entryCount > snapshotHeader->slotCount) {
+        return false;
+    }
+
+    const quint64 dataOffset =
+        sizeof(Header) + quint64(snapshotHeader->bucketCount) * sizeof(quint32) + quint64(snapshotHeader->slotCount) * sizeof(Slot);
+    if (dataOffset > quint64(m_size)) {
+        return false;
+    }
+
+    quint32 entryCount = 0;
+    const Slot *snapshotSlots = slots();
+    for (quint32 i = 0; i < snapshotHeader->slotCount; ++i) {
+        const Slot &slot = snapshotSlots[i];
+        if (slot.offset == 0) {
+            continue;
+        }
+
+        if (slot.offset < dataOffset || quint64(slot.offset) + slot.keySize + slot.dataSize > quint64(m_size)) {
+            return false;
+        }
+        entryCount++;
+    }
+
+    return entryCount == snapshotHeader->entryCount;
+}
+
+bool KSDCSnapshot::find(const QByteArray &encodedKey, const char **data, uint *size, uint *flags) const
+{
+    const Header *snapshotHeader = header();
+    if (snapshotHeader->entryCount == 0) {
+        return false;
+    }
+
+    const quint64 hash = hashKey(encodedKey.constData(), encodedKey.size());
+    const quint32 seed = seeds()[hash % snapshotHeader->bucketCount];
+    const Slot &slot = slots()[slotFor(hash, seed, snapshotHeader->slotCount)];
+
+    // Keys which are not in the snapshot end up in some slot as well.
+    const char *key = reinterpret_cast<const char *>(m_mapped) + slot.offset;
+    if (slot.offset == 0 || slot.keySize != quint32(encodedKey.size()) || std::memcmp(key, encodedKey.constData(), slot.keySize) != 0) {
+        return false;
+    }
+
+    *data = key + slot.keySize;
+    *size = slot.dataSize;
+    *flags = slot.flags;
+    return true;
+}
+
+uint KSDCSnapshot::count() const
+{
+    return header()->entryCount;
+}
+
+const KSDCSnapshot::Header *KSDCSnapshot::header() const
+{
+    return reinterpret_cast<const Header *>(m_mapped);
+}
+
+const quint32 *KSDCSnapshot::seeds() const
+{
+    return reinterpret_cast<const quint32 *>(m_mapped + sizeof(Header));
+}
+
+const KSDCSnapshot::Slot *KSDCSnapshot::slots() const
+{
+    return reinterpret_cast<const Slot *>(m_mapped + sizeof(Header) + header()->bucketCount * sizeof(quint32));
+}
@@ -0,0 +1,103 @@
+/*
+    This file is part of the KDE project.
+
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: LGPL-2.0-only
+*/
+
+#ifndef KSDCSNAPSHOT_P_H
+#define KSDCSNAPSHOT_P_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <QtGlobal>
+
+#include <memory>
+#include <vector>
+
+// =========================================================================
+// Description of a snapshot:
+//
+// A snapshot is an immutable copy of the entries of a cache, written by
+// KSharedDataCache::exportSnapshot() and attached as a read-only tier in front
+// of a cache by KSharedDataCache::attachSnapshot(). It is only ever read, so
+// it can be mapped into memory and looked up without any locking.
+//
+// The file starts with a header, followed by the seeds of the perfect
+// hash function, the table of slots and finally the keys and data of the
+// entries. The entries are indexed with a "hash, displace and compress"
+// perfect hash function: every key falls into a bucket, and each bucket has a
+// seed chosen such that the keys of all buckets end up in different slots.
+// Finding a key takes a single hash of the key, and a single key comparison.
+//
+// All numbers are stored in the byte order of the machine which wrote the
+// snapshot, snapshots are meant to be used where they are written (or where
+// they are shipped to, for the same architecture). A snapshot in a different
+// byte order or version is rejected when it is attached.
+// =========================================================================
+
+class Q_DECL_HIDDEN KSDCSnapshot
+{
+public:
+    // Flags of an entry, the same as those of an entry in the cache.
+    enum EntryFlag {
+        Compressed = 1, // Compressed with qCompress()
+    };
+
+    // An entry to be written into a snapshot.
+    struct Entry {
+        QByteArray key; // Encoded as UTF-8
+        QByteArray data; // As stored in the cache, see flags
+        uint flags;
+    };
+
+    /*
+     * Writes @p entries into a new snapshot at @p fileName, replacing any file
+     * of that name atomically, so that processes which have the previous
+     * snapshot attached can go on using it.
+     * @return true if the snapshot was written.
+     */
+    static bool write(const QString &fileName, const std::vector<Entry> &entries);
+
+    /*
+     * Maps the snapshot at @p fileName into memory, after making sure that it
+     * is valid.
+     * @return the snapshot, or null if it could not be opened or is invalid.
+     */
+    static std::shared_ptr<const KSDCSnapshot> open(const QString &fileName);
+
+    /*
+     * Looks up @p encodedKey. This needs no locking, and never touches
+     * anything outside of the mapping.
+     * @return true if it was found, in which case @p data, @p size and
+     *         @p flags are set to the data of the entry, as it was stored in
+     *         the cache.
+     */
+    bool find(const QByteArray &encodedKey, const char **data, uint *size, uint *flags) const;
+
+    // The number of entries in the snapshot.
+    uint count() const;
+
+    KSDCSnapshot(const KSDCSnapshot &) = delete;
+    KSDCSnapshot &operator=(const KSDCSnapshot &) = delete;
+
+private:
+    struct Header;
+    struct Slot;
+
+    KSDCSnapshot() = default;
+
+    bool validate() const;
+
+    const Header *header() const;
+    const quint32 *seeds() const;
+    const Slot *slots() const;
+
+    QFile m_file;
+    const uchar *m_mapped = nullptr;
+    qint64 m_size = 0;
+};
+
+#endif /* KSDCSNAPSHOT_P_H */
@@ -11,26 +11,42 @@
 #include "kcoreaddons_debug.h"
 #include "ksdcmapping_p.h"
 #include "ksdcmemory_p.h"
+#include "ksdcsnapshot_p.h"
 
 #include "kshareddatacache_p.h" // Various auxiliary support code
 
 #include <QByteArray>
 #include <QDir>
+#include <QElapsedTimer>
 #include <QFile>
-#include <QRandomGenerator>
+#include <QFuture>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QPair>
+#include <QPromise>
 #include <QStandardPaths>
+#include <QStringList>
+#include <QThreadPool>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <limits>
+#include <vector>
 
 // The per-instance private data, such as map size, whether
 // attached or not, pointer to shared memory, etc.
 class Q_DECL_HIDDEN KSharedDataCache::Private
 {
 public:
-    Private(const QString &name, unsigned defaultCacheSize, unsigned expectedItemSize)
+    Private(const QString &name, unsigned defaultCacheSize, unsigned expectedItemSize, MappingOptions mappingOptions)
         : m_cacheName(name)
         , shm(nullptr)
         , m_mapping(nullptr)
         , m_defaultCacheSize(defaultCacheSize)
         , m_expectedItemSize(expectedItemSize)
+        , m_mappingOptions(mappingOptions)
     {
         createMemoryMapping();
     }
@@ -50,8 +66,7 @@ public:
         cacheSize = qMax(pageSize * 256, cacheSize);
 
         // The m_cacheName is used to find the file to store the cache in.
-        const QString cacheDir = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation);
-        QString cacheName = cacheDir + QLatin1String("/") + m_cacheName + QLatin1String(".kcache");
+        QString cacheName = cacheFileName(m_cacheName);
         QFile file(cacheName);
         QFileInfo fileInfo(file);
         if (!QDir().mkpath(fileInfo.absolutePath())) {
@@ -71,7 +86,7 @@ public:
         // Open the file and resize to some sane value if the file is too small.
         if (file.open(QIODevice::ReadWrite) && (file.size() >= size || (ensureFileAllocated(file.handle(), size) && file.resize(size)))) {
             try {
-                m_mapping.reset(new KSDCMapping(&file, size, cacheSize, pageSize));
+                m_mapping.reset(new KSDCMapping(&file, size, cacheSize, pageSize, m_mappingOptions));
                 shm = m_mapping->m_mapped;
             } catch (KSDCCorrupted) {
                 shm = nullptr;
@@ -82,7 +97,7 @@ public:
                 QFile file(cacheName);
                 if (file.open(QIODevice::ReadWrite) && ensureFileAllocated(file.handle(), size) && file.resize(size)) {
                     try {
-                        m_mapping.reset(new KSDCMapping(&file, size, cacheSize, pageSize));
+                        m_mapping.reset(new KSDCMapping(&file, size, cacheSize, pageSize, m_mappingOptions));
                     } catch (KSDCCorrupted) {
                         m_mapping.reset();
                         qCCritical(KCOREADDONS_DEBUG) << "Even a brand-new cache starts off corrupted, something is"
@@ -93,11 +108,17 @@ public:
         }
 
         if (!m_mapping) {
-            m_mapping.reset(new KSDCMapping(nullptr, size, cacheSize, pageSize));
+            m_mapping.reset(new KSDCMapping(nullptr, size, cacheSize, pageSize, m_mappingOptions));
             shm = m_mapping->m_mapped;
         }
     }
 
+    // Returns the path of the file holding the cache named @p cacheName.
+    static QString cacheFileName(const QString &cacheName)
+    {
+        return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + QLatin1String("/") + cacheName + QLatin1String(".kcache");
+    }
+
     // Called whenever the cache is apparently corrupt (for instance, a timeout trying to
     // lock the cache). In this situation it is safer just to destroy it all and try again.
     void recoverCorruptedCache()
@@ -109,9 +130,68 @@ public:
         createMemoryMapping();
     }
 
+    // Locks either the shard of the cache holding a given key, or all of
+    // them (always in the same order, to avoid deadlocks).
     class CacheLocker
     {
         mutable Private *d;
+        const uint m_keyHash;
+        const bool m_allShards;
+        uint m_firstShard;
+        uint m_endShard;
+
+        bool lockShards()
+        {
+            if (Q_UNLIKELY(!d->shm)) {
+                return false;
+            }
+
+            // The shard has to be determined again each time, recovering from
+            // corruption may have resulted in a differently sized cache.
+            m_firstShard = m_allShards ? 0 : d->shm->shardFor(m_keyHash);
+            m_endShard = m_allShards ? d->shm->shardCount() : m_firstShard + 1;
+
+            // The end of the shards which have to be unlocked again when giving
+            // up. A lock recovered from an owner which died holding it is held
+            // even if the cache turns out to be corrupt.
+            uint lockedEnd = m_firstShard;
+            try {
+                for (uint shard = m_firstShard; shard < m_endShard; ++shard) {
+                    QElapsedTimer timer;
+                    timer.start();
+                    const KSDCLock::LockResult result = d->m_mapping->lock(shard);
+                    d->shm->shards()[shard].counters.lockWaitTime.fetchAndAddRelaxed(timer.nsecsElapsed());
+
+                    lockedEnd = result == KSDCLock::LockFailed ? shard : shard + 1;
+                    if (result != KSDCLock::LockAcquired && !d->m_mapping->isLockedCacheSafe()) {
+                        unlockShards(lockedEnd);
+                        return false;
+                    }
+                    lockedEnd = shard + 1;
+                }
+            } catch (KSDCCorrupted) {
+                unlockShards(lockedEnd);
+                throw;
+            }
+
+            // Another process replaced the cache by a resized copy, switch to
+            // that one instead.
+            if (Q_UNLIKELY(d->shm->retired.loadAcquire())) {
+                unlockShards(m_endShard);
+                d->createMemoryMapping();
+                return lockShards();
+            }
+
+            return true;
+        }
+
+        // Unlocks the shards locked so far, up to (excluding) end.
+        void unlockShards(uint end)
+        {
+            for (uint shard = m_firstShard; shard < end; ++shard) {
+                d->m_mapping->unlock(shard);
+            }
+        }
 
         bool cautiousLock()
         {
@@ -120,7 +200,7 @@ public:
             // Locking can fail due to a timeout. If it happens too often even though
             // we're taking corrective action assume there's some disastrous problem
             // and give up.
-            while (!d->m_mapping->lock() && !d->m_mapping->isLockedCacheSafe()) {
+            while (!lockShards()) {
                 d->recoverCorruptedCache();
 
                 if (!d->m_mapping->isValid()) {
@@ -139,8 +219,26 @@ public:
         }
 
     public:
-        CacheLocker(const Private *_d)
+        // Locks the shard holding the key with the given hash.
+        CacheLocker(const Private *_d, uint keyHash)
             : d(const_cast<Private *>(_d))
+            , m_keyHash(keyHash)
+            , m_allShards(false)
+            , m_firstShard(0)
+            , m_endShard(0)
+        {
+            if (Q_UNLIKELY(!d || !cautiousLock())) {
+                d = nullptr;
+            }
+        }
+
+        // Locks the whole cache.
+        explicit CacheLocker(const Private *_d)
+            : d(const_cast<Private *>(_d))
+            , m_keyHash(0)
+            , m_allShards(true)
+            , m_firstShard(0)
+            , m_endShard(0)
         {
             if (Q_UNLIKELY(!d || !cautiousLock())) {
                 d = nullptr;
@@ -150,7 +248,7 @@ public:
         ~CacheLocker()
         {
             if (d) {
-                d->m_mapping->unlock();
+                unlockShards(m_endShard);
             }
         }
 
@@ -161,337 +259,1461 @@ public:
         {
             return !d;
         }
+
+        // The locked shard, or the first one if the whole cache is locked.
+        uint shard() const
+        {
+            return m_firstShard;
+        }
     };
 
-    QString m_cacheName;
-    SharedMemory *shm;
-    std::unique_ptr<KSDCMapping> m_mapping;
-    uint m_defaultCacheSize;
-    uint m_expectedItemSize;
-};
+    // Brackets a modification of the contents of a shard so that concurrent
+    // lock-free readers notice it. The shard must be locked for the whole
+    // lifetime of this object.
+    class WriteGuard
+    {
+        SharedMemory *m_shm;
+        uint m_shard;
 
-KSharedDataCache::KSharedDataCache(const QString &cacheName, unsigned defaultCacheSize, unsigned expectedItemSize)
-    : d(nullptr)
-{
-    try {
-        d = new Private(cacheName, defaultCacheSize, expectedItemSize);
-    } catch (KSDCCorrupted) {
-        qCCritical(KCOREADDONS_DEBUG) << "Failed to initialize KSharedDataCache!";
-        d = nullptr; // Just in case
-    }
-}
+    public:
+        WriteGuard(SharedMemory *shm, uint shard)
+            : m_shm(shm)
+            , m_shard(shard)
+        {
+            m_shm->beginWrite(m_shard);
+        }
 
-KSharedDataCache::~KSharedDataCache()
-{
-    if (!d) {
-        return;
-    }
+        ~WriteGuard()
+        {
+            m_shm->endWrite(m_shard);
+        }
 
-    delete d;
-}
+        WriteGuard(const WriteGuard &) = delete;
+        WriteGuard &operator=(const WriteGuard &) = delete;
+    };
 
-bool KSharedDataCache::insert(const QString &key, const QByteArray &data)
-{
-    try {
-        Private::CacheLocker lock(d);
-        if (lock.failed()) {
-            return false;
+    enum class LookupResult {
+        Found,
+        NotFound,
+        Contended, // Must be retried with the lock held
+    };
+
+    /*
+     * Looks up @p encodedKey without taking the lock, in the manner of a
+     * seqlock: the entry is copied optimistically, and the copy is only used
+     * if CacheShard::generation shows that no writer touched the shard in the
+     * meantime. If @p destination is null only the presence of the key is
+     * checked.
+     *
+     * Nothing read from the cache before the generation is validated can be
+     * trusted, so every offset is bounds-checked against the mapping before it
+     * is dereferenced, and inconsistencies are reported as Contended instead
+     * of throwing KSDCCorrupted. The locked code path will sort them out.
+     */
+    LookupResult lockFreeFind(const QByteArray &encodedKey, QByteArray *destination) const
+    {
+        // If a writer keeps interfering give up after a few attempts, waiting
+        // for the lock is cheaper than spinning on it.
+        static const uint maxAttempts = 3;
+
+        // Leave it to the locked code path to switch to the resized cache.
+        if (Q_UNLIKELY(shm->retired.loadAcquire())) {
+            return LookupResult::Contended;
         }
 
-        QByteArray encodedKey = key.toUtf8();
-        uint keyHash = SharedMemory::generateHash(encodedKey);
-        uint position = keyHash % d->shm->indexTableSize();
+        const QAtomicInt &shardGeneration = shm->shards()[shm->shardFor(SharedMemory::generateHash(encodedKey))].generation;
 
-        // See if we're overwriting an existing entry.
-        IndexTableEntry *indices = d->shm->indexTable();
-
-        // In order to avoid the issue of a very long-lived cache having items
-        // with a use count of 1 near-permanently, we attempt to artifically
-        // reduce the use count of long-lived items when there is high load on
-        // the cache. We do this randomly, with a weighting that makes the event
-        // impossible if load < 0.5, and guaranteed if load >= 0.96.
-        const static double startCullPoint = 0.5l;
-        const static double mustCullPoint = 0.96l;
-
-        // cacheAvail is in pages, cacheSize is in bytes.
-        double loadFactor = 1.0 - (1.0l * d->shm->cacheAvail * d->shm->cachePageSize() / d->shm->cacheSize);
-        bool cullCollisions = false;
-
-        if (Q_UNLIKELY(loadFactor >= mustCullPoint)) {
-            cullCollisions = true;
-        } else if (loadFactor > startCullPoint) {
-            const int tripWireValue = RAND_MAX * (loadFactor - startCullPoint) / (mustCullPoint - startCullPoint);
-            if (QRandomGenerator::global()->bounded(RAND_MAX) >= tripWireValue) {
-                cullCollisions = true;
-            }
-        }
-
-        // In case of collisions in the index table (i.e. identical positions), use
-        // quadratic chaining to attempt to find an empty slot. The equation we use
-        // is:
-        // position = (hash + (i + i*i) / 2) % size, where i is the probe number.
-        uint probeNumber = 1;
-        while (indices[position].useCount > 0 && probeNumber < SharedMemory::MAX_PROBE_COUNT) {
-            // If we actually stumbled upon an old version of the key we are
-            // overwriting, then use that position, do not skip over it.
-
-            if (Q_UNLIKELY(indices[position].fileNameHash == keyHash)) {
-                break;
+        for (uint attempt = 0; attempt < maxAttempts; ++attempt) {
+            const int generation = shardGeneration.loadAcquire();
+            if (generation & 1) {
+                return LookupResult::Contended;
+            }
+
+            const qint32 entry = shm->findNamedEntry(encodedKey);
+            IndexTableEntry header;
+            if (entry >= 0) {
+                header = shm->indexTable()[entry];
+            }
+
+            QByteArray result;
+            bool consistent = true;
+            if (entry >= 0) {
+                const uint pageSize = shm->cachePageSize();
+                const uint keySize = encodedKey.size() + 1;
+
+                consistent = header.firstPage >= 0 && static_cast<uint>(header.firstPage) < shm->pageTableSize() && header.totalItemSize >= keySize
+                    && header.totalItemSize <= (shm->pageTableSize() - header.firstPage) * pageSize;
+
+                if (consistent && destination) {
+                    const char *cacheData = reinterpret_cast<const char *>(shm->page(header.firstPage));
+                    result = QByteArray(cacheData + keySize, header.totalItemSize - keySize);
+                }
+            }
+
+            // Order the reads above before the validation below.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (shardGeneration.loadRelaxed() != generation) {
+                continue;
+            }
+
+            if (!consistent) {
+                return LookupResult::Contended;
             }
 
-            // If we are "culling" old entries, see if this one is old and if so
-            // reduce its use count. If it reduces to zero then eliminate it and
-            // use its old spot.
+            const time_t now = ::time(nullptr);
+            if (entry < 0 || shm->isExpired(header, now)) {
+                return LookupResult::NotFound;
+            }
 
-            if (cullCollisions && (::time(nullptr) - indices[position].lastUsedTime) > 60) {
-                indices[position].useCount >>= 1;
-                if (indices[position].useCount == 0) {
-                    qCDebug(KCOREADDONS_DEBUG) << "Overwriting existing old cached entry due to collision.";
-                    d->shm->removeEntry(position); // Remove it first
-                    break;
+            // Decompressing is only safe now that the data is known to be
+            // complete. Should it fail anyway let the locked code path decide
+            // whether the cache is corrupt.
+            if (destination && (header.flags & IndexTableEntry::COMPRESSED)) {
+                result = qUncompress(result);
+                if (result.isEmpty()) {
+                    return LookupResult::Contended;
                 }
             }
 
-            position = (keyHash + (probeNumber + probeNumber * probeNumber) / 2) % d->shm->indexTableSize();
-            probeNumber++;
+            // Like in the locked case the usage statistics are updated without
+            // any synchronization, they are only hints for eviction. Should the
+            // entry have been replaced in the meantime no harm is done either.
+            IndexTableEntry *liveHeader = &shm->indexTable()[entry];
+            liveHeader->useCount++;
+            liveHeader->lastUsedTime = now;
+
+            if (destination) {
+                *destination = result;
+            }
+
+            return LookupResult::Found;
+        }
+
+        return LookupResult::Contended;
+    }
+
+    /*
+     * Inserts @p dataSize bytes of data named by @p encodedKey (with hash
+     * @p keyHash) into @p shard, replacing any previous entry with the same
+     * key. The data is written into the cache by @p writeData, which is
+     * called with a pointer to where it belongs. It must already be encoded
+     * as described by the IndexTableEntry @p flags, see encodePayload(). The
+     * entry expires at @p expiryTime, unless it is 0, or when its @p tag is
+     * invalidated, see SharedMemory::tagFor(). The shard must be locked and
+     * covered by a WriteGuard.
+     */
+    template<typename WriteData>
+    bool insertLocked(uint shard, const QByteArray &encodedKey, uint keyHash, uint dataSize, uint flags, time_t expiryTime, uint tag, const WriteData &writeData)
+    {
+        uint &cacheAvail = shm->shards()[shard].cacheAvail;
+        shm->recordRequest(keyHash);
+
+        // See if we're overwriting an existing entry.
+        const qint32 existing = shm->findNamedEntry(encodedKey);
+        if (existing >= 0) {
+            if (SharedMemory::isPinned(shm->indexTable()[existing])) {
+                qCDebug(KCOREADDONS_DEBUG) << "Unable to overwrite pinned cached entry for" << encodedKey;
+                return false;
+            }
+
+            shm->removeEntry(existing); // Remove it first
         }
 
-        if (indices[position].useCount > 0 && indices[position].firstPage >= 0) {
-            qCDebug(KCOREADDONS_DEBUG) << "Overwriting existing cached entry due to collision.";
-            d->shm->removeEntry(position); // Remove it first
+        // Reclaim some of the expired entries, so they don't have to wait to
+        // be evicted.
+        shm->removeExpiredEntries(shard, SharedMemory::EXPIRY_SCAN_SIZE);
+
+        // The index table only runs out of entries if the average entry is a
+        // lot smaller than expected, make room like we do for pages.
+        if (shm->shards()[shard].usedEntries >= shm->shardIndexSize() && !shm->evictEntry(shard, &keyHash)) {
+            qCDebug(KCOREADDONS_DEBUG) << "Unable to make room in the index table for" << encodedKey;
+            return false;
         }
 
         // Data will be stored as fileNamefoo\0PNGimagedata.....
         // So total size required is the length of the encoded file name + 1
         // for the trailing null, and then the length of the image data.
         uint fileNameLength = 1 + encodedKey.length();
-        uint requiredSize = fileNameLength + data.size();
-        uint pagesNeeded = SharedMemory::intCeil(requiredSize, d->shm->cachePageSize());
+        uint requiredSize = fileNameLength + dataSize;
+        uint pagesNeeded = SharedMemory::intCeil(requiredSize, shm->cachePageSize());
         uint firstPage(-1);
 
-        if (pagesNeeded >= d->shm->pageTableSize()) {
-            qCWarning(KCOREADDONS_DEBUG) << key << "is too large to be cached.";
+        if (pagesNeeded >= shm->shardPageCount()) {
+            qCWarning(KCOREADDONS_DEBUG) << encodedKey << "is too large to be cached.";
             return false;
         }
 
-        // If the cache has no room, or the fragmentation is too great to find
+        // If the shard has no room, or the fragmentation is too great to find
         // the required number of consecutive free pages, take action.
-        if (pagesNeeded > d->shm->cacheAvail || (firstPage = d->shm->findEmptyPages(pagesNeeded)) >= d->shm->pageTableSize()) {
+        if (pagesNeeded > cacheAvail || (firstPage = shm->findEmptyPages(shard, pagesNeeded)) >= shm->pageTableSize()) {
             // If we have enough free space just defragment
             uint freePagesDesired = 3 * qMax(1u, pagesNeeded / 2);
 
-            if (d->shm->cacheAvail > freePagesDesired) {
-                // TODO: How the hell long does this actually take on real
-                // caches?
-                d->shm->defragment();
-                firstPage = d->shm->findEmptyPages(pagesNeeded);
+            if (cacheAvail > freePagesDesired) {
+                // Defragmenting takes time proportional to the size of the
+                // shard, so only do a part of it, the following inserts will
+                // continue from there. Should that not suffice, evict entries
+                // instead of holding the lock any longer.
+                shm->defragment(shard, defragmentBudget());
+                firstPage = shm->findEmptyPages(shard, pagesNeeded);
+
+                if (firstPage >= shm->pageTableSize()) {
+                    shm->removeUsedPages(shard, pagesNeeded, defragmentBudget(), &keyHash);
+                    firstPage = shm->findEmptyPages(shard, pagesNeeded);
+                }
             } else {
                 // If we already have free pages we don't want to remove a ton
                 // extra. However we can't rely on the return value of
                 // removeUsedPages giving us a good location since we're not
                 // passing in the actual number of pages that we need.
-                d->shm->removeUsedPages(qMin(2 * freePagesDesired, d->shm->pageTableSize()) - d->shm->cacheAvail);
-                firstPage = d->shm->findEmptyPages(pagesNeeded);
+                shm->removeUsedPages(shard, qMin(2 * freePagesDesired, shm->shardPageCount()) - cacheAvail, defragmentBudget(), &keyHash);
+                firstPage = shm->findEmptyPages(shard, pagesNeeded);
             }
 
-            if (firstPage >= d->shm->pageTableSize() || d->shm->cacheAvail < pagesNeeded) {
-                qCCritical(KCOREADDONS_DEBUG) << "Unable to free up memory for" << key;
+            if (firstPage >= shm->pageTableSize() || cacheAvail < pagesNeeded) {
+                // Expected if the entry was not admitted, see evictEntry().
+                if (shm->evictionPolicy.loadRelaxed() == KSharedDataCache::EvictWithAdmissionFilter) {
+                    qCDebug(KCOREADDONS_DEBUG) << "Not admitting" << encodedKey;
+                } else {
+                    qCCritical(KCOREADDONS_DEBUG) << "Unable to free up memory for" << encodedKey;
+                }
                 return false;
             }
         }
 
-        // Update page table
-        PageTableEntry *table = d->shm->pageTable();
-        for (uint i = 0; i < pagesNeeded; ++i) {
-            table[firstPage + i].index = position;
-        }
-
-        // Update index
-        indices[position].fileNameHash = keyHash;
-        indices[position].totalItemSize = requiredSize;
-        indices[position].useCount = 1;
-        indices[position].addTime = ::time(nullptr);
-        indices[position].lastUsedTime = indices[position].addTime;
-        indices[position].firstPage = firstPage;
+        // Update index and page table
+        IndexTableEntry entry;
+        entry.fileNameHash = keyHash;
+        entry.totalItemSize = requiredSize;
+        entry.useCount = 1;
+        entry.addTime = ::time(nullptr);
+        entry.lastUsedTime = entry.addTime;
+        entry.firstPage = firstPage;
+        entry.pinCount = 0;
+        entry.pinTime = 0;
+        entry.expiryTime = expiryTime;
+        entry.tag = tag;
+        entry.tagGeneration = shm->tagGeneration(tag);
+        entry.flags = flags;
+        shm->insertEntry(shard, entry);
 
         // Update cache
-        d->shm->cacheAvail -= pagesNeeded;
+        cacheAvail -= pagesNeeded;
 
         // Actually move the data in place
-        void *dataPage = d->shm->page(firstPage);
+        void *dataPage = shm->page(firstPage);
         if (Q_UNLIKELY(!dataPage)) {
             throw KSDCCorrupted();
         }
 
         // Verify it will all fit
-        d->m_mapping->verifyProposedMemoryAccess(dataPage, requiredSize);
+        m_mapping->verifyProposedMemoryAccess(dataPage, requiredSize);
 
         // Cast for byte-sized pointer arithmetic
         uchar *startOfPageData = reinterpret_cast<uchar *>(dataPage);
         ::memcpy(startOfPageData, encodedKey.constData(), fileNameLength);
-        ::memcpy(startOfPageData + fileNameLength, data.constData(), data.size());
+        writeData(reinterpret_cast<char *>(startOfPageData + fileNameLength));
 
         return true;
-    } catch (KSDCCorrupted) {
-        d->recoverCorruptedCache();
-        return false;
     }
-}
 
-bool KSharedDataCache::remove(const QString &key)
-{
-    try {
-        const Private::CacheLocker lock(d);
-        if (lock.failed()) {
-            return false;
-        }
+    // Returns a function for insertLocked() writing @p data.
+    static auto copyOf(const QByteArray &data)
+    {
+        return [&data](char *destination) {
+            ::memcpy(destination, data.constData(), data.size());
+        };
+    }
 
-        const QByteArray encodedKey = key.toUtf8();
-        const qint32 entry = d->shm->findNamedEntry(encodedKey);
-        if (entry == -1) {
-            return false;
-        }
+    // Counts a lookup of the key with hash @p keyHash in the statistics of
+    // its shard, returning @p found for convenience.
+    bool countLookup(uint keyHash, bool found) const
+    {
+        CacheCounters &counters = shm->countersFor(keyHash);
+        (found ? counters.hits : counters.misses).fetchAndAddRelaxed(1);
+        return found;
+    }
 
-        d->shm->removeEntry(entry);
-        return true;
-    } catch (KSDCCorrupted) {
-        d->recoverCorruptedCache();
+    // Like insertLocked(), but also counts the insert in the statistics.
+    template<typename WriteData>
+    bool countedInsertLocked(uint shard, const QByteArray &encodedKey, uint keyHash, uint dataSize, uint flags, time_t expiryTime, uint tag, const WriteData &writeData)
+    {
+        const bool inserted = insertLocked(shard, encodedKey, keyHash, dataSize, flags, expiryTime, tag, writeData);
+        CacheCounters &counters = shm->shards()[shard].counters;
+        (inserted ? counters.inserts : counters.failedInserts).fetchAndAddRelaxed(1);
+        return inserted;
     }
 
-    return false;
-}
+    /*
+     * Makes sure that @p pagesNeeded pages are free in @p shard, which must be
+     * locked and covered by a WriteGuard, evicting entries if necessary. This
+     * allows a batch of entries to be inserted with a single eviction pass.
+     * Only the shortfall of free pages is evicted for, not a consecutive run
+     * for the whole batch, as every entry is placed on its own and may fit
+     * into one of the existing holes. With the EvictWithAdmissionFilter policy
+     * every entry has to make room for itself instead, so nothing is done.
+     */
+    void reserveLocked(uint shard, uint pagesNeeded)
+    {
+        if (shm->evictionPolicy.loadRelaxed() == KSharedDataCache::EvictWithAdmissionFilter) {
+            return;
+        }
 
-bool KSharedDataCache::find(const QString &key, QByteArray *destination) const
-{
-    try {
-        Private::CacheLocker lock(d);
-        if (lock.failed()) {
-            return false;
+        pagesNeeded = qMin(pagesNeeded, shm->shardPageCount());
+        while (pagesNeeded > shm->shards()[shard].cacheAvail) {
+            if (!shm->evictEntry(shard)) {
+                break;
+            }
         }
+    }
 
-        // Search in the index for our data, hashed by key;
-        QByteArray encodedKey = key.toUtf8();
-        qint32 entry = d->shm->findNamedEntry(encodedKey);
+    /*
+     * Returns @p data in the form it is to be stored in the cache, and sets
+     * @p flags to the matching IndexTableEntry flags. Data larger than the
+     * compression threshold is compressed, unless that doesn't make it any
+     * smaller. This is meant to be done before locking the cache.
+     */
+    QByteArray encodePayload(const QByteArray &data, uint &flags) const
+    {
+        flags = 0;
+        if (m_compressionThreshold == 0 || static_cast<uint>(data.size()) <= m_compressionThreshold) {
+            return data;
+        }
 
-        if (entry >= 0) {
-            const IndexTableEntry *header = &d->shm->indexTable()[entry];
-            const void *resultPage = d->shm->page(header->firstPage);
-            if (Q_UNLIKELY(!resultPage)) {
-                throw KSDCCorrupted();
-            }
+        // Favor speed, finding entries has to decompress them every time.
+        QByteArray compressed = qCompress(data, 1);
+        if (compressed.size() >= data.size()) {
+            return data;
+        }
 
-            d->m_mapping->verifyProposedMemoryAccess(resultPage, header->totalItemSize);
+        flags = IndexTableEntry::COMPRESSED;
+        return compressed;
+    }
 
-            header->useCount++;
-            header->lastUsedTime = ::time(nullptr);
+    // The number of pages defragment() may move at a time, see
+    // KSharedDataCache::setDefragmentationLimit().
+    uint defragmentBudget() const
+    {
+        if (m_defragmentationLimit == 0) {
+            return 0;
+        }
 
-            // Our item is the key followed immediately by the data, so skip
-            // past the key.
-            const char *cacheData = reinterpret_cast<const char *>(resultPage);
-            cacheData += encodedKey.size();
-            cacheData++; // Skip trailing null -- now we're pointing to start of data
+        return qMax(1u, m_defragmentationLimit / shm->cachePageSize());
+    }
 
-            if (destination) {
-                *destination = QByteArray(cacheData, header->totalItemSize - encodedKey.size() - 1);
-            }
+    /*
+     * Looks up @p encodedKey, whose shard must be locked, and notes the use of
+     * the entry.
+     * @return the entry, or null if there is no such entry or it has expired.
+     *         @p data is set to
+     *         the data of the entry as stored in the cache, which is
+     *         dataSize() bytes long.
+     */
+    IndexTableEntry *findEntryLocked(const QByteArray &encodedKey, const char **data) const
+    {
+        const qint32 entry = shm->findNamedEntry(encodedKey);
+        if (entry < 0) {
+            return nullptr;
+        }
 
-            return true;
+        IndexTableEntry *header = &shm->indexTable()[entry];
+        const time_t now = ::time(nullptr);
+        if (shm->isExpired(*header, now)) {
+            return nullptr;
         }
-    } catch (KSDCCorrupted) {
-        d->recoverCorruptedCache();
-    }
 
-    return false;
-}
+        const void *resultPage = shm->page(header->firstPage);
+        if (Q_UNLIKELY(!resultPage)) {
+            throw KSDCCorrupted();
+        }
 
-void KSharedDataCache::clear()
-{
-    try {
-        Private::CacheLocker lock(d);
+        m_mapping->verifyProposedMemoryAccess(resultPage, header->totalItemSize);
 
-        if (!lock.failed()) {
-            d->shm->clear();
+        header->useCount++;
+        header->lastUsedTime = now;
+
+        // Our item is the key followed immediately by the data, so skip
+        // past the key.
+        const char *cacheData = reinterpret_cast<const char *>(resultPage);
+        cacheData += encodedKey.size();
+        cacheData++; // Skip trailing null -- now we're pointing to start of data
+
+        *data = cacheData;
+        return header;
+    }
+
+    // Returns the size of the data of @p entry, named by @p encodedKey.
+    static uint dataSize(const IndexTableEntry &entry, const QByteArray &encodedKey)
+    {
+        return entry.totalItemSize - encodedKey.size() - 1;
+    }
+
+    // Decompresses the @p size bytes at @p data of a compressed entry.
+    static QByteArray decompress(const char *data, uint size)
+    {
+        QByteArray result = qUncompress(reinterpret_cast<const uchar *>(data), size);
+        if (Q_UNLIKELY(result.isEmpty())) {
+            throw KSDCCorrupted("Unable to decompress cache entry");
         }
-    } catch (KSDCCorrupted) {
-        d->recoverCorruptedCache();
+
+        return result;
     }
-}
 
-bool KSharedDataCache::contains(const QString &key) const
-{
-    try {
-        Private::CacheLocker lock(d);
-        if (lock.failed()) {
+    /*
+     * Looks up @p encodedKey, whose shard must be locked. If @p destination is
+     * not null the payload is copied into it.
+     */
+    bool findLocked(const QByteArray &encodedKey, QByteArray *destination) const
+    {
+        const char *data = nullptr;
+        const IndexTableEntry *header = findEntryLocked(encodedKey, &data);
+        if (!header) {
             return false;
         }
 
-        return d->shm->findNamedEntry(key.toUtf8()) >= 0;
-    } catch (KSDCCorrupted) {
-        d->recoverCorruptedCache();
-        return false;
-    }
-}
+        if (destination) {
+            const uint size = dataSize(*header, encodedKey);
+            *destination = (header->flags & IndexTableEntry::COMPRESSED) ? decompress(data, size) : QByteArray(data, size);
+        }
 
-void KSharedDataCache::deleteCache(const QString &cacheName)
-{
-    QString cachePath = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + QLatin1String("/") + cacheName + QLatin1String(".kcache");
+        return true;
+    }
 
-    // Note that it is important to simply unlink the file, and not truncate it
-    // smaller first to avoid SIGBUS errors and similar with shared memory
-    // attached to the underlying inode.
-    qCDebug(KCOREADDONS_DEBUG) << "Removing cache at" << cachePath;
-    QFile::remove(cachePath);
-}
+    /*
+     * Returns the key of @p entry, whose shard must be locked, and sets
+     * @p data to the data of the entry, which is dataSize() bytes long.
+     */
+    QByteArray entryKeyLocked(const IndexTableEntry &entry, const char **data) const
+    {
+        const char *page = reinterpret_cast<const char *>(shm->page(entry.firstPage));
+        if (Q_UNLIKELY(!page)) {
+            throw KSDCCorrupted();
+        }
 
-unsigned KSharedDataCache::totalSize() const
-{
-    try {
-        Private::CacheLocker lock(d);
-        if (lock.failed()) {
-            return 0u;
+        m_mapping->verifyProposedMemoryAccess(page, entry.totalItemSize);
+        const QByteArray encodedKey(page, qstrnlen(page, entry.totalItemSize));
+        if (Q_UNLIKELY(static_cast<uint>(encodedKey.size()) >= entry.totalItemSize)) {
+            throw KSDCCorrupted();
         }
 
-        return d->shm->cacheSize;
-    } catch (KSDCCorrupted) {
-        d->recoverCorruptedCache();
-        return 0u;
+        *data = page + encodedKey.size() + 1;
+        return encodedKey;
     }
-}
 
-unsigned KSharedDataCache::freeSize() const
-{
-    try {
-        Private::CacheLocker lock(d);
-        if (lock.failed()) {
-            return 0u;
+    /*
+     * Looks up @p encodedKey in the attached snapshot, if any, see
+     * KSharedDataCache::attachSnapshot(). This needs no lock. If @p data is
+     * not null it is set to the payload of the entry, which points into the
+     * snapshot, unless the entry is compressed and is decompressed into
+     * @p buffer instead.
+     */
+    bool findInSnapshot(const QByteArray &encodedKey, const char **data, qsizetype *size, QByteArray *buffer) const
+    {
+        const char *entryData = nullptr;
+        uint entrySize = 0;
+        uint flags = 0;
+        if (!m_snapshot || !m_snapshot->find(encodedKey, &entryData, &entrySize, &flags)) {
+            return false;
         }
 
-        return d->shm->cacheAvail * d->shm->cachePageSize();
-    } catch (KSDCCorrupted) {
-        d->recoverCorruptedCache();
-        return 0u;
-    }
-}
+        if (!data) {
+            return true;
+        }
 
-KSharedDataCache::EvictionPolicy KSharedDataCache::evictionPolicy() const
-{
-    if (d && d->shm) {
-        return static_cast<EvictionPolicy>(d->shm->evictionPolicy.fetchAndAddAcquire(0));
-    }
+        if (flags & KSDCSnapshot::Compressed) {
+            // Treat it as missing, the cache may well have the entry.
+            *buffer = qUncompress(reinterpret_cast<const uchar *>(entryData), entrySize);
+            if (Q_UNLIKELY(buffer->isEmpty())) {
+                qCWarning(KCOREADDONS_DEBUG) << "Unable to decompress snapshot entry" << encodedKey;
+                return false;
+            }
 
-    return NoEvictionPreference;
-}
+            entryData = buffer->constData();
+            entrySize = buffer->size();
+        }
 
-void KSharedDataCache::setEvictionPolicy(EvictionPolicy newPolicy)
-{
-    if (d && d->shm) {
-        d->shm->evictionPolicy.fetchAndStoreRelease(static_cast<int>(newPolicy));
+        *data = entryData;
+        *size = entrySize;
+        return true;
     }
-}
 
-unsigned KSharedDataCache::timestamp() const
-{
-    if (d && d->shm) {
+    // Like above, but copies the payload into @p destination if it is not null.
+    bool findInSnapshot(const QByteArray &encodedKey, QByteArray *destination) const
+    {
+        const char *data = nullptr;
+        qsizetype size = 0;
+        QByteArray buffer;
+        if (!findInSnapshot(encodedKey, destination ? &data : nullptr, &size, &buffer)) {
+            return false;
+        }
+
+        if (destination) {
+            *destination = buffer.isNull() ? QByteArray(data, size) : buffer;
+        }
+
+        return true;
+    }
+
+    /*
+     * Copies the entries of this cache, all of whose shards must be locked,
+     * into @p resized, all of whose shards must be locked too. Expired entries
+     * are left out, as are those which don't fit.
+     */
+    void copyEntriesLocked(Private &resized) const
+    {
+        SharedMemory *target = resized.shm;
+        target->evictionPolicy.storeRelaxed(shm->evictionPolicy.loadRelaxed());
+        target->cacheTimestamp.storeRelaxed(shm->cacheTimestamp.loadRelaxed());
+
+        // Copy the entries in eviction order, so that if the new cache is too
+        // small for all of them the ones evicted first make room.
+        const IndexTableEntry *indices = shm->indexTable();
+        const time_t now = ::time(nullptr);
+        std::vector<uint> entries;
+        for (uint i = 0; i < shm->indexTableSize(); ++i) {
+            if (indices[i].firstPage >= 0 && !shm->isExpired(indices[i], now)) {
+                entries.push_back(i);
+            }
+        }
+
+        const SharedMemory::EntryCompare compare = shm->evictionCompare();
+        std::sort(entries.begin(), entries.end(), [indices, compare](uint left, uint right) {
+            return compare(indices[left], indices[right]);
+        });
+
+        for (const uint index : entries) {
+            const IndexTableEntry &entry = indices[index];
+            const char *data = nullptr;
+            const QByteArray encodedKey = entryKeyLocked(entry, &data);
+
+            // Tags map to the same slots in every cache, and as the generations
+            // of the new one start over the entries get the current ones.
+            const uint keyHash = SharedMemory::generateHash(encodedKey);
+            const uint shard = target->shardFor(keyHash);
+            const uint size = dataSize(entry, encodedKey);
+            const WriteGuard writeGuard(target, shard);
+            const auto copyData = [data, size](char *destination) {
+                ::memcpy(destination, data, size);
+            };
+            if (!resized.insertLocked(shard, encodedKey, keyHash, size, entry.flags, entry.expiryTime, entry.tag, copyData)) {
+                continue;
+            }
+
+            // Keep the usage statistics for the eviction policies.
+            IndexTableEntry &copy = target->indexTable()[target->findNamedEntry(encodedKey)];
+            copy.useCount = entry.useCount;
+            copy.addTime = entry.addTime;
+            copy.lastUsedTime = entry.lastUsedTime;
+        }
+    }
+
+    /*
+     * Replaces this cache, all of whose shards must be locked, by a copy of
+     * @p newCacheSize bytes. The copy takes the place of the cache file, and
+     * this cache is retired, see SharedMemory::retired.
+     * @return the copy, or null if it could not be created.
+     */
+    std::unique_ptr<Private> resizeLocked(uint newCacheSize)
+    {
+        // Left behind if a process died while resizing, which must have
+        // happened while holding the locks of this cache.
+        const QString resizedName = m_cacheName + QLatin1String(".resizing");
+        KSharedDataCache::deleteCache(resizedName);
+
+        auto resized = std::make_unique<Private>(resizedName, newCacheSize, shm->cachePageSize(), m_mappingOptions);
+        bool copied = false;
+        {
+            const CacheLocker resizedLock(resized.get());
+            if (!resizedLock.failed() && QFile::exists(cacheFileName(resizedName))) {
+                copyEntriesLocked(*resized);
+                copied = true;
+            }
+        }
+
+        // Atomically replace the cache file, processes which open the cache
+        // from now on get the new one. Those which already use this one switch
+        // over once they notice that it is retired.
+        if (!copied
+            || ::rename(QFile::encodeName(cacheFileName(resizedName)).constData(), QFile::encodeName(cacheFileName(m_cacheName)).constData()) != 0) {
+            qCWarning(KCOREADDONS_DEBUG) << "Unable to replace cache" << m_cacheName << "by a resized copy";
+            resized.reset();
+            KSharedDataCache::deleteCache(resizedName);
+            return nullptr;
+        }
+
+        shm->retired.storeRelease(1);
+        return resized;
+    }
+
+    /*
+     * Writes the entries queued by KSharedDataCache::insertAsync() on a
+     * thread of its own. Like another process would, it uses a separate
+     * KSharedDataCache attached to the same cache, so it never has to
+     * synchronize with the one it was created for beyond the queue. That
+     * only works for caches shared through their file, see insertAsync().
+     */
+    class AsyncWriter
+    {
+    public:
+        explicit AsyncWriter(const Private &owner)
+            : m_cacheName(owner.m_cacheName)
+            , m_defaultCacheSize(owner.m_defaultCacheSize)
+            , m_expectedItemSize(owner.m_expectedItemSize)
+            , m_mappingOptions(owner.m_mappingOptions)
+        {
+            m_pool.setMaxThreadCount(1);
+        }
+
+        ~AsyncWriter()
+        {
+            m_pool.waitForDone();
+        }
+
+        AsyncWriter(const AsyncWriter &) = delete;
+        AsyncWriter &operator=(const AsyncWriter &) = delete;
+
+        // Queues @p data to be written with the given settings of the owner,
+        // replacing any data queued for @p key which is not written yet.
+        QFuture<bool> enqueue(const QString &key, const QByteArray &data, uint defragmentationLimit, uint compressionThreshold)
+        {
+            QPromise<bool> promise;
+            promise.start();
+            QFuture<bool> future = promise.future();
+
+            const QMutexLocker locker(&m_mutex);
+            m_defragmentationLimit = defragmentationLimit;
+            m_compressionThreshold = compressionThreshold;
+
+            const auto queued = m_queued.constFind(key);
+            if (queued != m_queued.constEnd()) {
+                PendingWrite &write = m_queue[*queued];
+                write.data = data;
+                write.promises.push_back(std::move(promise));
+            } else {
+                m_queued.insert(key, m_queue.size());
+                m_queue.push_back(PendingWrite{key, data, {}});
+                m_queue.back().promises.push_back(std::move(promise));
+            }
+
+            if (!m_running) {
+                m_running = true;
+                m_pool.start([this]() {
+                    run();
+                });
+            }
+
+            return future;
+        }
+
+    private:
+        struct PendingWrite {
+            QString key;
+            QByteArray data;
+            std::vector<QPromise<bool>> promises;
+        };
+
+        // Writes everything queued, until the queue stays empty.
+        void run()
+        {
+            for (;;) {
+                std::vector<PendingWrite> batch;
+                {
+                    const QMutexLocker locker(&m_mutex);
+                    if (m_queue.empty()) {
+                        m_running = false;
+                        return;
+                    }
+
+                    batch.swap(m_queue);
+                    m_queued.clear();
+                }
+
+                if (!m_cache) {
+                    m_cache = std::make_unique<KSharedDataCache>(m_cacheName, m_defaultCacheSize, m_expectedItemSize, m_mappingOptions);
+                }
+
+                {
+                    const QMutexLocker locker(&m_mutex);
+                    m_cache->setDefragmentationLimit(m_defragmentationLimit);
+                    m_cache->setCompressionThreshold(m_compressionThreshold);
+                }
+
+                QList<QPair<QString, QByteArray>> entries;
+                entries.reserve(batch.size());
+                for (const PendingWrite &write : batch) {
+                    entries.append(QPair<QString, QByteArray>(write.key, write.data));
+                }
+
+                // Without the file the writer would fill a cache of its own,
+                // which the owner never sees
+                const Private *writer = m_cache->d;
+                const bool shared = writer && writer->m_mapping && writer->m_mapping->isFileBacked();
+                const QList<bool> results = shared ? m_cache->insertMany(entries) : QList<bool>(batch.size(), false);
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    for (QPromise<bool> &promise : batch[i].promises) {
+                        promise.addResult(results.at(i));
+                        promise.finish();
+                    }
+                }
+            }
+        }
+
+        const QString m_cacheName;
+        const uint m_defaultCacheSize;
+        const uint m_expectedItemSize;
+        const MappingOptions m_mappingOptions;
+
+        // Guards everything up to m_running.
+        QMutex m_mutex;
+        std::vector<PendingWrite> m_queue;
+        QHash<QString, size_t> m_queued; // Position of each key in m_queue
+        uint m_defragmentationLimit = 0;
+        uint m_compressionThreshold = 0;
+        bool m_running = false;
+
+        // Only used by the writer thread.
+        std::unique_ptr<KSharedDataCache> m_cache;
+
+        // Destroyed first, after the last write finished.
+        QThreadPool m_pool;
+    };
+
+    QString m_cacheName;
+    SharedMemory *shm;
+    // Shared with the PinnedData handed out, which keep the mapping alive.
+    std::shared_ptr<KSDCMapping> m_mapping;
+    uint m_defaultCacheSize;
+    uint m_expectedItemSize;
+    MappingOptions m_mappingOptions;
+    uint m_defragmentationLimit = 1024 * 1024;
+    uint m_compressionThreshold = 0;
+
+    // Created by the first call to insertAsync().
+    std::unique_ptr<AsyncWriter> m_asyncWriter;
+
+    // Looked up before the cache, see KSharedDataCache::attachSnapshot().
+    std::shared_ptr<const KSDCSnapshot> m_snapshot;
+};
+
+class Q_DECL_HIDDEN KSharedDataCache::PinnedData::Private
+{
+public:
+    ~Private()
+    {
+        // Compressed entries and those of snapshots are not pinned.
+        if (!mapping || !mapping->isValid()) {
+            return;
+        }
+
+        // The cache may turn out to be corrupt when locking it, in which case
+        // there is no point in releasing the pin. Like elsewhere a failure to
+        // lock is ignored if the cache appears to be fine otherwise. A lock
+        // which was taken is always released again.
+        KSDCLock::LockResult result = KSDCLock::LockFailed;
+        try {
+            result = mapping->lock(shard);
+            if (result == KSDCLock::LockAcquired || mapping->isLockedCacheSafe()) {
+                mapping->m_mapped->unpinEntry(firstPage);
+            }
+        } catch (KSDCCorrupted) {
+        }
+
+        if (result != KSDCLock::LockFailed) {
+            mapping->unlock(shard);
+        }
+    }
+
+    std::shared_ptr<KSDCMapping> mapping;
+    uint shard = 0;
+    pageID firstPage = -1;
+    const char *data = nullptr;
+    qsizetype size = 0;
+
+    // The data of compressed entries cannot be used in place, so they are
+    // decompressed into this instead of being pinned.
+    QByteArray decompressed;
+
+    // Keeps the snapshot mapped, for entries found in one.
+    std::shared_ptr<const KSDCSnapshot> snapshot;
+};
+
+KSharedDataCache::PinnedData::PinnedData() = default;
+KSharedDataCache::PinnedData::~PinnedData() = default;
+KSharedDataCache::PinnedData::PinnedData(PinnedData &&other) noexcept = default;
+KSharedDataCache::PinnedData &KSharedDataCache::PinnedData::operator=(PinnedData &&other) noexcept = default;
+
+bool KSharedDataCache::PinnedData::isNull() const
+{
+    return !d;
+}
+
+const char *KSharedDataCache::PinnedData::constData() const
+{
+    return d ? d->data : nullptr;
+}
+
+qsizetype KSharedDataCache::PinnedData::size() const
+{
+    return d ? d->size : 0;
+}
+
+QByteArray KSharedDataCache::PinnedData::toByteArray() const
+{
+    return d ? QByteArray::fromRawData(d->data, d->size) : QByteArray();
+}
+
+KSharedDataCache::KSharedDataCache(const QString &cacheName, unsigned defaultCacheSize, unsigned expectedItemSize)
+    : KSharedDataCache(cacheName, defaultCacheSize, expectedItemSize, NoMappingOptions)
+{
+}
+
+KSharedDataCache::KSharedDataCache(const QString &cacheName, unsigned defaultCacheSize, unsigned expectedItemSize, MappingOptions options)
+    : d(nullptr)
+{
+    try {
+        d = new Private(cacheName, defaultCacheSize, expectedItemSize, options);
+    } catch (KSDCCorrupted) {
+        qCCritical(KCOREADDONS_DEBUG) << "Failed to initialize KSharedDataCache!";
+        d = nullptr; // Just in case
+    }
+}
+
+KSharedDataCache::~KSharedDataCache()
+{
+    if (!d) {
+        return;
+    }
+
+    delete d;
+}
+
+bool KSharedDataCache::insert(const QString &key, const QByteArray &data)
+{
+    return insert(key, data, std::chrono::seconds::zero());
+}
+
+bool KSharedDataCache::insert(const QString &key, const QByteArray &data, std::chrono::seconds timeToLive)
+{
+    return insert(key, data, QString(), timeToLive);
+}
+
+bool KSharedDataCache::insert(const QString &key, const QByteArray &data, const QString &tag, std::chrono::seconds timeToLive)
+{
+    try {
+        QByteArray encodedKey = key.toUtf8();
+        uint keyHash = SharedMemory::generateHash(encodedKey);
+
+        // Compress before locking, which may well take longer than the rest.
+        uint flags = 0;
+        const QByteArray payload = d ? d->encodePayload(data, flags) : data;
+
+        Private::CacheLocker lock(d, keyHash);
+        if (lock.failed()) {
+            return false;
+        }
+
+        // Keys only ever live in their own shard, so all that follows is
+        // restricted to its part of the index and page tables.
+        const time_t expiryTime = timeToLive.count() > 0 ? ::time(nullptr) + timeToLive.count() : 0;
+        const uint entryTag = tag.isEmpty() ? 0 : SharedMemory::tagFor(tag.toUtf8());
+        const Private::WriteGuard writeGuard(d->shm, lock.shard());
+        return d->countedInsertLocked(lock.shard(), encodedKey, keyHash, payload.size(), flags, expiryTime, entryTag, Private::copyOf(payload));
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return false;
+    }
+}
+
+bool KSharedDataCache::insert(const QString &key, qsizetype size, const std::function<void(char *)> &writeData)
+{
+    if (size < 0 || size >= std::numeric_limits<int>::max()) {
+        return false;
+    }
+
+    try {
+        const QByteArray encodedKey = key.toUtf8();
+        const uint keyHash = SharedMemory::generateHash(encodedKey);
+
+        Private::CacheLocker lock(d, keyHash);
+        if (lock.failed()) {
+            return false;
+        }
+
+        const Private::WriteGuard writeGuard(d->shm, lock.shard());
+        return d->countedInsertLocked(lock.shard(), encodedKey, keyHash, size, 0, 0, 0, writeData);
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return false;
+    }
+}
+
+bool KSharedDataCache::remove(const QString &key)
+{
+    try {
+        const QByteArray encodedKey = key.toUtf8();
+        const Private::CacheLocker lock(d, SharedMemory::generateHash(encodedKey));
+        if (lock.failed()) {
+            return false;
+        }
+
+        const qint32 entry = d->shm->findNamedEntry(encodedKey);
+        if (entry == -1 || SharedMemory::isPinned(d->shm->indexTable()[entry])) {
+            return false;
+        }
+
+        const Private::WriteGuard writeGuard(d->shm, lock.shard());
+        d->shm->removeEntry(entry);
+        return true;
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+    }
+
+    return false;
+}
+
+bool KSharedDataCache::find(const QString &key, QByteArray *destination) const
+{
+    try {
+        // Search in the index for our data, hashed by key;
+        QByteArray encodedKey = key.toUtf8();
+        const uint keyHash = SharedMemory::generateHash(encodedKey);
+
+        if (d && d->findInSnapshot(encodedKey, destination)) {
+            return true;
+        }
+
+        // Most lookups don't race with a writer, so try without locking first.
+        if (d && d->shm) {
+            d->shm->recordRequest(keyHash);
+
+            switch (d->lockFreeFind(encodedKey, destination)) {
+            case Private::LookupResult::Found:
+                return d->countLookup(keyHash, true);
+            case Private::LookupResult::NotFound:
+                return d->countLookup(keyHash, false);
+            case Private::LookupResult::Contended:
+                break;
+            }
+        }
+
+        Private::CacheLocker lock(d, keyHash);
+        if (lock.failed()) {
+            return false;
+        }
+
+        return d->countLookup(keyHash, d->findLocked(encodedKey, destination));
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+    }
+
+    return false;
+}
+
+bool KSharedDataCache::find(const QString &key, const std::function<void(const char *, qsizetype)> &readData) const
+{
+    try {
+        const QByteArray encodedKey = key.toUtf8();
+        const uint keyHash = SharedMemory::generateHash(encodedKey);
+
+        const char *data = nullptr;
+        qsizetype size = 0;
+        QByteArray buffer;
+        if (d && d->findInSnapshot(encodedKey, &data, &size, &buffer)) {
+            readData(data, size);
+            return true;
+        }
+
+        const Private::CacheLocker lock(d, keyHash);
+        if (lock.failed()) {
+            return false;
+        }
+
+        d->shm->recordRequest(keyHash);
+
+        const IndexTableEntry *header = d->findEntryLocked(encodedKey, &data);
+        if (!d->countLookup(keyHash, header != nullptr)) {
+            return false;
+        }
+
+        size = Private::dataSize(*header, encodedKey);
+        if (header->flags & IndexTableEntry::COMPRESSED) {
+            const QByteArray decompressed = Private::decompress(data, size);
+            readData(decompressed.constData(), decompressed.size());
+        } else {
+            readData(data, size);
+        }
+
+        return true;
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+    }
+
+    return false;
+}
+
+KSharedDataCache::PinnedData KSharedDataCache::findPinned(const QString &key) const
+{
+    PinnedData result;
+
+    try {
+        const QByteArray encodedKey = key.toUtf8();
+        const uint keyHash = SharedMemory::generateHash(encodedKey);
+
+        // Snapshots are immutable, so their entries need no pinning. The
+        // buffer of decompressed entries is shared with the result.
+        const char *data = nullptr;
+        qsizetype size = 0;
+        QByteArray buffer;
+        if (d && d->findInSnapshot(encodedKey, &data, &size, &buffer)) {
+            result.d = std::make_unique<PinnedData::Private>();
+            result.d->snapshot = d->m_snapshot;
+            result.d->decompressed = buffer;
+            result.d->data = data;
+            result.d->size = size;
+            return result;
+        }
+
+        Private::CacheLocker lock(d, keyHash);
+        if (lock.failed()) {
+            return result;
+        }
+
+        d->shm->recordRequest(keyHash);
+
+        IndexTableEntry *header = d->findEntryLocked(encodedKey, &data);
+        if (!d->countLookup(keyHash, header != nullptr)) {
+            return result;
+        }
+
+        result.d = std::make_unique<PinnedData::Private>();
+        if (header->flags & IndexTableEntry::COMPRESSED) {
+            result.d->decompressed = Private::decompress(data, Private::dataSize(*header, encodedKey));
+            result.d->data = result.d->decompressed.constData();
+            result.d->size = result.d->decompressed.size();
+            return result;
+        }
+
+        header->pinCount++;
+        header->pinTime = header->lastUsedTime;
+
+        result.d->mapping = d->m_mapping;
+        result.d->shard = lock.shard();
+        result.d->firstPage = header->firstPage;
+        result.d->data = data;
+        result.d->size = Private::dataSize(*header, encodedKey);
+    } catch (KSDCCorrupted) {
+        result = PinnedData();
+        d->recoverCorruptedCache();
+    }
+
+    return result;
+}
+
+QList<bool> KSharedDataCache::insertMany(const QList<QPair<QString, QByteArray>> &entries)
+{
+    QList<bool> results(entries.size(), false);
+
+    try {
+        QList<QByteArray> encodedKeys;
+        QList<uint> keyHashes;
+        QList<QByteArray> payloads;
+        QList<uint> flags;
+        QList<qsizetype> pending;
+        encodedKeys.reserve(entries.size());
+        keyHashes.reserve(entries.size());
+        payloads.reserve(entries.size());
+        flags.reserve(entries.size());
+        pending.reserve(entries.size());
+
+        // Like insert(), compress before locking.
+        for (qsizetype i = 0; i < entries.size(); ++i) {
+            encodedKeys.append(entries.at(i).first.toUtf8());
+            keyHashes.append(SharedMemory::generateHash(encodedKeys.at(i)));
+            uint entryFlags = 0;
+            payloads.append(d ? d->encodePayload(entries.at(i).second, entryFlags) : entries.at(i).second);
+            flags.append(entryFlags);
+            pending.append(i);
+        }
+
+        // Every iteration locks the shard of the first pending entry and
+        // inserts all pending entries which belong to the same shard.
+        while (!pending.isEmpty()) {
+            Private::CacheLocker lock(d, keyHashes.at(pending.first()));
+            if (lock.failed()) {
+                break;
+            }
+
+            const uint shard = lock.shard();
+            const uint pageSize = d->shm->cachePageSize();
+            QList<qsizetype> batch;
+            QList<qsizetype> remaining;
+            uint pagesNeeded = 0;
+
+            for (const qsizetype i : std::as_const(pending)) {
+                if (d->shm->shardFor(keyHashes.at(i)) != shard) {
+                    remaining.append(i);
+                    continue;
+                }
+
+                batch.append(i);
+                const uint entryPages = SharedMemory::intCeil(encodedKeys.at(i).size() + 1 + payloads.at(i).size(), pageSize);
+                if (entryPages < d->shm->shardPageCount()) {
+                    pagesNeeded += entryPages;
+                }
+            }
+
+            const Private::WriteGuard writeGuard(d->shm, shard);
+            d->reserveLocked(shard, pagesNeeded);
+
+            for (const qsizetype i : std::as_const(batch)) {
+                results[i] = d->countedInsertLocked(shard, encodedKeys.at(i), keyHashes.at(i), payloads.at(i).size(), flags.at(i), 0, 0, Private::copyOf(payloads.at(i)));
+            }
+
+            pending = remaining;
+        }
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+    }
+
+    return results;
+}
+
+QFuture<bool> KSharedDataCache::insertAsync(const QString &key, const QByteArray &data)
+{
+    if (!d) {
+        return QtFuture::makeReadyValueFuture(false);
+    }
+
+    // A cache which is not shared through its file can't be written by the
+    // separate KSharedDataCache of the writer, see AsyncWriter.
+    if (!d->m_mapping || !d->m_mapping->isFileBacked()) {
+        return QtFuture::makeReadyValueFuture(insert(key, data));
+    }
+
+    if (!d->m_asyncWriter) {
+        d->m_asyncWriter = std::make_unique<Private::AsyncWriter>(*d);
+    }
+
+    return d->m_asyncWriter->enqueue(key, data, d->m_defragmentationLimit, d->m_compressionThreshold);
+}
+
+QList<bool> KSharedDataCache::findMany(const QStringList &keys, QHash<QString, QByteArray> *destination) const
+{
+    QList<bool> results(keys.size(), false);
+
+    try {
+        QList<QByteArray> encodedKeys;
+        QList<qsizetype> pending;
+        encodedKeys.reserve(keys.size());
+
+        // Like find(), try the snapshot and then without locking first.
+        for (qsizetype i = 0; i < keys.size(); ++i) {
+            encodedKeys.append(keys.at(i).toUtf8());
+
+            QByteArray snapshotData;
+            if (d && d->findInSnapshot(encodedKeys.at(i), destination ? &snapshotData : nullptr)) {
+                results[i] = true;
+                if (destination) {
+                    destination->insert(keys.at(i), snapshotData);
+                }
+                continue;
+            }
+
+            if (d && d->shm) {
+                const uint keyHash = SharedMemory::generateHash(encodedKeys.at(i));
+                d->shm->recordRequest(keyHash);
+
+                QByteArray data;
+                const auto result = d->lockFreeFind(encodedKeys.at(i), destination ? &data : nullptr);
+                if (result == Private::LookupResult::Found) {
+                    results[i] = true;
+                    if (destination) {
+                        destination->insert(keys.at(i), data);
+                    }
+                }
+                if (result != Private::LookupResult::Contended) {
+                    d->countLookup(keyHash, results[i]);
+                    continue;
+                }
+            }
+
+            pending.append(i);
+        }
+
+        // Every iteration locks the shard of the first pending key and looks
+        // up all pending keys which belong to the same shard.
+        while (!pending.isEmpty()) {
+            Private::CacheLocker lock(d, SharedMemory::generateHash(encodedKeys.at(pending.first())));
+            if (lock.failed()) {
+                break;
+            }
+
+            QList<qsizetype> remaining;
+            for (const qsizetype i : std::as_const(pending)) {
+                const uint keyHash = SharedMemory::generateHash(encodedKeys.at(i));
+                if (d->shm->shardFor(keyHash) != lock.shard()) {
+                    remaining.append(i);
+                    continue;
+                }
+
+                QByteArray data;
+                if (d->countLookup(keyHash, d->findLocked(encodedKeys.at(i), destination ? &data : nullptr))) {
+                    results[i] = true;
+                    if (destination) {
+                        destination->insert(keys.at(i), data);
+                    }
+                }
+            }
+
+            pending = remaining;
+        }
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+    }
+
+    return results;
+}
+
+void KSharedDataCache::clear()
+{
+    try {
+        Private::CacheLocker lock(d);
+
+        if (!lock.failed()) {
+            // Every shard is modified, see Private::WriteGuard.
+            for (uint shard = 0; shard < d->shm->shardCount(); ++shard) {
+                d->shm->beginWrite(shard);
+            }
+
+            d->shm->clear();
+
+            for (uint shard = 0; shard < d->shm->shardCount(); ++shard) {
+                d->shm->endWrite(shard);
+            }
+        }
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+    }
+}
+
+bool KSharedDataCache::contains(const QString &key) const
+{
+    try {
+        const QByteArray encodedKey = key.toUtf8();
+
+        if (d && d->findInSnapshot(encodedKey, nullptr)) {
+            return true;
+        }
+
+        if (d && d->shm) {
+            switch (d->lockFreeFind(encodedKey, nullptr)) {
+            case Private::LookupResult::Found:
+                return true;
+            case Private::LookupResult::NotFound:
+                return false;
+            case Private::LookupResult::Contended:
+                break;
+            }
+        }
+
+        Private::CacheLocker lock(d, SharedMemory::generateHash(encodedKey));
+        if (lock.failed()) {
+            return false;
+        }
+
+        return d->findLocked(encodedKey, nullptr);
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return false;
+    }
+}
+
+void KSharedDataCache::invalidateTag(const QString &tag)
+{
+    if (tag.isEmpty()) {
+        return;
+    }
+
+    try {
+        // Only the generation of the tag changes, which needs no lock by
+        // itself. Locking makes sure that it does not change in a cache which
+        // is being replaced by a resized copy though, see resize().
+        const Private::CacheLocker lock(d);
+        if (!lock.failed()) {
+            d->shm->invalidateTag(SharedMemory::tagFor(tag.toUtf8()));
+        }
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+    }
+}
+
+void KSharedDataCache::deleteCache(const QString &cacheName)
+{
+    QString cachePath = Private::cacheFileName(cacheName);
+
+    // Note that it is important to simply unlink the file, and not truncate it
+    // smaller first to avoid SIGBUS errors and similar with shared memory
+    // attached to the underlying inode.
+    qCDebug(KCOREADDONS_DEBUG) << "Removing cache at" << cachePath;
+    QFile::remove(cachePath);
+}
+
+bool KSharedDataCache::resize(unsigned newCacheSize)
+{
+    try {
+        std::unique_ptr<Private> resized;
+        {
+            const Private::CacheLocker lock(d);
+            if (lock.failed()) {
+                return false;
+            }
+
+            resized = d->resizeLocked(qMax(newCacheSize, uint(SharedMemory::MINIMUM_CACHE_SIZE)));
+            if (!resized) {
+                return false;
+            }
+        }
+
+        // Switch over to the new cache right away, the old one is unlocked now.
+        d->m_mapping = resized->m_mapping;
+        d->shm = resized->shm;
+        d->m_defaultCacheSize = newCacheSize;
+        return true;
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+    }
+
+    return false;
+}
+
+bool KSharedDataCache::exportSnapshot(const QString &fileName) const
+{
+    std::vector<KSDCSnapshot::Entry> entries;
+
+    try {
+        const Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return false;
+        }
+
+        // Only copy the entries while the cache is locked, indexing and
+        // writing them can be done without holding up everyone else.
+        const IndexTableEntry *indices = d->shm->indexTable();
+        const time_t now = ::time(nullptr);
+        for (uint i = 0; i < d->shm->indexTableSize(); ++i) {
+            const IndexTableEntry &entry = indices[i];
+            if (entry.firstPage < 0 || d->shm->isExpired(entry, now)) {
+                continue;
+            }
+
+            const char *data = nullptr;
+            const QByteArray encodedKey = d->entryKeyLocked(entry, &data);
+            const uint flags = (entry.flags & IndexTableEntry::COMPRESSED) ? KSDCSnapshot::Compressed : 0;
+            entries.push_back(KSDCSnapshot::Entry{encodedKey, QByteArray(data, Private::dataSize(entry, encodedKey)), flags});
+        }
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return false;
+    }
+
+    return KSDCSnapshot::write(fileName, entries);
+}
+
+bool KSharedDataCache::attachSnapshot(const QString &fileName)
+{
+    if (!d) {
+        return false;
+    }
+
+    std::shared_ptr<const KSDCSnapshot> snapshot = KSDCSnapshot::open(fileName);
+    if (!snapshot) {
+        return false;
+    }
+
+    d->m_snapshot = std::move(snapshot);
+    return true;
+}
+
+void KSharedDataCache::detachSnapshot()
+{
+    if (d) {
+        d->m_snapshot.reset();
+    }
+}
+
+unsigned KSharedDataCache::totalSize() const
+{
+    try {
+        Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return 0u;
+        }
+
+        return d->shm->cacheSize;
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return 0u;
+    }
+}
+
+unsigned KSharedDataCache::freeSize() const
+{
+    try {
+        Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return 0u;
+        }
+
+        return d->shm->cacheAvail() * d->shm->cachePageSize();
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return 0u;
+    }
+}
+
+KSharedDataCache::EvictionPolicy KSharedDataCache::evictionPolicy() const
+{
+    if (d && d->shm) {
+        return static_cast<EvictionPolicy>(d->shm->evictionPolicy.fetchAndAddAcquire(0));
+    }
+
+    return NoEvictionPreference;
+}
+
+void KSharedDataCache::setEvictionPolicy(EvictionPolicy newPolicy)
+{
+    if (d && d->shm) {
+        d->shm->evictionPolicy.fetchAndStoreRelease(static_cast<int>(newPolicy));
+    }
+}
+
+unsigned KSharedDataCache::defragmentationLimit() const
+{
+    return d ? d->m_defragmentationLimit : 0;
+}
+
+void KSharedDataCache::setDefragmentationLimit(unsigned bytes)
+{
+    if (d) {
+        d->m_defragmentationLimit = bytes;
+    }
+}
+
+unsigned KSharedDataCache::compressionThreshold() const
+{
+    return d ? d->m_compressionThreshold : 0;
+}
+
+void KSharedDataCache::setCompressionThreshold(unsigned bytes)
+{
+    if (d) {
+        d->m_compressionThreshold = bytes;
+    }
+}
+
+unsigned KSharedDataCache::timestamp() const
+{
+    if (d && d->shm) {
         return static_cast<unsigned>(d->shm->cacheTimestamp.fetchAndAddAcquire(0));
     }
 
@@ -504,3 +1726,56 @@ void KSharedDataCache::setTimestamp(unsigned newTimestamp)
         d->shm->cacheTimestamp.fetchAndStoreRelease(static_cast<int>(newTimestamp));
     }
 }
+
+KSharedDataCache::Statistics KSharedDataCache::statistics() const
+{
+    Statistics result;
+
+    try {
+        const Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return result;
+        }
+
+        const IndexTableEntry *indices = d->shm->indexTable();
+        quint64 totalProbeLength = 0;
+        for (uint i = 0; i < d->shm->indexTableSize(); ++i) {
+            if (indices[i].firstPage < 0) {
+                continue;
+            }
+
+            const uint probeLength = d->shm->probeDistance(i) + 1;
+            result.maximumProbeLength = qMax(result.maximumProbeLength, probeLength);
+            totalProbeLength += probeLength;
+            result.entryCount++;
+
+            if (result.probeLengthHistogram.size() < qsizetype(probeLength)) {
+                result.probeLengthHistogram.resize(probeLength);
+            }
+            result.probeLengthHistogram[probeLength - 1]++;
+        }
+
+        for (uint shard = 0; shard < d->shm->shardCount(); ++shard) {
+            const CacheCounters &counters = d->shm->shards()[shard].counters;
+            result.hits += counters.hits.loadRelaxed();
+            result.misses += counters.misses.loadRelaxed();
+            result.inserts += counters.inserts.loadRelaxed();
+            result.failedInserts += counters.failedInserts.loadRelaxed();
+            result.evictions += counters.evictions.loadRelaxed();
+            result.expirations += counters.expirations.loadRelaxed();
+            result.defragmentations += counters.defragmentations.loadRelaxed();
+            result.defragmentationTime += counters.defragmentationTime.loadRelaxed();
+            result.lockWaitTime += counters.lockWaitTime.loadRelaxed();
+        }
+
+        result.indexSize = d->shm->indexTableSize();
+        if (result.entryCount > 0) {
+            result.averageProbeLength = qreal(totalProbeLength) / result.entryCount;
+        }
+    } catch (KSDCCorrupted) {
+        result = Statistics();
+        d->recoverCorruptedCache();
+    }
+
+    return result;
+}
@@ -11,6 +11,15 @@
 
 #include <kcoreaddons_export.h>
 
+#include <QFlags>
+#include <QFuture>
+#include <QList>
+#include <QtContainerFwd>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+
 class QString;
 class QByteArray;
 
@@ -69,6 +78,51 @@ public:
      *   system.
      */
     KSharedDataCache(const QString &cacheName, unsigned defaultCacheSize, unsigned expectedItemSize = 0);
+
+    /*!
+     * Options for mapping the cache into memory, which trade memory for
+     * faster access.
+     *
+     * \value NoMappingOptions Map the cache as it is accessed.
+     * \value PrefaultMapping Map the whole cache in advance, so the first
+     *        accesses by this process don't have to wait for the kernel to
+     *        map each page of it.
+     * \value HugePages Ask the kernel to back the cache with huge pages, which
+     *        reduces TLB misses for large caches. This is only a hint, which
+     *        Linux currently honours only for caches in tmpfs, and only if
+     *        transparent huge pages are enabled for it.
+     * \value LockIndex Keep the part of the cache used to look up entries in
+     *        physical memory, so it is never swapped out. This is subject to
+     *        RLIMIT_MEMLOCK, and silently skipped if the limit is too low.
+     * \value RobustLocks Guard the cache with locks which recover when a
+     *        process dies while holding one, instead of leaving the other
+     *        processes to time out and take the cache for corrupt. These locks
+     *        are slower to take. Unlike the other options this is only
+     *        considered when the cache is created, and then applies to every
+     *        process using it. It is ignored where robust locks are not
+     *        supported.
+     *
+     * \since 6.29
+     */
+    enum MappingOption {
+        NoMappingOptions = 0x0,
+        PrefaultMapping = 0x1,
+        HugePages = 0x2,
+        LockIndex = 0x4,
+        RobustLocks = 0x8,
+    };
+    Q_DECLARE_FLAGS(MappingOptions, MappingOption)
+
+    /*!
+     * Attaches to a shared cache, creating it if necessary, like the
+     * constructor above, and maps it into memory according to \a options.
+     *
+     * The options only affect this process, other processes using the same
+     * cache may use different ones. RobustLocks is the exception, see above.
+     *
+     * \since 6.29
+     */
+    KSharedDataCache(const QString &cacheName, unsigned defaultCacheSize, unsigned expectedItemSize, MappingOptions options);
     ~KSharedDataCache();
 
     KSharedDataCache(const KSharedDataCache &) = delete;
@@ -79,6 +133,11 @@ public:
      * \value EvictLeastRecentlyUsed Evict the least recently used entry
      * \value EvictLeastOftenUsed Evict the lest often used item
      * \value EvictOldest Evict the oldest item
+     * \value [since 6.29] EvictWithAdmissionFilter Evict the least recently used
+     *        entry, but only to make room for an entry which has been
+     *        requested more often recently. This keeps entries which are
+     *        requested only once, such as during a scan over many keys, from
+     *        pushing out frequently used ones.
      */
     enum EvictionPolicy {
         // The default value for data in our shared memory will be 0, so it is
@@ -87,6 +146,7 @@ public:
         EvictLeastRecentlyUsed,
         EvictLeastOftenUsed,
         EvictOldest,
+        EvictWithAdmissionFilter,
     };
 
     /*!
@@ -101,18 +161,129 @@ public:
      */
     void setEvictionPolicy(EvictionPolicy newPolicy);
 
+    /*!
+     * Returns the maximum amount of data in bytes which is moved around to
+     * defragment the cache while inserting a single entry.
+     *
+     * \sa setDefragmentationLimit()
+     * \since 6.29
+     */
+    unsigned defragmentationLimit() const;
+
+    /*!
+     * Sets the maximum amount of data in bytes which is moved around to
+     * defragment the cache while inserting a single entry to \a bytes, or
+     * removes the limit if \a bytes is 0. The default is 1 MiB.
+     *
+     * The cache is locked while it is being defragmented, so this bounds the
+     * time other processes may have to wait for an insert to finish. The
+     * following inserts continue defragmenting where the previous one left
+     * off, but entries may be evicted earlier than otherwise necessary
+     * because of the limit.
+     *
+     * Unlike the eviction policy this setting is not shared, it only applies
+     * to inserts through this object.
+     *
+     * \since 6.29
+     */
+    void setDefragmentationLimit(unsigned bytes);
+
+    /*!
+     * Returns the size in bytes above which data is compressed before it is
+     * inserted, or 0 if data is never compressed.
+     *
+     * \sa setCompressionThreshold()
+     * \since 6.29
+     */
+    unsigned compressionThreshold() const;
+
+    /*!
+     * Sets the size above which data is compressed before it is inserted into
+     * the cache to \a bytes, or disables compression if \a bytes is 0, which
+     * is the default.
+     *
+     * Compressed entries take up less of the cache, so it can hold more of
+     * them, at the expense of compressing them on insertion and
+     * decompressing them every time they are found. This pays off for data
+     * which compresses well, such as raw image data. Data which doesn't get
+     * any smaller is stored as it is. Note that the expected item size passed
+     * to the constructor should then be based on the compressed size.
+     *
+     * Compressed entries are decompressed transparently, by every process
+     * using the cache. They are not pinned by findPinned(), which has to
+     * return a decompressed copy of their data instead.
+     *
+     * Like the defragmentation limit this setting is not shared, it only
+     * applies to inserts through this object.
+     *
+     * \since 6.29
+     */
+    void setCompressionThreshold(unsigned bytes);
+
     /*!
      * Attempts to insert the entry \a data into the shared cache, named by
      * \a key, and returns true only if successful.
      *
      * Note that even if the insert was successful, that the newly added entry
      * may be evicted by other processes contending for the cache.
+     *
+     * Fails if an existing entry named by \a key is pinned, see findPinned().
+     *
+     * Caches of 1024 pages or more are split into up to 16 independently
+     * locked shards of at least 512 pages each, and every entry has to fit
+     * into the shard its key belongs to. Depending on the size of the cache an
+     * entry can thus take up no more than between a sixteenth and a half of
+     * totalSize(), and larger entries are rejected even if the cache is
+     * otherwise empty. Caches smaller than 4 MiB are never split with the
+     * default page size of 4 KiB.
      */
     bool insert(const QString &key, const QByteArray &data);
 
+    /*!
+     * Inserts the entry \a data named by \a key like insert() above, but lets
+     * it expire after \a timeToLive. Afterwards it is no longer found, and
+     * the space it takes up is reclaimed by later inserts. If \a timeToLive
+     * is not positive the entry never expires.
+     *
+     * The time is counted in whole seconds, by the wall clock.
+     *
+     * \since 6.29
+     */
+    bool insert(const QString &key, const QByteArray &data, std::chrono::seconds timeToLive);
+
+    /*!
+     * Inserts the entry \a data named by \a key like insert() above, tagged
+     * with \a tag, so that it can be removed along with all other entries
+     * with the same tag by invalidateTag(). An empty \a tag means no tag.
+     * The entry expires after \a timeToLive, if it is positive.
+     *
+     * \sa invalidateTag()
+     * \since 6.29
+     */
+    bool insert(const QString &key, const QByteArray &data, const QString &tag, std::chrono::seconds timeToLive = std::chrono::seconds::zero());
+
+    /*!
+     * Attempts to insert an entry of \a size bytes named by \a key into the
+     * shared cache, and returns true only if successful.
+     *
+     * Instead of being copied from a QByteArray the data is written by
+     * \a writeData, which is called with a pointer to the \a size bytes in
+     * the cache it has to fill. This allows serializing data directly into the
+     * cache, see KSharedDataCacheT. The cache is locked while \a writeData
+     * runs, so it has to be quick, and must not use the cache itself.
+     *
+     * Entries inserted this way are never compressed, see
+     * setCompressionThreshold(). The same limit on the size of a single entry
+     * as for insert() applies.
+     *
+     * \sa insert()
+     * \since 6.29
+     */
+    bool insert(const QString &key, qsizetype size, const std::function<void(char *data)> &writeData);
+
     /*!
      * Attempts to remove an entry with the specified \a key. Returns \c true if an entry has
-     * been removed; otherwise returns \c false.
+     * been removed; otherwise returns \c false. Pinned entries are not removed, see findPinned().
      *
      * \since 6.18
      */
@@ -139,10 +310,181 @@ public:
     bool find(const QString &key, QByteArray *destination) const;
 
     /*!
-     * Removes all entries from the cache.
+     * Looks up the entry named by \a key and calls \a readData with its data
+     * and its size in bytes, without copying it first. Returns true if
+     * \a key was present in the cache, false otherwise, in which case
+     * \a readData is not called.
+     *
+     * The cache is locked while \a readData runs, so it has to be quick, and
+     * must not use the cache itself. The data must not be used after it
+     * returns, see findPinned() for that.
+     *
+     * \sa find(), KSharedDataCacheT
+     * \since 6.29
+     */
+    bool find(const QString &key, const std::function<void(const char *data, qsizetype size)> &readData) const;
+
+    /*!
+     * \class KSharedDataCache::PinnedData
+     * \inmodule KCoreAddons
+     *
+     * \brief Provides direct access to the data of a cache entry.
+     *
+     * As long as this object exists the entry cannot be removed from the cache,
+     * nor moved within it, which allows its data to be used directly from the
+     * shared memory instead of copying it first.
+     *
+     * To keep entries pinned by crashed processes from occupying the cache
+     * forever pins expire after 10 minutes, after which the data may change.
+     * Pinned data should therefore only be held on to briefly, such as while
+     * decoding it.
+     *
+     * \sa KSharedDataCache::findPinned()
+     * \since 6.29
+     */
+    class KCOREADDONS_EXPORT PinnedData
+    {
+    public:
+        /*!
+         * Creates a null object, referring to no data.
+         */
+        PinnedData();
+        ~PinnedData();
+
+        PinnedData(PinnedData &&other) noexcept;
+        PinnedData &operator=(PinnedData &&other) noexcept;
+
+        /*!
+         * Returns \c true if this refers to no data, i.e. the entry was not
+         * found.
+         */
+        bool isNull() const;
+
+        /*!
+         * Returns a pointer to the data of the entry, or \c nullptr if this is
+         * null.
+         */
+        const char *constData() const;
+
+        /*!
+         * Returns the size of the data of the entry in bytes.
+         */
+        qsizetype size() const;
+
+        /*!
+         * Returns a QByteArray referring to the data of the entry without
+         * copying it, see QByteArray::fromRawData(). It must not be used after
+         * this object has been destroyed.
+         */
+        QByteArray toByteArray() const;
+
+    private:
+        friend class KSharedDataCache;
+        class Private;
+        std::unique_ptr<Private> d;
+    };
+
+    /*!
+     * Returns the data in the cache named by \a key, without copying it, or a
+     * null PinnedData if there is no such entry.
+     *
+     * The entry cannot be evicted, removed, overwritten or moved while the
+     * returned object exists, so this is a good fit for large entries which
+     * are processed right away. For small entries find() is usually faster.
+     *
+     * Compressed entries, see setCompressionThreshold(), are decompressed into
+     * the returned object instead of being pinned.
+     *
+     * \sa find()
+     * \since 6.29
+     */
+    PinnedData findPinned(const QString &key) const;
+
+    /*!
+     * Attempts to insert all of \a entries (pairs of key and data) into the
+     * shared cache, as if by calling insert() for each of them.
+     *
+     * This is considerably cheaper than calling insert() repeatedly, as the
+     * cache is locked only once for all entries stored in the same part of
+     * the cache, and room for all of them is made at once.
+     *
+     * Returns a list with one element per element of \a entries, which is
+     * \c true if that entry was inserted.
+     *
+     * \sa insert()
+     * \since 6.29
+     */
+    QList<bool> insertMany(const QList<QPair<QString, QByteArray>> &entries);
+
+    /*!
+     * Queues the entry \a data, named by \a key, to be inserted into the
+     * shared cache by a separate thread, so that the calling thread doesn't
+     * have to wait for the cache to be locked, or for room to be made.
+     *
+     * Returns a future which reports whether the entry was inserted, see
+     * insert(). Until it has finished the entry may not be found yet.
+     *
+     * Entries queued before the previous ones have been written are inserted
+     * together, as if by insertMany(). If an entry is queued again in the
+     * meantime only the last \a data is written, and all of the futures
+     * report the result of that.
+     *
+     * The queued entries are written before this object is destroyed, which
+     * waits for that.
+     *
+     * If the cache could not be shared, and is private to this object, the
+     * entry is inserted right away instead.
+     *
+     * \sa insert()
+     * \since 6.29
+     */
+    QFuture<bool> insertAsync(const QString &key, const QByteArray &data);
+
+    /*!
+     * Looks up all of \a keys in the cache, as if by calling find() for each
+     * of them, but with the cache locked at most once for all keys stored in
+     * the same part of the cache.
+     *
+     * The data of each key present in the cache is inserted into
+     * \a destination, if it is not \c nullptr. Data for keys not present in
+     * the cache is left unchanged.
+     *
+     * Returns a list with one element per element of \a keys, which is
+     * \c true if that key was present in the cache.
+     *
+     * \sa find()
+     * \since 6.29
+     */
+    QList<bool> findMany(const QStringList &keys, QHash<QString, QByteArray> *destination) const;
+
+    /*!
+     * Removes all entries from the cache, except for pinned ones.
+     *
+     * \sa findPinned()
      */
     void clear();
 
+    /*!
+     * Removes all entries inserted with \a tag, in all processes using the
+     * cache. This is meant for groups of entries which become invalid
+     * together, like all icons of a theme, and takes constant time: the
+     * entries are no longer found right away, but only actually removed by
+     * later inserts.
+     *
+     * Tags are told apart by their hash in one of only 256 slots, so this
+     * also removes the entries of every other tag sharing the slot of \a tag.
+     * Any two tags share a slot with a chance of 1 in 256, but with 10 tags in
+     * use there is a chance of about 16% that some of them do, and with 20
+     * tags it is more likely than not. Tags are thus best suited to a small
+     * number of groups, with an occasional unneeded removal being harmless.
+     * The data of entries pinned by findPinned() stays valid until it is
+     * released.
+     *
+     * \sa insert()
+     * \since 6.29
+     */
+    void invalidateTag(const QString &tag);
+
     /*!
      * Removes the underlying file from the cache. Note that this is *all* that this
      * function does. The shared memory segment is still attached and will still contain
@@ -169,6 +511,78 @@ public:
      */
     unsigned totalSize() const;
 
+    /*!
+     * Changes the size of the shared cache to \a newCacheSize bytes, keeping
+     * its entries, and returns true if successful. If the cache shrinks, the
+     * entries which don't fit anymore are evicted according to the eviction
+     * policy.
+     *
+     * The entries are copied into a new cache, which replaces the old one for
+     * all processes using it. They switch over the next time they access the
+     * cache. This takes time proportional to the size of the cache, during
+     * which it is locked, so it is meant to be done rarely.
+     *
+     * Attaching to an existing cache with a different size passed to the
+     * constructor does not change its size, the existing cache always wins.
+     *
+     * The statistics of the cache start over, see statistics().
+     *
+     * \since 6.29
+     */
+    bool resize(unsigned newCacheSize);
+
+    /*!
+     * Writes the entries of the cache into a snapshot at \a fileName, and
+     * returns true if successful. A snapshot is an immutable, indexed copy of
+     * the entries, which can be attached to a cache with attachSnapshot(), so
+     * that a cache which would otherwise start out empty starts out with them.
+     * This is meant for data which is known in advance, like the icons of an
+     * application, and can be prepared when building or installing it.
+     *
+     * Entries which have expired are left out. The expiry times and tags of
+     * the others are not kept, entries in a snapshot never expire. An existing
+     * file at \a fileName is replaced atomically.
+     *
+     * Snapshots can only be used on machines with the same byte order as the
+     * one which wrote them.
+     *
+     * \sa attachSnapshot()
+     * \since 6.29
+     */
+    bool exportSnapshot(const QString &fileName) const;
+
+    /*!
+     * Attaches the snapshot at \a fileName, written by exportSnapshot(), to
+     * this cache object, replacing any snapshot attached before. Returns true
+     * if successful, or false if the file could not be read or is not a valid
+     * snapshot.
+     *
+     * The snapshot acts as a read-only tier in front of the cache: find(),
+     * findPinned(), findMany() and contains() look up keys in the snapshot
+     * first, and only consult the cache if they are not found there. Lookups
+     * in the snapshot need no locking, and don't touch the shared cache at
+     * all, so they are not counted in statistics().
+     *
+     * As the snapshot comes first, inserting or removing an entry with a key
+     * contained in the snapshot has no effect on what is found for it.
+     *
+     * The snapshot is mapped into memory, so attaching it is cheap and the
+     * memory is shared with every other process attaching it. It is attached
+     * to this object only, every process needs to attach it on its own.
+     *
+     * \sa exportSnapshot(), detachSnapshot()
+     * \since 6.29
+     */
+    bool attachSnapshot(const QString &fileName);
+
+    /*!
+     * Detaches the snapshot attached by attachSnapshot(), if any. Data handed
+     * out by findPinned() stays valid until it is released.
+     *
+     * \since 6.29
+     */
+    void detachSnapshot();
+
     /*!
      * Returns the amount of free space in the cache, in bytes. Due to
      * implementation details it is possible to still not be able to fit an
@@ -221,9 +635,137 @@ public:
      */
     void setTimestamp(unsigned newTimestamp);
 
+    /*!
+     * \class KSharedDataCache::Statistics
+     * \inmodule KCoreAddons
+     *
+     * \brief Describes the state of a cache, see KSharedDataCache::statistics().
+     *
+     * \since 6.29
+     */
+    struct Statistics {
+        /*!
+         * The number of entries in the cache.
+         */
+        uint entryCount = 0;
+
+        /*!
+         * The maximum number of entries the index of the cache can hold.
+         */
+        uint indexSize = 0;
+
+        /*!
+         * The number of probes it takes to find the entry which is the
+         * hardest to find in the index.
+         */
+        uint maximumProbeLength = 0;
+
+        /*!
+         * The average number of probes it takes to find an entry in the index.
+         */
+        qreal averageProbeLength = 0;
+
+        /*!
+         * The number of entries found with a given number of probes: the
+         * element at position \c i is the number of entries which take
+         * \c{i + 1} probes to find.
+         */
+        QList<uint> probeLengthHistogram;
+
+        /*!
+         * The number of lookups which found their entry, through find(),
+         * findMany() or findPinned().
+         */
+        quint64 hits = 0;
+
+        /*!
+         * The number of lookups which did not find their entry.
+         */
+        quint64 misses = 0;
+
+        /*!
+         * The number of entries inserted, through any of the overloads of
+         * insert(), including the one taking a \c writeData function, or
+         * through insertMany() or insertAsync().
+         */
+        quint64 inserts = 0;
+
+        /*!
+         * The number of entries which could not be inserted, for instance
+         * because there was no room for them.
+         */
+        quint64 failedInserts = 0;
+
+        /*!
+         * The number of entries removed to make room for others.
+         */
+        quint64 evictions = 0;
+
+        /*!
+         * The number of expired entries removed, see insert().
+         */
+        quint64 expirations = 0;
+
+        /*!
+         * The number of times the cache has been defragmented, or a part of
+         * it, see setDefragmentationLimit().
+         */
+        quint64 defragmentations = 0;
+
+        /*!
+         * The total time spent defragmenting the cache, in nanoseconds.
+         */
+        quint64 defragmentationTime = 0;
+
+        /*!
+         * The total time spent waiting to lock the cache, in nanoseconds.
+         * This includes the time it takes to lock it when it is not
+         * contended, which is short but not zero.
+         */
+        quint64 lockWaitTime = 0;
+
+        /*!
+         * Returns the fraction of the index which is in use.
+         */
+        qreal indexLoadFactor() const
+        {
+            return indexSize ? qreal(entryCount) / indexSize : 0;
+        }
+
+        /*!
+         * Returns the fraction of lookups which found their entry.
+         */
+        qreal hitRatio() const
+        {
+            return hits + misses ? qreal(hits) / (hits + misses) : 0;
+        }
+
+    private:
+        // Statistics is returned by value from an exported function, so its
+        // size is part of the ABI. New members take the place of some of
+        // these, shrinking the array accordingly.
+        quint64 m_reserved[8] = {};
+    };
+
+    /*!
+     * Returns statistics about the cache, shared by all processes using it.
+     *
+     * The counters of events, such as Statistics::hits, are kept in the cache
+     * itself, so they cover every process which has used it since it was
+     * created. They are not reset by clear().
+     *
+     * This has to look at every entry of the cache, so it is meant for
+     * diagnostics rather than to be called frequently.
+     *
+     * \since 6.29
+     */
+    Statistics statistics() const;
+
 private:
     class Private;
     Private *d;
 };
 
+Q_DECLARE_OPERATORS_FOR_FLAGS(KSharedDataCache::MappingOptions)
+
 #endif
@@ -12,18 +12,117 @@
  * that don't support POSIX.
  */
 #include "kshareddatacache.h"
+#include "ksdcsnapshot_p.h"
 
 #include <QByteArray>
 #include <QCache>
+#include <QDeadlineTimer>
+#include <QFuture>
+#include <QHash>
+#include <QList>
+#include <QPair>
 #include <QString>
+#include <QStringList>
+
+#include <memory>
+#include <vector>
 
 class Q_DECL_HIDDEN KSharedDataCache::Private
 {
 public:
     KSharedDataCache::EvictionPolicy evictionPolicy;
-    QCache<QString, QByteArray> cache;
+
+    struct Entry {
+        QByteArray data;
+        QDeadlineTimer expiry;
+        QString tag;
+        quint64 tagGeneration;
+    };
+    QCache<QString, Entry> cache;
+
+    // Incremented by invalidateTag(), entries of older generations expire.
+    QHash<QString, quint64> tagGenerations;
+    unsigned defragmentationLimit = 1024 * 1024; // Unused, there are no pages to defragment
+    unsigned compressionThreshold = 0; // Unused, the data is shared with the caller instead
+
+    // Only counted for this object, nothing is shared.
+    mutable KSharedDataCache::Statistics statistics;
+
+    // Looked up before the cache, see KSharedDataCache::attachSnapshot().
+    std::shared_ptr<const KSDCSnapshot> snapshot;
+
+    // Looks up key in the snapshot, if any, copying its data into destination
+    // if that is not null.
+    bool findInSnapshot(const QString &key, QByteArray *destination) const
+    {
+        const char *data = nullptr;
+        uint size = 0;
+        uint flags = 0;
+        if (!snapshot || !snapshot->find(key.toUtf8(), &data, &size, &flags)) {
+            return false;
+        }
+
+        if (destination) {
+            // The snapshot may come from a cache which compresses entries.
+            *destination = (flags & KSDCSnapshot::Compressed) ? qUncompress(reinterpret_cast<const uchar *>(data), size) : QByteArray(data, size);
+        }
+
+        return true;
+    }
+
+    // Returns the data of the entry named by key, unless it has expired.
+    QByteArray *value(const QString &key)
+    {
+        Entry *entry = cache.object(key);
+        if (entry && (entry->expiry.hasExpired() || entry->tagGeneration != tagGenerations.value(entry->tag))) {
+            cache.remove(key);
+            statistics.expirations++;
+            return nullptr;
+        }
+
+        return entry ? &entry->data : nullptr;
+    }
+
+    QByteArray *lookup(const QString &key) const
+    {
+        QByteArray *value = const_cast<Private *>(this)->value(key);
+        (value ? statistics.hits : statistics.misses)++;
+        return value;
+    }
+};
+
+class Q_DECL_HIDDEN KSharedDataCache::PinnedData::Private
+{
+public:
+    // Shares the data with the cache, so no copy is needed here either.
+    QByteArray data;
 };
 
+KSharedDataCache::PinnedData::PinnedData() = default;
+KSharedDataCache::PinnedData::~PinnedData() = default;
+KSharedDataCache::PinnedData::PinnedData(PinnedData &&other) noexcept = default;
+KSharedDataCache::PinnedData &KSharedDataCache::PinnedData::operator=(PinnedData &&other) noexcept = default;
+
+bool KSharedDataCache::PinnedData::isNull() const
+{
+    return !d;
+}
+
+const char *KSharedDataCache::PinnedData::constData() const
+{
+    return d ? d->data.constData() : nullptr;
+}
+
+qsizetype KSharedDataCache::PinnedData::size() const
+{
+    return d ? d->data.size() : 0;
+}
+
+QByteArray KSharedDataCache::PinnedData::toByteArray() const
+{
+    return d ? d->data : QByteArray();
+}
+
 KSharedDataCache::KSharedDataCache(const QString &cacheName, unsigned defaultCacheSize, unsigned expectedItemSize)
     : d(new Private)
 {
@@ -33,6 +132,12 @@ KSharedDataCache::KSharedDataCache(const QString &cacheName, unsigned defaultCac
     Q_UNUSED(expectedItemSize);
 }
 
+KSharedDataCache::KSharedDataCache(const QString &cacheName, unsigned defaultCacheSize, unsigned expectedItemSize, MappingOptions options)
+    : KSharedDataCache(cacheName, defaultCacheSize, expectedItemSize)
+{
+    Q_UNUSED(options); // Nothing is mapped
+}
+
 KSharedDataCache::~KSharedDataCache()
 {
     delete d;
@@ -48,9 +153,53 @@ void KSharedDataCache::setEvictionPolicy(KSharedDataCache::EvictionPolicy newPol
     d->evictionPolicy = newPolicy;
 }
 
+unsigned KSharedDataCache::defragmentationLimit() const
+{
+    return d->defragmentationLimit;
+}
+
+void KSharedDataCache::setDefragmentationLimit(unsigned bytes)
+{
+    d->defragmentationLimit = bytes;
+}
+
+unsigned KSharedDataCache::compressionThreshold() const
+{
+    return d->compressionThreshold;
+}
+
+void KSharedDataCache::setCompressionThreshold(unsigned bytes)
+{
+    d->compressionThreshold = bytes;
+}
+
 bool KSharedDataCache::insert(const QString &key, const QByteArray &data)
 {
-    return d->cache.insert(key, new QByteArray(data));
+    return insert(key, data, std::chrono::seconds::zero());
+}
+
+bool KSharedDataCache::insert(const QString &key, const QByteArray &data, std::chrono::seconds timeToLive)
+{
+    return insert(key, data, QString(), timeToLive);
+}
+
+bool KSharedDataCache::insert(const QString &key, const QByteArray &data, const QString &tag, std::chrono::seconds timeToLive)
+{
+    const QDeadlineTimer expiry = timeToLive.count() > 0 ? QDeadlineTimer(timeToLive) : QDeadlineTimer(QDeadlineTimer::Forever);
+    const bool inserted = d->cache.insert(key, new Private::Entry{data, expiry, tag, d->tagGenerations.value(tag)});
+    (inserted ? d->statistics.inserts : d->statistics.failedInserts)++;
+    return inserted;
+}
+
+bool KSharedDataCache::insert(const QString &key, qsizetype size, const std::function<void(char *)> &writeData)
+{
+    if (size < 0) {
+        return false;
+    }
+
+    QByteArray data(size, Qt::Uninitialized);
+    writeData(data.data());
+    return insert(key, data);
 }
 
 bool KSharedDataCache::remove(const QString &key)
@@ -60,7 +209,11 @@ bool KSharedDataCache::remove(const QString &key)
 
 bool KSharedDataCache::find(const QString &key, QByteArray *destination) const
 {
-    QByteArray *value = d->cache.object(key);
+    if (d->findInSnapshot(key, destination)) {
+        return true;
+    }
+
+    QByteArray *value = d->lookup(key);
 
     if (value) {
         if (destination) {
@@ -72,11 +225,93 @@ bool KSharedDataCache::find(const QString &key, QByteArray *destination) const
     }
 }
 
+bool KSharedDataCache::find(const QString &key, const std::function<void(const char *, qsizetype)> &readData) const
+{
+    QByteArray snapshotData;
+    if (d->findInSnapshot(key, &snapshotData)) {
+        readData(snapshotData.constData(), snapshotData.size());
+        return true;
+    }
+
+    const QByteArray *value = d->lookup(key);
+    if (value) {
+        readData(value->constData(), value->size());
+    }
+
+    return value != nullptr;
+}
+
+KSharedDataCache::PinnedData KSharedDataCache::findPinned(const QString &key) const
+{
+    PinnedData result;
+
+    QByteArray snapshotData;
+    if (d->findInSnapshot(key, &snapshotData)) {
+        result.d = std::make_unique<PinnedData::Private>();
+        result.d->data = snapshotData;
+        return result;
+    }
+
+    QByteArray *value = d->lookup(key);
+    if (value) {
+        result.d = std::make_unique<PinnedData::Private>();
+        result.d->data = *value;
+    }
+
+    return result;
+}
+
+QList<bool> KSharedDataCache::insertMany(const QList<QPair<QString, QByteArray>> &entries)
+{
+    QList<bool> results;
+    results.reserve(entries.size());
+    for (const auto &entry : entries) {
+        results.append(insert(entry.first, entry.second));
+    }
+    return results;
+}
+
+QFuture<bool> KSharedDataCache::insertAsync(const QString &key, const QByteArray &data)
+{
+    // Inserting is cheap enough here, there is nothing to lock or evict.
+    return QtFuture::makeReadyValueFuture(insert(key, data));
+}
+
+QList<bool> KSharedDataCache::findMany(const QStringList &keys, QHash<QString, QByteArray> *destination) const
+{
+    QList<bool> results;
+    results.reserve(keys.size());
+    for (const QString &key : keys) {
+        QByteArray snapshotData;
+        if (d->findInSnapshot(key, destination ? &snapshotData : nullptr)) {
+            if (destination) {
+                destination->insert(key, snapshotData);
+            }
+            results.append(true);
+            continue;
+        }
+
+        QByteArray *value = d->lookup(key);
+        if (value && destination) {
+            destination->insert(key, *value);
+        }
+        results.append(value != nullptr);
+    }
+    return results;
+}
+
 void KSharedDataCache::clear()
 {
     d->cache.clear();
 }
 
+void KSharedDataCache::invalidateTag(const QString &tag)
+{
+    if (!tag.isEmpty()) {
+        d->tagGenerations[tag]++;
+    }
+}
+
 void KSharedDataCache::deleteCache(const QString &cacheName)
 {
     Q_UNUSED(cacheName);
@@ -84,7 +319,37 @@ void KSharedDataCache::deleteCache(const QString &cacheName)
 
 bool KSharedDataCache::contains(const QString &key) const
 {
-    return d->cache.contains(key);
+    return d->findInSnapshot(key, nullptr) || d->value(key) != nullptr;
+}
+
+bool KSharedDataCache::exportSnapshot(const QString &fileName) const
+{
+    std::vector<KSDCSnapshot::Entry> entries;
+    const QList<QString> keys = d->cache.keys();
+    for (const QString &key : keys) {
+        const QByteArray *value = d->value(key);
+        if (value) {
+            entries.push_back(KSDCSnapshot::Entry{key.toUtf8(), *value, 0});
+        }
+    }
+
+    return KSDCSnapshot::write(fileName, entries);
+}
+
+bool KSharedDataCache::attachSnapshot(const QString &fileName)
+{
+    std::shared_ptr<const KSDCSnapshot> snapshot = KSDCSnapshot::open(fileName);
+    if (!snapshot) {
+        return false;
+    }
+
+    d->snapshot = std::move(snapshot);
+    return true;
+}
+
+void KSharedDataCache::detachSnapshot()
+{
+    d->snapshot.reset();
 }
 
 unsigned KSharedDataCache::totalSize() const
@@ -92,6 +357,12 @@ unsigned KSharedDataCache::totalSize() const
     return static_cast<unsigned>(d->cache.maxCost());
 }
 
+bool KSharedDataCache::resize(unsigned newCacheSize)
+{
+    d->cache.setMaxCost(newCacheSize);
+    return true;
+}
+
 unsigned KSharedDataCache::freeSize() const
 {
     if (d->cache.totalCost() < d->cache.maxCost()) {
@@ -110,3 +381,16 @@ void KSharedDataCache::setTimestamp(unsigned newTimestamp)
 {
     Q_UNUSED(newTimestamp);
 }
+
+KSharedDataCache::Statistics KSharedDataCache::statistics() const
+{
+    Statistics result = d->statistics;
+    result.entryCount = d->cache.count();
+    result.indexSize = result.entryCount;
+    result.maximumProbeLength = result.entryCount > 0 ? 1 : 0;
+    result.averageProbeLength = result.maximumProbeLength;
+    if (result.entryCount > 0) {
+        result.probeLengthHistogram = {result.entryCount};
+    }
+    return result;
+}
@@ -0,0 +1,388 @@
+/*
+    This file is part of the KDE project.
+
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: LGPL-2.0-only
+*/
+
+#ifndef KSHAREDDATACACHET_H
+#define KSHAREDDATACACHET_H
+
+#include <kshareddatacache.h>
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QList>
+#include <QString>
+
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+/*!
+ * \class KSharedDataCacheCodec
+ * \inmodule KCoreAddons
+ *
+ * \brief Converts values to and from the data stored by KSharedDataCacheT.
+ *
+ * The generic implementation serializes values with QDataStream, so it
+ * supports every type which can be written to and read from a QDataStream.
+ * This requires a temporary buffer, so there are specializations which
+ * encode values directly into the cache instead, for
+ *
+ * \list
+ * \li trivially copyable types, which are copied as they are
+ * \li QByteArray and QString, whose contents are copied as they are
+ * \li QList of trivially copyable types
+ * \endlist
+ *
+ * Further specializations can be added for other types. Those encoding
+ * values directly into the cache provide
+ *
+ * \code
+ * // The number of bytes encode() writes
+ * static qsizetype size(const T &value);
+ * static void encode(const T &value, char *data);
+ * // Returns false if data is not a valid encoding of T
+ * static bool decode(const char *data, qsizetype size, T *value);
+ * \endcode
+ *
+ * while those which need a buffer provide
+ *
+ * \code
+ * static QByteArray encode(const T &value);
+ * static bool decode(const char *data, qsizetype size, T *value);
+ * \endcode
+ *
+ * Either kind may also provide
+ *
+ * \code
+ * static bool decode(QByteArray &&data, T *value);
+ * \endcode
+ *
+ * which KSharedDataCacheT::find() prefers, to let the value take over the
+ * copy of the data it reads from the cache instead of copying it again.
+ *
+ * As an example, a specialization storing the pixels of a QImage of a fixed
+ * format and size could copy them from QImage::constBits() in encode(), and
+ * into QImage::bits() of a newly created image in decode().
+ *
+ * The encoding is shared by every process using the cache, so it must not
+ * depend on anything specific to a process, such as addresses.
+ *
+ * \sa KSharedDataCacheT
+ * \since 6.29
+ */
+template<typename T, typename Enable = void>
+struct KSharedDataCacheCodec {
+    // Processes built against different versions of Qt may share a cache, so
+    // the version of the format must not depend on the one in use.
+    static constexpr QDataStream::Version streamVersion = QDataStream::Qt_6_0;
+
+    static QByteArray encode(const T &value)
+    {
+        QByteArray data;
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream.setVersion(streamVersion);
+        stream << value;
+        return data;
+    }
+
+    static bool decode(const char *data, qsizetype size, T *value)
+    {
+        QDataStream stream(QByteArray::fromRawData(data, size));
+        stream.setVersion(streamVersion);
+        stream >> *value;
+        return stream.status() == QDataStream::Ok;
+    }
+};
+
+template<typename T>
+struct KSharedDataCacheCodec<T, std::enable_if_t<std::is_trivially_copyable_v<T> && !std::is_pointer_v<T>>> {
+    static qsizetype size(const T &)
+    {
+        return sizeof(T);
+    }
+
+    static void encode(const T &value, char *data)
+    {
+        std::memcpy(data, &value, sizeof(T));
+    }
+
+    static bool decode(const char *data, qsizetype size, T *value)
+    {
+        if (size != sizeof(T)) {
+            return false;
+        }
+
+        std::memcpy(value, data, sizeof(T));
+        return true;
+    }
+};
+
+template<>
+struct KSharedDataCacheCodec<QByteArray> {
+    static qsizetype size(const QByteArray &value)
+    {
+        return value.size();
+    }
+
+    static void encode(const QByteArray &value, char *data)
+    {
+        std::memcpy(data, value.constData(), value.size());
+    }
+
+    static bool decode(const char *data, qsizetype size, QByteArray *value)
+    {
+        *value = QByteArray(data, size);
+        return true;
+    }
+
+    static bool decode(QByteArray &&data, QByteArray *value)
+    {
+        *value = std::move(data);
+        return true;
+    }
+};
+
+template<>
+struct KSharedDataCacheCodec<QString> {
+    static qsizetype size(const QString &value)
+    {
+        return value.size() * sizeof(QChar);
+    }
+
+    static void encode(const QString &value, char *data)
+    {
+        std::memcpy(data, value.constData(), value.size() * sizeof(QChar));
+    }
+
+    static bool decode(const char *data, qsizetype size, QString *value)
+    {
+        if (size % sizeof(QChar) != 0) {
+            return false;
+        }
+
+        // The data is not necessarily aligned, so it has to be copied instead
+        // of being used as QChars.
+        *value = QString(size / sizeof(QChar), Qt::Uninitialized);
+        std::memcpy(value->data(), data, size);
+        return true;
+    }
+};
+
+template<typename T>
+struct KSharedDataCacheCodec<QList<T>, std::enable_if_t<std::is_trivially_copyable_v<T> && !std::is_pointer_v<T>>> {
+    static qsizetype size(const QList<T> &value)
+    {
+        return value.size() * sizeof(T);
+    }
+
+    static void encode(const QList<T> &value, char *data)
+    {
+        std::memcpy(data, value.constData(), value.size() * sizeof(T));
+    }
+
+    static bool decode(const char *data, qsizetype size, QList<T> *value)
+    {
+        if (size % sizeof(T) != 0) {
+            return false;
+        }
+
+        value->resize(size / sizeof(T));
+        std::memcpy(value->data(), data, size);
+        return true;
+    }
+};
+
+namespace KSharedDataCacheTPrivate
+{
+// Whether Codec encodes values in place, see KSharedDataCacheCodec.
+template<typename Codec, typename Value, typename = void>
+struct EncodesInPlace : std::false_type {
+};
+
+template<typename Codec, typename Value>
+struct EncodesInPlace<Codec, Value, std::void_t<decltype(Codec::size(std::declval<const Value &>()))>> : std::true_type {
+};
+
+// Whether Codec can take over the data of a value, see KSharedDataCacheCodec.
+template<typename Codec, typename Value, typename = void>
+struct DecodesByteArray : std::false_type {
+};
+
+template<typename Codec, typename Value>
+struct DecodesByteArray<Codec, Value, std::void_t<decltype(Codec::decode(std::declval<QByteArray &&>(), std::declval<Value *>()))>> : std::true_type {
+};
+}
+
+/*!
+ * \class KSharedDataCacheT
+ * \inmodule KCoreAddons
+ *
+ * \brief A KSharedDataCache holding values of type \c Value, named by keys of
+ * type \c Key.
+ *
+ * The values are converted to and from the data in the cache by \c Codec,
+ * which by default is KSharedDataCacheCodec<Value>. Where possible values are
+ * encoded directly into the cache, without any copies in between. Values are
+ * decoded from a copy of their data, which is usually taken without locking
+ * the cache, so that decoding them doesn't hold up other users of the cache.
+ * Codecs can take over that copy, as the one for QByteArray does, so such
+ * values are copied only once.
+ *
+ * Keys can be of any type a QString can be constructed from, or of an
+ * arithmetic type.
+ *
+ * Example usage:
+ *
+ * \code
+ * struct ThumbnailInfo {
+ *     qint64 modificationTime;
+ *     int width;
+ *     int height;
+ * };
+ *
+ * KSharedDataCacheT<QString, ThumbnailInfo> cache(QStringLiteral("thumbnail-info"), 1024 * 1024);
+ *
+ * ThumbnailInfo info;
+ * if (!cache.find(path, &info)) {
+ *     info = readThumbnailInfo(path);
+ *     cache.insert(path, info);
+ * }
+ * \endcode
+ *
+ * Values which are encoded in place are not compressed, see
+ * KSharedDataCache::setCompressionThreshold().
+ *
+ * Every value stored in a cache has to be of the same type, as its type is
+ * not stored along with it. The underlying KSharedDataCache is available
+ * through cache() for everything else.
+ *
+ * \sa KSharedDataCache, KSharedDataCacheCodec
+ * \since 6.29
+ */
+template<typename Key, typename Value, typename Codec = KSharedDataCacheCodec<Value>>
+class KSharedDataCacheT
+{
+public:
+    /*!
+     * Attaches to the shared cache \a cacheName, see KSharedDataCache for
+     * \a defaultCacheSize and \a expectedItemSize.
+     */
+    KSharedDataCacheT(const QString &cacheName, unsigned defaultCacheSize, unsigned expectedItemSize = 0)
+        : m_cache(cacheName, defaultCacheSize, expectedItemSize)
+    {
+    }
+
+    /*!
+     * Attempts to insert \a value into the cache, named by \a key, and
+     * returns true only if successful.
+     *
+     * \sa KSharedDataCache::insert()
+     */
+    bool insert(const Key &key, const Value &value)
+    {
+        if constexpr (KSharedDataCacheTPrivate::EncodesInPlace<Codec, Value>::value) {
+            return m_cache.insert(cacheKey(key), Codec::size(value), [&value](char *data) {
+                Codec::encode(value, data);
+            });
+        } else {
+            return m_cache.insert(cacheKey(key), Codec::encode(value));
+        }
+    }
+
+    /*!
+     * Looks up the value named by \a key, and stores it in \a destination if
+     * it is not \c nullptr. Returns true if it was found, false if there is no
+     * such value in the cache or it could not be decoded, in which case
+     * \a destination is left unchanged.
+     *
+     * \sa KSharedDataCache::find()
+     */
+    bool find(const Key &key, Value *destination) const
+    {
+        if (!destination) {
+            return m_cache.contains(cacheKey(key));
+        }
+
+        QByteArray data;
+        if (!m_cache.find(cacheKey(key), &data)) {
+            return false;
+        }
+
+        Value value;
+        if constexpr (KSharedDataCacheTPrivate::DecodesByteArray<Codec, Value>::value) {
+            if (!Codec::decode(std::move(data), &value)) {
+                return false;
+            }
+        } else if (!Codec::decode(data.constData(), data.size(), &value)) {
+            return false;
+        }
+
+        *destination = std::move(value);
+        return true;
+    }
+
+    /*!
+     * Returns true if the cache currently contains a value named by \a key.
+     *
+     * \sa KSharedDataCache::contains()
+     */
+    bool contains(const Key &key) const
+    {
+        return m_cache.contains(cacheKey(key));
+    }
+
+    /*!
+     * Removes the value named by \a key. Returns true if there was such a
+     * value.
+     *
+     * \sa KSharedDataCache::remove()
+     */
+    bool remove(const Key &key)
+    {
+        return m_cache.remove(cacheKey(key));
+    }
+
+    /*!
+     * Removes all values from the cache.
+     *
+     * \sa KSharedDataCache::clear()
+     */
+    void clear()
+    {
+        m_cache.clear();
+    }
+
+    /*!
+     * Returns the underlying cache.
+     */
+    KSharedDataCache &cache()
+    {
+        return m_cache;
+    }
+
+    /*!
+     * \overload
+     */
+    const KSharedDataCache &cache() const
+    {
+        return m_cache;
+    }
+
+private:
+    static QString cacheKey(const Key &key)
+    {
+        if constexpr (std::is_arithmetic_v<Key>) {
+            return QString::number(key);
+        } else {
+            return QString(key);
+        }
+    }
+
+    KSharedDataCache m_cache;
+};
+
+#endif
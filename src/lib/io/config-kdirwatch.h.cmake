@@ -2,4 +2,6 @@
 
 #cmakedefine01 HAVE_INOTIFY_DIRECT_READV
 
+#cmakedefine01 HAVE_FANOTIFY
+
 #cmakedefine01 HAVE_QTDBUS
@@ -41,6 +41,7 @@
 #include <QDir>
 #include <QFile>
 #include <QLoggingCategory>
+#include <QMutexLocker>
 #include <QSocketNotifier>
 #include <QThread>
 #include <QThreadStorage>
@@ -67,6 +68,8 @@
 #define IN_ONLYDIR 0x01000000
 #endif
 
+#include <poll.h>
+
 // debug
 #include <sys/ioctl.h>
 
@@ -74,6 +77,19 @@
 
 #endif // HAVE_SYS_INOTIFY_H
 
+#if HAVE_FANOTIFY
+#include <climits>
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+
+// Everything the inotify watches are registered for, apart from the events
+// on the watched entries themselves, which fanotify reports on their parents.
+static const uint64_t s_fanotifyMask = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MODIFY | FAN_ATTRIB | FAN_ONDIR;
+
+// Limits the directories of the whole filesystem remembered by fanotifyDirectory()
+static const int s_maxFANotifyDirectories = 4096;
+#endif // HAVE_FANOTIFY
+
 Q_DECLARE_LOGGING_CATEGORY(KDIRWATCH)
 // logging category for this framework, default: log stuff >= warning
 Q_LOGGING_CATEGORY(KDIRWATCH, "kf.coreaddons.kdirwatch", QtWarningMsg)
@@ -102,6 +118,10 @@ static KDirWatch::Method methodFromString(const QByteArray &method)
         return KDirWatch::Stat;
     } else if (method == "QFSWatch") {
         return KDirWatch::QFSWatch;
+#if HAVE_FANOTIFY
+    } else if (method == "FANotify") {
+        return KDirWatch::FANotify;
+#endif
     } else {
 #if HAVE_SYS_INOTIFY_H
         // inotify supports delete+recreate+modify, which QFSWatch doesn't support
@@ -121,6 +141,8 @@ static const char *methodToString(KDirWatch::Method method)
         return "Stat";
     case KDirWatch::QFSWatch:
         return "QFSWatch";
+    case KDirWatch::FANotify:
+        return "FANotify";
     }
     // not reached
     return nullptr;
@@ -130,6 +152,320 @@ static const char s_envNfsPoll[] = "KDIRWATCH_NFSPOLLINTERVAL";
 static const char s_envPoll[] = "KDIRWATCH_POLLINTERVAL";
 static const char s_envMethod[] = "KDIRWATCH_METHOD";
 static const char s_envNfsMethod[] = "KDIRWATCH_NFSMETHOD";
+static const char s_envReaderThread[] = "KDIRWATCH_READER_THREAD";
+
+#if HAVE_SYS_INOTIFY_H
+//
+// Class KDirWatchReader
+//
+
+Q_GLOBAL_STATIC(KDirWatchReader, s_reader)
+
+// Limits what is kept for a thread which doesn't get to process its events,
+// several times as much as fits into a kernel queue of the default size
+static const qsizetype s_maxQueuedBytes = 8 * 1024 * 1024;
+
+QByteArray KDirWatchReader::inotifyOverflowEvent()
+{
+    struct inotify_event event = {};
+    event.wd = -1;
+    event.mask = IN_Q_OVERFLOW;
+    return QByteArray(reinterpret_cast<const char *>(&event), sizeof(event));
+}
+
+KDirWatchReader::KDirWatchReader()
+    : m_quit(false)
+    , m_inotifyFd(-1)
+{
+    setObjectName(QStringLiteral("KDirWatchReader"));
+    if (pipe2(m_wakeUpFds, O_CLOEXEC | O_NONBLOCK) != 0) {
+        qCWarning(KDIRWATCH) << "Can't create the pipe of the reader thread:" << strerror(errno);
+        m_wakeUpFds[0] = m_wakeUpFds[1] = -1;
+    }
+}
+
+KDirWatchReader::~KDirWatchReader()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_quit = true;
+    }
+    wakeUp();
+    wait();
+
+    if (m_inotifyFd >= 0) {
+        QT_CLOSE(m_inotifyFd);
+    }
+    if (m_wakeUpFds[0] >= 0) {
+        QT_CLOSE(m_wakeUpFds[0]);
+        QT_CLOSE(m_wakeUpFds[1]);
+    }
+}
+
+// Returns null on exit, once the reader is gone
+KDirWatchReader *KDirWatchReader::self()
+{
+    KDirWatchReader *reader = s_reader();
+    return reader && reader->m_wakeUpFds[0] >= 0 ? reader : nullptr;
+}
+
+void KDirWatchReader::addDescriptor(int fd, KDirWatchPrivate *receiver, Handler handler, const QByteArray &overflowEvent)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_descriptors.insert(fd, Descriptor{receiver, handler, QByteArray(), overflowEvent, false, false});
+        if (!isRunning()) {
+            start();
+        }
+    }
+    wakeUp();
+}
+
+void KDirWatchReader::removeDescriptor(int fd)
+{
+    {
+        // run() only reads registered descriptors, with the mutex held
+        QMutexLocker locker(&m_mutex);
+        m_descriptors.remove(fd);
+    }
+    wakeUp();
+}
+
+QByteArray KDirWatchReader::takeData(int fd)
+{
+    QMutexLocker locker(&m_mutex);
+    auto it = m_descriptors.find(fd);
+    if (it == m_descriptors.end()) {
+        return QByteArray();
+    }
+
+    return takeData(*it);
+}
+
+int KDirWatchReader::addINotifyReceiver(KDirWatchPrivate *receiver)
+{
+    int fd;
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_inotifyFd < 0) {
+            m_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (m_inotifyFd < 0) {
+                return -1;
+            }
+        }
+
+        m_inotifyReceivers.insert(receiver, Descriptor{receiver, &KDirWatchPrivate::inotifyEventReceived, QByteArray(), inotifyOverflowEvent(), false, false});
+        if (!isRunning()) {
+            start();
+        }
+        fd = m_inotifyFd;
+    }
+    wakeUp();
+    return fd;
+}
+
+void KDirWatchReader::removeINotifyReceiver(KDirWatchPrivate *receiver)
+{
+    QMutexLocker locker(&m_mutex);
+    for (auto it = m_inotifyWatches.begin(); it != m_inotifyWatches.end();) {
+        it->remove(receiver);
+        if (it->isEmpty()) {
+            (void)inotify_rm_watch(m_inotifyFd, it.key());
+            it = m_inotifyWatches.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    m_inotifyReceivers.remove(receiver);
+}
+
+int KDirWatchReader::addINotifyWatch(KDirWatchPrivate *receiver, const QByteArray &path, uint mask)
+{
+    QMutexLocker locker(&m_mutex);
+    // Every receiver uses the same mask, so that adding the watch of an
+    // inode again, which replaces its mask, doesn't change anything
+    const int wd = inotify_add_watch(m_inotifyFd, path.constData(), mask);
+    if (wd >= 0) {
+        ++m_inotifyWatches[wd][receiver];
+    }
+    return wd;
+}
+
+void KDirWatchReader::removeINotifyWatch(KDirWatchPrivate *receiver, int wd)
+{
+    QMutexLocker locker(&m_mutex);
+    // The watch is gone already if its inode was deleted
+    auto it = m_inotifyWatches.find(wd);
+    if (it == m_inotifyWatches.end()) {
+        return;
+    }
+
+    auto receiverIt = it->find(receiver);
+    if (receiverIt == it->end()) {
+        return;
+    }
+    if (--*receiverIt == 0) {
+        it->erase(receiverIt);
+    }
+
+    // Only the last receiver of a watch removes it from the kernel
+    if (it->isEmpty()) {
+        (void)inotify_rm_watch(m_inotifyFd, wd);
+        m_inotifyWatches.erase(it);
+    }
+}
+
+QByteArray KDirWatchReader::takeINotifyEvents(KDirWatchPrivate *receiver)
+{
+    QMutexLocker locker(&m_mutex);
+    auto it = m_inotifyReceivers.find(receiver);
+    if (it == m_inotifyReceivers.end()) {
+        return QByteArray();
+    }
+
+    return takeData(*it);
+}
+
+void KDirWatchReader::wakeUp()
+{
+    // If the pipe is full, poll() is woken up already
+    const char byte = 0;
+    (void)QT_WRITE(m_wakeUpFds[1], &byte, 1);
+}
+
+void KDirWatchReader::queueData(Descriptor &descriptor, const char *data, qsizetype size)
+{
+    if (descriptor.overflowed) {
+        return;
+    }
+
+    if (descriptor.data.size() + size > s_maxQueuedBytes) {
+        // Like the kernel queue, drop the events and tell the receiver it has
+        // to check everything instead
+        descriptor.data = descriptor.overflowEvent;
+        descriptor.overflowed = true;
+    } else {
+        descriptor.data.append(data, size);
+    }
+
+    if (!descriptor.notified) {
+        descriptor.notified = true;
+        QMetaObject::invokeMethod(descriptor.receiver, descriptor.handler, Qt::QueuedConnection);
+    }
+}
+
+QByteArray KDirWatchReader::takeData(Descriptor &descriptor)
+{
+    const QByteArray data = descriptor.data;
+    descriptor.data.clear();
+    descriptor.notified = false;
+    descriptor.overflowed = false;
+    return data;
+}
+
+// Passes the events of the shared inotify descriptor on to the receivers of
+// their watches, with the mutex held
+void KDirWatchReader::readINotifyEvents(QByteArray &buf)
+{
+    ssize_t bytesRead;
+    while ((bytesRead = QT_READ(m_inotifyFd, buf.data(), buf.size())) > 0) {
+        int offsetCurrent = 0;
+        while (offsetCurrent + int(sizeof(struct inotify_event)) <= bytesRead) {
+            const struct inotify_event *const event = (struct inotify_event *)(buf.constData() + offsetCurrent);
+            const int eventSize = sizeof(struct inotify_event) + event->len;
+            const char *const eventData = buf.constData() + offsetCurrent;
+            offsetCurrent += eventSize;
+
+            // Overflows concern every receiver, they have no watch
+            if (event->mask & IN_Q_OVERFLOW) {
+                for (Descriptor &descriptor : m_inotifyReceivers) {
+                    queueData(descriptor, eventData, eventSize);
+                }
+                continue;
+            }
+
+            auto it = m_inotifyWatches.find(event->wd);
+            if (it == m_inotifyWatches.end()) {
+                continue;
+            }
+
+            for (auto receiverIt = it->cbegin(); receiverIt != it->cend(); ++receiverIt) {
+                auto descriptorIt = m_inotifyReceivers.find(receiverIt.key());
+                if (descriptorIt != m_inotifyReceivers.end()) {
+                    queueData(*descriptorIt, eventData, eventSize);
+                }
+            }
+
+            // The kernel removed the watch, its descriptor may be handed out again
+            if (event->mask & IN_IGNORED) {
+                m_inotifyWatches.erase(it);
+            }
+        }
+    }
+}
+
+void KDirWatchReader::run()
+{
+    std::vector<pollfd> fds;
+    // Large enough for any inotify event, which is never split across reads
+    QByteArray buf(65536, Qt::Uninitialized);
+
+    for (;;) {
+        {
+            QMutexLocker locker(&m_mutex);
+            if (m_quit) {
+                return;
+            }
+
+            fds.clear();
+            fds.push_back(pollfd{m_wakeUpFds[0], POLLIN, 0});
+            if (m_inotifyFd >= 0) {
+                fds.push_back(pollfd{m_inotifyFd, POLLIN, 0});
+            }
+            for (auto it = m_descriptors.cbegin(); it != m_descriptors.cend(); ++it) {
+                fds.push_back(pollfd{it.key(), POLLIN, 0});
+            }
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            qCWarning(KDIRWATCH) << "poll failed in the reader thread:" << strerror(errno);
+            return;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            // The descriptors changed, see them again
+            char bytes[64];
+            while (QT_READ(m_wakeUpFds[0], bytes, sizeof(bytes)) > 0) { }
+        }
+
+        QMutexLocker locker(&m_mutex);
+        for (size_t i = 1; i < fds.size(); ++i) {
+            if (!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            if (fds[i].fd == m_inotifyFd) {
+                readINotifyEvents(buf);
+                continue;
+            }
+
+            // Skip descriptors removed since, they may be closed already
+            auto it = m_descriptors.find(fds[i].fd);
+            if (it == m_descriptors.end()) {
+                continue;
+            }
+
+            ssize_t bytesRead;
+            while ((bytesRead = QT_READ(fds[i].fd, buf.data(), buf.size())) > 0) {
+                queueData(*it, buf.constData(), bytesRead);
+            }
+        }
+    }
+}
+#endif // HAVE_SYS_INOTIFY_H
 
 //
 // Class KDirWatchPrivate (singleton)
@@ -157,6 +493,11 @@ static const char s_envNfsMethod[] = "KDIRWATCH_NFSMETHOD";
  *   introduced. You're now able to watch arbitrary inode's
  *   for changes, and even get notification when they're
  *   unmounted.
+ * - FANOTIFY: Since LINUX 5.9, fanotify reports the directory
+ *   and name of created, deleted, moved and modified entries of
+ *   a whole filesystem. When preferred, a recursive watch is a
+ *   single mark on the filesystem instead of one inotify watch
+ *   per subdirectory, all other entries still use inotify.
  */
 
 KDirWatchPrivate::KDirWatchPrivate()
@@ -171,6 +512,12 @@ KDirWatchPrivate::KDirWatchPrivate()
 #if HAVE_SYS_INOTIFY_H
     mSn(nullptr)
     ,
+#endif
+#if HAVE_FANOTIFY
+    mFanSn(nullptr)
+    , supports_fanotify(false)
+    , m_fanotify_fd(-1)
+    ,
 #endif
     _isStopped(false)
 {
@@ -184,6 +531,12 @@ KDirWatchPrivate::KDirWatchPrivate()
     m_nfsPollInterval = qEnvironmentVariableIsSet(s_envNfsPoll) ? qEnvironmentVariableIntValue(s_envNfsPoll) : 5000;
     m_PollInterval = qEnvironmentVariableIsSet(s_envPoll) ? qEnvironmentVariableIntValue(s_envPoll) : 500;
 
+#if HAVE_SYS_INOTIFY_H && !HAVE_INOTIFY_DIRECT_READV
+    m_useReaderThread = qEnvironmentVariableIntValue(s_envReaderThread) != 0 && KDirWatchReader::self();
+#else
+    m_useReaderThread = false;
+#endif
+
     m_preferredMethod = methodFromString(qEnvironmentVariableIsSet(s_envMethod) ? qgetenv(s_envMethod) : "inotify");
     // The nfs method defaults to the normal (local) method
     m_nfsPreferredMethod = methodFromString(qEnvironmentVariableIsSet(s_envNfsMethod) ? qgetenv(s_envNfsMethod) : "Stat");
@@ -197,11 +550,19 @@ KDirWatchPrivate::KDirWatchPrivate()
     rescan_timer.setSingleShot(true);
     connect(&rescan_timer, &QTimer::timeout, this, &KDirWatchPrivate::slotRescan);
 
+    // used for KDirWatch::setBatchInterval()
+    m_batchTimer.setObjectName(QStringLiteral("KDirWatchPrivate::batch_timer"));
+    m_batchTimer.setSingleShot(true);
+    connect(&m_batchTimer, &QTimer::timeout, this, &KDirWatchPrivate::slotFlushBatches);
+
 #if HAVE_SYS_INOTIFY_H
 #if HAVE_INOTIFY_DIRECT_READV
     m_inotify_fd = inotify_init1(IN_DIRECT);
 #else
-    m_inotify_fd = inotify_init();
+    // With the reader thread, the watches of all threads go into its inotify
+    // descriptor, so that watching a directory from several threads takes a
+    // single kernel watch
+    m_inotify_fd = m_useReaderThread ? KDirWatchReader::self()->addINotifyReceiver(this) : inotify_init();
 #endif
     supports_inotify = m_inotify_fd > 0;
 
@@ -209,10 +570,42 @@ KDirWatchPrivate::KDirWatchPrivate()
         qCDebug(KDIRWATCH) << "Can't use Inotify, kernel doesn't support it:" << strerror(errno);
     } else {
         availableMethods << "INotify";
-        (void)fcntl(m_inotify_fd, F_SETFD, FD_CLOEXEC);
 
-        mSn = new QSocketNotifier(m_inotify_fd, QSocketNotifier::Read, this);
-        connect(mSn, &QSocketNotifier::activated, this, &KDirWatchPrivate::inotifyEventReceived);
+        if (!m_useReaderThread) {
+            (void)fcntl(m_inotify_fd, F_SETFD, FD_CLOEXEC);
+            mSn = new QSocketNotifier(m_inotify_fd, QSocketNotifier::Read, this);
+            connect(mSn, &QSocketNotifier::activated, this, &KDirWatchPrivate::inotifyEventReceived);
+        }
+    }
+#endif
+#if HAVE_FANOTIFY
+    // Only set up when asked for, marking a filesystem needs privileges most
+    // processes don't have anyway.
+    if (m_preferredMethod == KDirWatch::FANotify) {
+        m_fanotify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY | O_CLOEXEC);
+        supports_fanotify = m_fanotify_fd >= 0;
+
+        if (!supports_fanotify) {
+            qCDebug(KDIRWATCH) << "Can't use FANotify, kernel doesn't support it:" << strerror(errno);
+        } else {
+            availableMethods << "FANotify";
+
+            if (m_useReaderThread) {
+                fanotify_event_metadata overflowEvent = {};
+                overflowEvent.event_len = sizeof(overflowEvent);
+                overflowEvent.vers = FANOTIFY_METADATA_VERSION;
+                overflowEvent.metadata_len = sizeof(overflowEvent);
+                overflowEvent.mask = FAN_Q_OVERFLOW;
+                overflowEvent.fd = FAN_NOFD;
+                KDirWatchReader::self()->addDescriptor(m_fanotify_fd,
+                                                       this,
+                                                       &KDirWatchPrivate::fanotifyEventReceived,
+                                                       QByteArray(reinterpret_cast<const char *>(&overflowEvent), sizeof(overflowEvent)));
+            } else {
+                mFanSn = new QSocketNotifier(m_fanotify_fd, QSocketNotifier::Read, this);
+                connect(mFanSn, &QSocketNotifier::activated, this, &KDirWatchPrivate::fanotifyEventReceived);
+            }
+        }
     }
 #endif
 #if HAVE_QFILESYSTEMWATCHER
@@ -242,7 +635,20 @@ KDirWatchPrivate::~KDirWatchPrivate()
     }
 
 #if HAVE_SYS_INOTIFY_H
-    if (supports_inotify) {
+    // Stop reading the descriptors before closing them, the shared inotify
+    // descriptor stays with the reader
+    if (KDirWatchReader *reader = m_useReaderThread ? KDirWatchReader::self() : nullptr) {
+        if (supports_inotify) {
+            reader->removeINotifyReceiver(this);
+        }
+#if HAVE_FANOTIFY
+        if (m_fanotify_fd >= 0) {
+            reader->removeDescriptor(m_fanotify_fd);
+        }
+#endif
+    }
+
+    if (supports_inotify && !m_useReaderThread) {
 #if HAVE_INOTIFY_DIRECT_READV
         // We need to call a special closing function instead of the usual close(),
         // so reimplement QT_CLOSE here
@@ -255,6 +661,14 @@ KDirWatchPrivate::~KDirWatchPrivate()
 #endif
     }
 #endif
+#if HAVE_FANOTIFY
+    for (const FANotifyFilesystem &filesystem : std::as_const(m_fanotifyFilesystems)) {
+        QT_CLOSE(filesystem.fd);
+    }
+    if (m_fanotify_fd >= 0) {
+        QT_CLOSE(m_fanotify_fd);
+    }
+#endif
 #if HAVE_QFILESYSTEMWATCHER
     delete fsWatcher;
 #endif
@@ -408,6 +822,39 @@ void KDirWatchPrivate::inotifyEventReceived()
         libinotify_free_iovec(received[i]);
     }
 #else
+    if (m_useReaderThread) {
+        KDirWatchReader *reader = KDirWatchReader::self();
+        if (!reader) {
+            return;
+        }
+
+        // The reader thread only ever reads whole events
+        const QByteArray events = reader->takeINotifyEvents(this);
+        int offsetCurrent = 0;
+        while (events.size() - offsetCurrent >= int(sizeof(struct inotify_event))) {
+            const struct inotify_event *const event = reinterpret_cast<const inotify_event *>(events.constData() + offsetCurrent);
+            const int eventSize = sizeof(struct inotify_event) + event->len;
+            if (events.size() - offsetCurrent < eventSize) {
+                break;
+            }
+            offsetCurrent += eventSize;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Lost track of the changes, in the kernel or in the reader
+                // thread, the best we can do is check what's watched
+                qCWarning(KDIRWATCH) << "Inotify Event queue overflowed, check max_queued_events value";
+                rescan_all = true;
+                if (!rescan_timer.isActive()) {
+                    rescan_timer.start(m_PollInterval); // singleshot
+                }
+                continue;
+            }
+
+            processEvent(event);
+        }
+        return;
+    }
+
     int pending = -1;
     int offsetStartRead = 0; // where we read into buffer
     char buf[8192];
@@ -451,6 +898,219 @@ void KDirWatchPrivate::inotifyEventReceived()
 #endif
 }
 
+void KDirWatchPrivate::fanotifyEventReceived()
+{
+#if HAVE_FANOTIFY
+    if (m_fanotify_fd < 0) {
+        return;
+    }
+
+    alignas(fanotify_event_metadata) char buf[8192];
+    QByteArray readerData;
+    // The marks cover whole filesystems, most events concern no entry at all
+    bool matched = false;
+    for (;;) {
+        // The descriptor is non-blocking, this stops once everything is read
+        char *data = buf;
+        ssize_t bytesAvailable;
+        if (m_useReaderThread) {
+            KDirWatchReader *reader = KDirWatchReader::self();
+            readerData = reader ? reader->takeData(m_fanotify_fd) : QByteArray();
+            data = readerData.data();
+            bytesAvailable = readerData.size();
+        } else {
+            bytesAvailable = read(m_fanotify_fd, buf, sizeof(buf));
+        }
+        if (bytesAvailable <= 0) {
+            break;
+        }
+
+        auto *event = reinterpret_cast<fanotify_event_metadata *>(data);
+        for (; FAN_EVENT_OK(event, bytesAvailable); event = FAN_EVENT_NEXT(event, bytesAvailable)) {
+            if (event->vers != FANOTIFY_METADATA_VERSION) {
+                qCWarning(KDIRWATCH) << "Unsupported fanotify event version" << event->vers;
+                return;
+            }
+
+            if (event->mask & FAN_Q_OVERFLOW) {
+                // Lost track of the changes, the best we can do is check what's watched
+                qCWarning(KDIRWATCH) << "FANotify Event queue overflowed, check max_queued_events value";
+                m_fanotifyDirectories.clear();
+                rescan_all = true;
+                matched = true;
+                continue;
+            }
+
+            if (processFANotifyEvent(event)) {
+                matched = true;
+            }
+        }
+    }
+
+    if (matched && !rescan_timer.isActive()) {
+        rescan_timer.start(m_PollInterval); // singleshot
+    }
+#endif
+}
+
+#if HAVE_FANOTIFY
+// Returns whether the event concerns any entry
+bool KDirWatchPrivate::processFANotifyEvent(const fanotify_event_metadata *event)
+{
+    // With FAN_REPORT_DFID_NAME, every event is reported on the directory
+    // containing the entry, followed by the name of the entry.
+    const auto *info = reinterpret_cast<const fanotify_event_info_fid *>(event + 1);
+    if (event->event_len < sizeof(*event) + sizeof(*info) + sizeof(file_handle)
+        || (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME && info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID)) {
+        return false;
+    }
+
+    const auto *handle = reinterpret_cast<const file_handle *>(info->handle);
+    if (event->event_len < sizeof(*event) + sizeof(*info) + sizeof(file_handle) + handle->handle_bytes) {
+        return false;
+    }
+    const char *name = info->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME ? reinterpret_cast<const char *>(handle->f_handle + handle->handle_bytes) : "";
+    if (*name && isNoisyFile(name)) {
+        return false;
+    }
+
+    quint64 fsid;
+    memcpy(&fsid, &info->fsid, sizeof(fsid));
+    const QString dir = fanotifyDirectory(fsid, handle);
+
+    if (dir.isEmpty()) {
+        // The directory is gone already
+        return false;
+    }
+
+    QString tpath = dir;
+    if (*name && strcmp(name, ".") != 0) {
+        if (!tpath.endsWith(QLatin1Char('/'))) {
+            tpath += QLatin1Char('/');
+        }
+        tpath += QFile::decodeName(name);
+    }
+
+    const bool isDir = event->mask & FAN_ONDIR;
+    if (isDir && (event->mask & (FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO))) {
+        // The paths of the directories below this one changed
+        forgetFANotifyDirectories(tpath);
+    }
+
+    // Events merged by the kernel don't tell in which order things happened
+    bool deletedFirst = false;
+    if ((event->mask & (FAN_CREATE | FAN_MOVED_TO)) && (event->mask & (FAN_DELETE | FAN_MOVED_FROM))) {
+        deletedFirst = QFileInfo::exists(tpath);
+    }
+
+    bool matched = false;
+    for (Entry *e : std::as_const(m_fanotifyEntries)) {
+        const QString &root = e->m_fanotifyPath;
+        if (tpath == root) {
+            // The watched directory itself, scanEntry() figures out what happened
+            e->dirty = true;
+            matched = true;
+            continue;
+        }
+        if (!tpath.startsWith(root) || (root.size() > 1 && tpath.at(root.size()) != QLatin1Char('/')) || e->m_clients.empty()) {
+            continue;
+        }
+
+        matched = true;
+        qCDebug(KDIRWATCH).nospace() << "got fanotify event " << Qt::hex << event->mask << Qt::dec << " for entry " << e->path
+                                     << (isDir ? " [directory] " : " [file] ") << tpath;
+
+        // Report the paths below the watched one, rather than the canonical ones
+        const QString path = e->path + tpath.mid(root.size());
+        const QString parent = e->path + dir.mid(root.size());
+        const bool inWatchedDir = dir == root;
+
+        // Entries in subdirectories are only reported to recursive watches,
+        // just like they are with an inotify watch per subdirectory.
+        const KDirWatch::WatchModes flag = isDir ? KDirWatch::WatchSubDirs : KDirWatch::WatchFiles;
+        const bool interested = std::any_of(e->m_clients.cbegin(), e->m_clients.cend(), [flag, inWatchedDir](const Client &client) {
+            return (client.m_watchModes & flag) && (inWatchedDir || (client.m_watchModes & KDirWatch::WatchSubDirs));
+        });
+
+        const bool created = event->mask & (FAN_CREATE | FAN_MOVED_TO);
+        const bool deleted = event->mask & (FAN_DELETE | FAN_MOVED_FROM);
+        if (interested) {
+            if (deleted && deletedFirst) {
+                emitEvent(e, Deleted, path);
+            }
+            if (created) {
+                emitEvent(e, Created, path);
+            }
+            if (deleted && !deletedFirst) {
+                emitEvent(e, Deleted, path);
+            }
+        }
+
+        if (created || deleted) {
+            if (inWatchedDir) {
+                e->dirty = true;
+            }
+            e->m_pendingFileChanges.append(parent);
+        }
+        if (event->mask & (FAN_MODIFY | FAN_ATTRIB)) {
+            // See inotifyEventReceived(), these are reported by the next slotRescan()
+            e->m_pendingFileChanges.append(path);
+        }
+    }
+
+    return matched;
+}
+
+// Returns the path of the directory with the file @p handle, or an empty string
+// if it doesn't exist anymore.
+QString KDirWatchPrivate::fanotifyDirectory(quint64 fsid, const file_handle *handle)
+{
+    const QByteArray handleData(reinterpret_cast<const char *>(handle), sizeof(file_handle) + handle->handle_bytes);
+    const QByteArray key = QByteArray(reinterpret_cast<const char *>(&fsid), sizeof(fsid)) + handleData;
+    auto it = m_fanotifyDirectories.constFind(key);
+    if (it != m_fanotifyDirectories.constEnd()) {
+        return it.value();
+    }
+
+    auto filesystemIt = m_fanotifyFilesystems.constFind(fsid);
+    if (filesystemIt == m_fanotifyFilesystems.constEnd()) {
+        return QString();
+    }
+
+    // The copy is aligned, unlike the handle in the event
+    QByteArray alignedHandle = handleData;
+    const int fd = open_by_handle_at(filesystemIt->fd, reinterpret_cast<file_handle *>(alignedHandle.data()), O_PATH | O_CLOEXEC);
+    if (fd < 0) {
+        return QString();
+    }
+
+    char target[PATH_MAX];
+    const ssize_t length = readlink(QByteArray("/proc/self/fd/" + QByteArray::number(fd)).constData(), target, sizeof(target));
+    QT_CLOSE(fd);
+    const QByteArray targetPath(target, std::max<ssize_t>(length, 0));
+    if (length <= 0 || targetPath.endsWith(" (deleted)")) {
+        return QString();
+    }
+
+    if (m_fanotifyDirectories.size() >= s_maxFANotifyDirectories) {
+        m_fanotifyDirectories.clear();
+    }
+
+    const QString path = QFile::decodeName(targetPath);
+    m_fanotifyDirectories.insert(key, path);
+    return path;
+}
+
+// Forgets the paths of @p path and the directories below it
+void KDirWatchPrivate::forgetFANotifyDirectories(const QString &path)
+{
+    m_fanotifyDirectories.removeIf([&path](const auto &it) {
+        const QString &directory = it.value();
+        return directory.startsWith(path) && (directory.size() == path.size() || directory.at(path.size()) == QLatin1Char('/'));
+    });
+}
+#endif
+
 KDirWatchPrivate::Entry::~Entry()
 {
 }
@@ -619,6 +1279,7 @@ QDebug operator<<(QDebug debug, const KDirWatchPrivate::Entry &entry)
     }
     debug << ", using "
           << ((entry.m_mode == KDirWatchPrivate::INotifyMode)        ? "INotify"
+                  : (entry.m_mode == KDirWatchPrivate::FANotifyMode) ? "FANotify"
                   : (entry.m_mode == KDirWatchPrivate::QFSWatchMode) ? "QFSWatch"
                   : (entry.m_mode == KDirWatchPrivate::StatMode)     ? "Stat"
                                                                      : "Unknown Method");
@@ -651,8 +1312,7 @@ KDirWatchPrivate::Entry *KDirWatchPrivate::entry(const QString &_path)
         path.chop(1);
     }
 
-    auto it = m_mapEntries.find(path);
-    return it != m_mapEntries.end() ? &it.value() : nullptr;
+    return m_entryIndex.value(path);
 }
 
 // set polling frequency for a entry and adjust global freq if needed
@@ -696,7 +1356,14 @@ bool KDirWatchPrivate::useINotify(Entry *e)
     // May as well register for almost everything - it's free!
     int mask = IN_DELETE | IN_DELETE_SELF | IN_CREATE | IN_MOVE | IN_MOVE_SELF | IN_DONT_FOLLOW | IN_MOVED_FROM | IN_MODIFY | IN_ATTRIB;
 
-    if ((e->wd = inotify_add_watch(m_inotify_fd, QFile::encodeName(e->path).data(), mask)) != -1) {
+    const QByteArray path = QFile::encodeName(e->path);
+    if (m_useReaderThread) {
+        KDirWatchReader *reader = KDirWatchReader::self();
+        e->wd = reader ? reader->addINotifyWatch(this, path, mask) : -1;
+    } else {
+        e->wd = inotify_add_watch(m_inotify_fd, path.constData(), mask);
+    }
+    if (e->wd != -1) {
         m_inotify_wd_to_entry.insert(e->wd, e);
         if (s_verboseDebug) {
             qCDebug(KDIRWATCH) << "inotify successfully used for monitoring" << e->path << "wd=" << e->wd;
@@ -717,6 +1384,59 @@ bool KDirWatchPrivate::useINotify(Entry *e)
     return false;
 }
 #endif
+#if HAVE_FANOTIFY
+// setup a fanotify mark on the filesystem of a recursively watched directory,
+// returns false if not possible
+bool KDirWatchPrivate::useFANotify(Entry *e)
+{
+    e->dirty = false;
+
+    if (!supports_fanotify || e->m_status == NonExistent) {
+        return false;
+    }
+
+    const QByteArray path = QFile::encodeName(e->path);
+    struct statfs filesystemInfo;
+    if (statfs(path.constData(), &filesystemInfo) != 0) {
+        return false;
+    }
+    quint64 fsid;
+    memcpy(&fsid, &filesystemInfo.f_fsid, sizeof(fsid));
+
+    // All recursive entries on a filesystem share its mark
+    auto it = m_fanotifyFilesystems.find(fsid);
+    if (it == m_fanotifyFilesystems.end()) {
+        const int fd = QT_OPEN(path.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+
+        if (fanotify_mark(m_fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, s_fanotifyMask, fd, nullptr) != 0) {
+            if (errno == EPERM) {
+                // Every other filesystem would need the same privileges
+                qCDebug(KDIRWATCH) << "Can't use FANotify without CAP_SYS_ADMIN, using INotify instead";
+                supports_fanotify = false;
+            } else {
+                qCDebug(KDIRWATCH) << "fanotify failed for monitoring" << e->path << ":" << strerror(errno) << " (errno:" << errno << ")";
+            }
+            QT_CLOSE(fd);
+            return false;
+        }
+        it = m_fanotifyFilesystems.insert(fsid, FANotifyFilesystem{fd, 0});
+    }
+    ++it->refCount;
+
+    e->m_mode = FANotifyMode;
+    e->m_fanotifyMarked = true;
+    e->m_fanotifyFsid = fsid;
+    e->m_fanotifyPath = QFileInfo(e->path).canonicalFilePath();
+    m_fanotifyEntries.append(e);
+    if (s_verboseDebug) {
+        qCDebug(KDIRWATCH) << "fanotify successfully used for monitoring" << e->path << "and its subdirectories";
+    }
+    return true;
+}
+#endif
 #if HAVE_QFILESYSTEMWATCHER
 bool KDirWatchPrivate::useQFSWatch(Entry *e)
 {
@@ -796,11 +1516,10 @@ void KDirWatchPrivate::addEntry(KDirWatch *instance, const QString &_path, Entry
         path.chop(1);
     }
 
-    auto it = m_mapEntries.find(path);
-    if (it != m_mapEntries.end()) {
-        Entry &entry = it.value();
+    if (Entry *existingEntry = m_entryIndex.value(path)) {
+        Entry &entry = *existingEntry;
         if (sub_entry) {
-            entry.m_entries.append(sub_entry);
+            entry.m_entries.insert(sub_entry->path, sub_entry);
             if (s_verboseDebug) {
                 qCDebug(KDIRWATCH) << "Added already watched Entry" << path << "(for" << sub_entry->path << ")";
             }
@@ -822,6 +1541,7 @@ void KDirWatchPrivate::addEntry(KDirWatch *instance, const QString &_path, Entry
     auto newIt = m_mapEntries.insert(path, Entry());
     // the insert does a copy, so we have to use <e> now
     Entry *e = &(*newIt);
+    m_entryIndex.insert(path, e);
 
     if (exists) {
         e->isDir = (stat_buf.st_mode & QT_STAT_MASK) == QT_STAT_DIR;
@@ -869,7 +1589,7 @@ void KDirWatchPrivate::addEntry(KDirWatch *instance, const QString &_path, Entry
 
     e->path = path;
     if (sub_entry) {
-        e->m_entries.append(sub_entry);
+        e->m_entries.insert(sub_entry->path, sub_entry);
     } else {
         e->addClient(instance, watchModes);
     }
@@ -887,6 +1607,14 @@ void KDirWatchPrivate::addEntry(KDirWatch *instance, const QString &_path, Entry
         return;
     }
 
+#if HAVE_FANOTIFY
+    if (exists && e->isDir && (watchModes & KDirWatch::WatchSubDirs) && m_preferredMethod == KDirWatch::FANotify
+        && (m_nfsPreferredMethod == m_preferredMethod || KFileSystemType::fileSystemType(e->path) != KFileSystemType::Nfs) && useFANotify(e)) {
+        // The mark covers the whole tree, no entries are needed for its contents
+        return;
+    }
+#endif
+
     if (exists && e->isDir && (watchModes != KDirWatch::WatchDirOnly)) {
         // recursive watch for folders
         QFlags<QDir::Filter> filters = QDir::NoDotAndDotDot;
@@ -900,7 +1628,7 @@ void KDirWatchPrivate::addEntry(KDirWatch *instance, const QString &_path, Entry
         }
 
 #if HAVE_SYS_INOTIFY_H
-        if (m_preferredMethod == KDirWatch::INotify) {
+        if (m_preferredMethod == KDirWatch::INotify || m_preferredMethod == KDirWatch::FANotify) {
             // qCDebug(KDIRWATCH) << "Ignoring WatchFiles directive - this is implicit with inotify";
             // Placing a watch on individual files is redundant with inotify
             // (inotify gives us WatchFiles functionality "for free") and indeed
@@ -933,6 +1661,13 @@ void KDirWatchPrivate::addWatch(Entry *e)
     // is fine, since the most common case is a NFS-mounted home, where all changes
     // are made locally. #177892.
 
+#if HAVE_FANOTIFY
+    // Watch again what a mark was covering, e.g. after the entry got recreated
+    if (e->m_mode == FANotifyMode && useFANotify(e)) {
+        return;
+    }
+#endif
+
     KDirWatch::Method preferredMethod = m_preferredMethod;
     if (m_nfsPreferredMethod != m_preferredMethod) {
         if (KFileSystemType::fileSystemType(e->path) == KFileSystemType::Nfs) {
@@ -946,6 +1681,8 @@ void KDirWatchPrivate::addWatch(Entry *e)
     switch (preferredMethod) {
 #if HAVE_SYS_INOTIFY_H
     case KDirWatch::INotify:
+    // fanotify is only used for recursive watches, see addEntry()
+    case KDirWatch::FANotify:
         entryAdded = useINotify(e);
         if (!entryAdded) {
             inotifyFailed = true;
@@ -953,6 +1690,7 @@ void KDirWatchPrivate::addWatch(Entry *e)
         break;
 #else
     case KDirWatch::INotify:
+    case KDirWatch::FANotify:
         entryAdded = false;
         break;
 #endif
@@ -973,7 +1711,7 @@ void KDirWatchPrivate::addWatch(Entry *e)
     // Failing that try in order INotify, QFSWatch, Stat
     if (!entryAdded) {
 #if HAVE_SYS_INOTIFY_H
-        if (preferredMethod != KDirWatch::INotify && useINotify(e)) {
+        if (preferredMethod != KDirWatch::INotify && preferredMethod != KDirWatch::FANotify && useINotify(e)) {
             return;
         }
 #endif
@@ -995,12 +1733,34 @@ void KDirWatchPrivate::removeWatch(Entry *e)
 #if HAVE_SYS_INOTIFY_H
     if (e->m_mode == INotifyMode) {
         m_inotify_wd_to_entry.remove(e->wd);
-        (void)inotify_rm_watch(m_inotify_fd, e->wd);
+        if (!m_useReaderThread) {
+            (void)inotify_rm_watch(m_inotify_fd, e->wd);
+        } else if (KDirWatchReader *reader = KDirWatchReader::self()) {
+            // Stays in the kernel while other threads watch it too
+            reader->removeINotifyWatch(this, e->wd);
+        }
         if (s_verboseDebug) {
             qCDebug(KDIRWATCH).nospace() << "Cancelled INotify (fd " << m_inotify_fd << ", " << e->wd << ") for " << e->path;
         }
     }
 #endif
+#if HAVE_FANOTIFY
+    if (e->m_mode == FANotifyMode && e->m_fanotifyMarked) {
+        e->m_fanotifyMarked = false;
+        m_fanotifyEntries.removeOne(e);
+
+        auto it = m_fanotifyFilesystems.find(e->m_fanotifyFsid);
+        if (it != m_fanotifyFilesystems.end() && --it->refCount == 0) {
+            (void)fanotify_mark(m_fanotify_fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, s_fanotifyMask, it->fd, nullptr);
+            QT_CLOSE(it->fd);
+            m_fanotifyFilesystems.erase(it);
+            m_fanotifyDirectories.clear();
+        }
+        if (s_verboseDebug) {
+            qCDebug(KDIRWATCH) << "Cancelled FANotify for" << e->path;
+        }
+    }
+#endif
 #if HAVE_QFILESYSTEMWATCHER
     if (e->m_mode == QFSWatchMode && fsWatcher) {
         if (s_verboseDebug) {
@@ -1026,7 +1786,7 @@ void KDirWatchPrivate::removeEntry(KDirWatch *instance, Entry *e, Entry *sub_ent
     removeList.remove(e);
 
     if (sub_entry) {
-        e->m_entries.removeAll(sub_entry);
+        e->m_entries.remove(sub_entry->path);
     } else {
         e->removeClient(instance);
     }
@@ -1046,6 +1806,12 @@ void KDirWatchPrivate::removeEntry(KDirWatch *instance, Entry *e, Entry *sub_ent
     } else {
         // Removed a NonExistent entry - we just remove it from the parent
         removeEntry(nullptr, e->parentDirectory(), e);
+#if HAVE_FANOTIFY
+        // The mark stays in place while the watched directory doesn't exist
+        if (e->m_mode == FANotifyMode) {
+            removeWatch(e);
+        }
+#endif
     }
 
     if (e->m_mode == StatMode) {
@@ -1064,6 +1830,7 @@ void KDirWatchPrivate::removeEntry(KDirWatch *instance, Entry *e, Entry *sub_ent
 #if HAVE_SYS_INOTIFY_H
     m_inotify_wd_to_entry.remove(e->wd);
 #endif
+    m_entryIndex.remove(p);
     m_mapEntries.remove(p); // <e> not valid any more
 }
 
@@ -1229,7 +1996,7 @@ int KDirWatchPrivate::scanEntry(Entry *e)
         return NoChange;
     }
 
-    if (e->m_mode == INotifyMode) {
+    if (e->m_mode == INotifyMode || e->m_mode == FANotifyMode) {
         // we know nothing has changed, no need to stat
         if (!e->dirty) {
             return NoChange;
@@ -1360,6 +2127,22 @@ void KDirWatchPrivate::emitEvent(Entry *e, int event, const QString &fileName)
             continue;
         }
 
+        auto batchIt = m_batches.find(c.instance);
+        if (batchIt != m_batches.end()) {
+            KDirWatch::ChangeTypes changes;
+            if (event & Deleted) {
+                changes |= KDirWatch::Deleted;
+            }
+            if (event & Created) {
+                changes |= KDirWatch::Created;
+            }
+            if (event & Changed) {
+                changes |= KDirWatch::Dirty;
+            }
+            addToBatch(*batchIt, path, changes);
+            continue;
+        }
+
         // Emit the signals delayed, to avoid unexpected re-entrance from the slots (#220153)
 
         if (event & Deleted) {
@@ -1405,6 +2188,70 @@ void KDirWatchPrivate::slotRemoveDelayed()
     }
 }
 
+/* Add <changes> of <path> to a batch, merging them with the earlier
+ * changes of the same path.
+ */
+void KDirWatchPrivate::addToBatch(Batch &batch, const QString &path, KDirWatch::ChangeTypes changes)
+{
+    if (batch.changes.isEmpty()) {
+        // The first change starts the batch
+        batch.deadline = QDeadlineTimer(batch.interval);
+        if (!m_batchTimer.isActive() || m_batchTimer.remainingTime() > batch.interval) {
+            m_batchTimer.start(batch.interval);
+        }
+    }
+
+    auto it = batch.positions.constFind(path);
+    if (it != batch.positions.constEnd()) {
+        batch.changes[it.value()].second |= changes;
+    } else {
+        batch.positions.insert(path, batch.changes.size());
+        batch.changes.append(qMakePair(path, changes));
+    }
+}
+
+void KDirWatchPrivate::flushBatch(KDirWatch *instance, Batch &batch)
+{
+    if (batch.changes.isEmpty()) {
+        return;
+    }
+
+    const QList<QPair<QString, KDirWatch::ChangeTypes>> changes = batch.changes;
+    batch.changes.clear();
+    batch.positions.clear();
+
+    // Emit the signal delayed, for the same reason as in emitEvent()
+    QMetaObject::invokeMethod(
+        instance,
+        [instance, changes]() {
+            Q_EMIT instance->changesBatched(changes);
+        },
+        Qt::QueuedConnection);
+}
+
+// Emit the batches which are due, and wait for the next one
+void KDirWatchPrivate::slotFlushBatches()
+{
+    qint64 nextDeadline = -1;
+    for (auto it = m_batches.begin(); it != m_batches.end(); ++it) {
+        Batch &batch = it.value();
+        if (batch.changes.isEmpty()) {
+            continue;
+        }
+
+        if (batch.deadline.hasExpired()) {
+            flushBatch(it.key(), batch);
+        } else {
+            const qint64 remaining = batch.deadline.remainingTime();
+            nextDeadline = nextDeadline < 0 ? remaining : qMin(nextDeadline, remaining);
+        }
+    }
+
+    if (nextDeadline >= 0) {
+        m_batchTimer.start(nextDeadline);
+    }
+}
+
 /* Scan all entries to be watched for changes. This is done regularly
  * when polling. inotify uses a single-shot timer to call this slot delayed.
  */
@@ -1441,7 +2288,7 @@ void KDirWatchPrivate::slotRescan()
         // propagate dirty flag to dependent entries (e.g. file watches)
         it = m_mapEntries.begin();
         for (; it != m_mapEntries.end(); ++it) {
-            if (((*it).m_mode == INotifyMode || (*it).m_mode == QFSWatchMode) && (*it).dirty) {
+            if (((*it).m_mode == INotifyMode || (*it).m_mode == FANotifyMode || (*it).m_mode == QFSWatchMode) && (*it).dirty) {
                 (*it).propagate_dirty();
             }
         }
@@ -1562,6 +2409,7 @@ void KDirWatchPrivate::ref(KDirWatch *watch)
 
 void KDirWatchPrivate::unref(KDirWatch *watch)
 {
+    m_batches.remove(watch);
     m_referencesObjects.removeOne(watch);
     if (m_referencesObjects.isEmpty()) {
         destroyPrivate();
@@ -1614,9 +2462,7 @@ void KDirWatchPrivate::fswEventReceived(const QString &path)
         qCDebug(KDIRWATCH) << path;
     }
 
-    auto it = m_mapEntries.find(path);
-    if (it != m_mapEntries.end()) {
-        Entry *entry = &it.value();
+    if (Entry *entry = m_entryIndex.value(path)) {
         entry->dirty = true;
         const int ev = scanEntry(entry);
         if (s_verboseDebug) {
@@ -1634,8 +2480,10 @@ void KDirWatchPrivate::fswEventReceived(const QString &path)
             // We were waiting for it to appear; now watch it
             addWatch(entry);
         } else if (entry->isDir) {
-            // Check if any file or dir was created under this directory, that we were waiting for
-            for (Entry *sub_entry : std::as_const(entry->m_entries)) {
+            // Check if any file or dir was created under this directory, that we were waiting for.
+            // Iterate over a copy, the recursion removes the entries which were created.
+            const QHash<QString, Entry *> subEntries = entry->m_entries;
+            for (Entry *sub_entry : subEntries) {
                 fswEventReceived(sub_entry->path); // recurse, to call scanEntry and see if something changed
             }
         } else {
@@ -1828,6 +2676,15 @@ KDirWatch::Method KDirWatch::internalMethod() const
         if (d->supports_inotify) {
             return KDirWatch::INotify;
         }
+#endif
+        break;
+    case KDirWatch::FANotify:
+#if HAVE_FANOTIFY
+        // Only recursive watches use fanotify, once a filesystem could be
+        // marked, anything else uses inotify
+        if (d->supports_fanotify && !d->m_fanotifyFilesystems.isEmpty()) {
+            return KDirWatch::FANotify;
+        }
 #endif
         break;
     case KDirWatch::QFSWatch:
@@ -1852,6 +2709,32 @@ KDirWatch::Method KDirWatch::internalMethod() const
 #endif
 }
 
+void KDirWatch::setBatchInterval(int msecs)
+{
+    if (!d) {
+        return;
+    }
+
+    auto it = d->m_batches.find(this);
+    if (msecs <= 0) {
+        if (it != d->m_batches.end()) {
+            d->flushBatch(this, it.value());
+            d->m_batches.erase(it);
+        }
+        return;
+    }
+
+    if (it == d->m_batches.end()) {
+        it = d->m_batches.insert(this, KDirWatchPrivate::Batch());
+    }
+    it->interval = msecs;
+}
+
+int KDirWatch::batchInterval() const
+{
+    return d ? d->m_batches.value(const_cast<KDirWatch *>(this)).interval : 0;
+}
+
 bool KDirWatch::event(QEvent *event)
 {
     if (Q_LIKELY(event->type() != QEvent::ThreadChange)) {
@@ -9,7 +9,9 @@
 #define _KDIRWATCH_H
 
 #include <QDateTime>
+#include <QList>
 #include <QObject>
+#include <QPair>
 #include <QString>
 
 #include <kcoreaddons_export.h>
@@ -48,7 +50,23 @@ class KDirWatchPrivate;
  * DirWatch/PollInterval and DirWatch/NFSPollInterval for NFS mounted
  * directories.
  * The choice of implementation can be adjusted by the user, with the key
- * [DirWatch] PreferredMethod={Stat|QFSWatch|inotify}
+ * [DirWatch] PreferredMethod={Stat|QFSWatch|inotify|FANotify}
+ *
+ * With FANotify, directories watched with WatchSubDirs are watched with a
+ * single fanotify mark on their filesystem instead of an inotify watch for
+ * every subdirectory, everything else is watched with inotify. Marking a
+ * filesystem needs the CAP_SYS_ADMIN capability, without it KDirWatch falls
+ * back to inotify.
+ *
+ * By default the inotify events are read by the thread which watches, as
+ * part of its event loop. When the environment variable
+ * KDIRWATCH_READER_THREAD is set to 1, a single thread reads them for every
+ * thread of the process instead, so that the events of a thread which is busy
+ * for a while are kept rather than overflowing the queue of the kernel. Up to
+ * 8 MiB of events are kept for each thread, beyond that the thread rescans
+ * everything it watches, as it does when the kernel queue overflows.
+ * The threads then share their inotify watches as well, a directory watched
+ * by several threads takes a single watch out of the max_user_watches limit.
  *
  */
 class KCOREADDONS_EXPORT KDirWatch : public QObject
@@ -71,6 +89,23 @@ public:
     };
     Q_DECLARE_FLAGS(WatchModes, WatchMode)
 
+    /*!
+     * The kinds of changes reported by changesBatched()
+     *
+     * \value Dirty The object changed, see dirty()
+     * \value Created The object was created, see created()
+     * \value Deleted The object was deleted, see deleted()
+     *
+     * \since 6.29
+     */
+    enum ChangeType {
+        Dirty = 0x01,
+        Created = 0x02,
+        Deleted = 0x04,
+    };
+    Q_DECLARE_FLAGS(ChangeTypes, ChangeType)
+    Q_FLAG(ChangeTypes)
+
     /*!
      * Constructor.
      *
@@ -222,18 +257,47 @@ public:
         \value INotify INotify
         \value Stat Stat
         \value QFSWatch QFileSystemWatcher
+        \value FANotify fanotify for recursive watches, inotify otherwise. Since 6.29
      */
     enum Method {
         INotify,
         Stat,
         QFSWatch,
+        FANotify,
     };
     /*!
      * Returns the preferred internal method to
      * watch for changes.
+     *
+     * FANotify is only returned while a recursive watch actually uses it.
      */
     Method internalMethod() const;
 
+    /*!
+     * Delivers the changes seen by this instance in batches, with
+     * changesBatched(), instead of one dirty(), created() or deleted() signal
+     * per change. This helps receivers keep up with bursts of changes, like
+     * those of a build or of a version control checkout.
+     *
+     * The changes of every path are merged during \a msecs milliseconds after
+     * the first change of a batch, after which the batch is emitted. Pending
+     * changes are emitted right away when batching is disabled again.
+     *
+     * \a msecs how long to collect changes before emitting them, 0 to stop
+     * batching, which is the default
+     *
+     * \since 6.29
+     */
+    void setBatchInterval(int msecs);
+
+    /*!
+     * Returns how long changes are collected before being emitted by
+     * changesBatched(), or 0 if they are not batched.
+     *
+     * \since 6.29
+     */
+    int batchInterval() const;
+
     /*!
      * The KDirWatch instance usually globally used in an application.
      * It is automatically deleted when the application exits.
@@ -313,6 +377,19 @@ Q_SIGNALS:
      */
     void deleted(const QString &path);
 
+    /*!
+     * Emitted instead of dirty(), created() and deleted() when batching was
+     * enabled with setBatchInterval().
+     *
+     * \a changes the paths which changed, in the order they first changed,
+     * each with everything which happened to it during the batch. For example
+     * a file which was deleted and created again is reported once, as
+     * \c {Deleted | Created}.
+     *
+     * \since 6.29
+     */
+    void changesBatched(const QList<QPair<QString, KDirWatch::ChangeTypes>> &changes);
+
 private:
     KDirWatchPrivate *d;
     friend class KDirWatchPrivate;
@@ -327,5 +404,6 @@ private:
 KCOREADDONS_EXPORT QDebug operator<<(QDebug debug, const KDirWatch &watch);
 
 Q_DECLARE_OPERATORS_FOR_FLAGS(KDirWatch::WatchModes)
+Q_DECLARE_OPERATORS_FOR_FLAGS(KDirWatch::ChangeTypes)
 
 #endif
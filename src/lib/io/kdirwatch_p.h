@@ -26,11 +26,15 @@
 #define HAVE_QFILESYSTEMWATCHER 0
 #endif
 
+#include <QDeadlineTimer>
+#include <QHash>
 #include <QList>
 #include <QMap>
+#include <QMutex>
 #include <QObject>
 #include <QSet>
 #include <QString>
+#include <QThread>
 #include <QTimer>
 class QSocketNotifier;
 
@@ -47,6 +51,94 @@ class QSocketNotifier;
 struct inotify_event;
 #endif
 
+#if HAVE_FANOTIFY
+struct fanotify_event_metadata;
+struct file_handle;
+#endif
+
+class KDirWatchPrivate;
+
+#if HAVE_SYS_INOTIFY_H
+/* Reads the inotify and fanotify events for the KDirWatchPrivate of every
+ * thread from a single thread of its own, when KDIRWATCH_READER_THREAD is set.
+ * The events pile up in memory until the thread they are for gets to process
+ * them, rather than in the kernel queue, which overflows after
+ * max_queued_events events while the thread is busy. Past s_maxQueuedBytes
+ * they are dropped for an overflow event, which has the thread rescan
+ * everything, like an overflow of the kernel queue.
+ *
+ * All threads share the inotify descriptor of the reader, which counts how
+ * many times every thread added each watch, so that a directory watched by
+ * several threads takes a single kernel watch. The events of each watch are
+ * passed on to the threads which added it.
+ */
+class KDirWatchReader : public QThread
+{
+public:
+    using Handler = void (KDirWatchPrivate::*)();
+
+    KDirWatchReader();
+    ~KDirWatchReader() override;
+
+    static KDirWatchReader *self();
+
+    // Starts reading the non-blocking descriptor <fd>, <handler> is called
+    // on <receiver> when there is something for takeData(). If too much
+    // piles up, it is dropped and replaced by <overflowEvent>.
+    void addDescriptor(int fd, KDirWatchPrivate *receiver, Handler handler, const QByteArray &overflowEvent);
+    // Once this returns, <fd> is not read any more and can be closed
+    void removeDescriptor(int fd);
+    // Returns everything read from <fd> since the last call
+    QByteArray takeData(int fd);
+
+    // Returns the shared inotify descriptor, or -1 if inotify can't be used.
+    // The inotifyEventReceived() slot of <receiver> is called when there are
+    // events for takeINotifyEvents().
+    int addINotifyReceiver(KDirWatchPrivate *receiver);
+    // Removes the watches <receiver> still has, and its pending events
+    void removeINotifyReceiver(KDirWatchPrivate *receiver);
+    // Same as inotify_add_watch() and inotify_rm_watch(), counting the watches
+    // of every receiver
+    int addINotifyWatch(KDirWatchPrivate *receiver, const QByteArray &path, uint mask);
+    void removeINotifyWatch(KDirWatchPrivate *receiver, int wd);
+    // Returns the events of the watches of <receiver> since the last call
+    QByteArray takeINotifyEvents(KDirWatchPrivate *receiver);
+
+protected:
+    void run() override;
+
+private:
+    struct Descriptor {
+        KDirWatchPrivate *receiver;
+        Handler handler;
+        QByteArray data;
+        // queued instead of data once too much piles up
+        QByteArray overflowEvent;
+        // whether the receiver was told about data it didn't take yet
+        bool notified;
+        // whether data was dropped since the receiver last took it
+        bool overflowed;
+    };
+
+    static QByteArray inotifyOverflowEvent();
+    void wakeUp();
+    void readINotifyEvents(QByteArray &buf);
+    static void queueData(Descriptor &descriptor, const char *data, qsizetype size);
+    static QByteArray takeData(Descriptor &descriptor);
+
+    QMutex m_mutex;
+    QHash<int, Descriptor> m_descriptors;
+    // a pipe, for poll() to notice changes of m_descriptors
+    int m_wakeUpFds[2];
+    bool m_quit;
+
+    int m_inotifyFd;
+    QHash<KDirWatchPrivate *, Descriptor> m_inotifyReceivers;
+    // how many times each receiver added every watch, by watch descriptor
+    QHash<int, QHash<KDirWatchPrivate *, int>> m_inotifyWatches;
+};
+#endif
+
 /* KDirWatchPrivate is a singleton and does the watching
  * for every KDirWatch instance in the application.
  */
@@ -63,6 +155,7 @@ public:
         StatMode,
         INotifyMode,
         QFSWatchMode,
+        FANotifyMode,
     };
     enum {
         NoChange = 0,
@@ -103,8 +196,8 @@ public:
         ~Entry();
         // instances interested in events
         std::vector<Client> m_clients;
-        // nonexistent entries of this directory
-        QList<Entry *> m_entries;
+        // nonexistent entries of this directory, by path
+        QHash<QString, Entry *> m_entries;
         QString path;
 
         // the last observed modification time
@@ -134,12 +227,7 @@ public:
 
         Entry *findSubEntry(const QString &path) const
         {
-            for (Entry *sub_entry : std::as_const(m_entries)) {
-                if (sub_entry->path == path) {
-                    return sub_entry;
-                }
-            }
-            return nullptr;
+            return m_entries.value(path);
         }
 
         bool dirty;
@@ -163,11 +251,29 @@ public:
         // that can be emitted and flushed at the next slotRescan(...).
         // This will be unused if the Entry is not a directory.
         QList<QString> m_pendingFileChanges;
+#endif
+#if HAVE_FANOTIFY
+        // Whether this recursive entry holds a reference on the fanotify mark
+        // of its filesystem, see useFANotify().
+        bool m_fanotifyMarked = false;
+        quint64 m_fanotifyFsid = 0;
+        // The canonical path, which is what the events are reported for
+        QString m_fanotifyPath;
 #endif
     };
 
     typedef QMap<QString, Entry> EntryMap;
 
+    // The changes collected for a KDirWatch instance which asked for them
+    // in batches, see KDirWatch::setBatchInterval().
+    struct Batch {
+        int interval = 0;
+        QList<QPair<QString, KDirWatch::ChangeTypes>> changes;
+        // The position of every path in changes
+        QHash<QString, qsizetype> positions;
+        QDeadlineTimer deadline;
+    };
+
     KDirWatchPrivate();
     ~KDirWatchPrivate() override;
 
@@ -188,6 +294,8 @@ public:
     Entry *entry(const QString &_path);
     int scanEntry(Entry *e);
     void emitEvent(Entry *e, int event, const QString &fileName = QString());
+    void addToBatch(Batch &batch, const QString &path, KDirWatch::ChangeTypes changes);
+    void flushBatch(KDirWatch *instance, Batch &batch);
 
     static bool isNoisyFile(const char *filename);
 
@@ -197,16 +305,27 @@ public:
 #if HAVE_SYS_INOTIFY_H
     QString inotifyEventName(const inotify_event *event) const;
 #endif
+#if HAVE_FANOTIFY
+    bool processFANotifyEvent(const fanotify_event_metadata *event);
+    QString fanotifyDirectory(quint64 fsid, const file_handle *handle);
+    void forgetFANotifyDirectories(const QString &path);
+#endif
 
 public Q_SLOTS:
     void slotRescan();
     void inotifyEventReceived(); // for inotify
+    void fanotifyEventReceived(); // for fanotify
     void slotRemoveDelayed();
+    void slotFlushBatches();
     void fswEventReceived(const QString &path); // for QFileSystemWatcher
 
 public:
     QTimer m_statRescanTimer;
+    // Owns the entries, which stay at the same address as long as they are
+    // watched, and keeps them sorted for rescans
     EntryMap m_mapEntries;
+    // The entries of m_mapEntries by path, for lookups while dispatching events
+    QHash<QString, Entry *> m_entryIndex;
 
     KDirWatch::Method m_preferredMethod, m_nfsPreferredMethod;
     int freq;
@@ -221,6 +340,12 @@ public:
     bool rescan_all;
     QTimer rescan_timer;
 
+    // whether the inotify and fanotify events are read by KDirWatchReader
+    bool m_useReaderThread;
+
+    QHash<KDirWatch *, Batch> m_batches;
+    QTimer m_batchTimer;
+
 #if HAVE_SYS_INOTIFY_H
     QSocketNotifier *mSn;
     bool supports_inotify;
@@ -229,6 +354,24 @@ public:
 
     bool useINotify(Entry *e);
 #endif
+#if HAVE_FANOTIFY
+    // A filesystem marked for fanotify, with a descriptor on it to resolve
+    // the file handles of the events.
+    struct FANotifyFilesystem {
+        int fd;
+        int refCount;
+    };
+
+    QSocketNotifier *mFanSn;
+    bool supports_fanotify;
+    int m_fanotify_fd;
+    QList<Entry *> m_fanotifyEntries;
+    QHash<quint64, FANotifyFilesystem> m_fanotifyFilesystems;
+    // Paths of the directories events were reported in, by file handle
+    QHash<QByteArray, QString> m_fanotifyDirectories;
+
+    bool useFANotify(Entry *e);
+#endif
 #if HAVE_QFILESYSTEMWATCHER
     QFileSystemWatcher *fsWatcher;
     bool useQFSWatch(Entry *e);